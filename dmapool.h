@@ -0,0 +1,194 @@
+#pragma once
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "mem.h"
+
+// a physically contiguous region which the controller can access.
+// it does not own the memory.
+class DmaBuffer {
+public:
+  DmaBuffer() = delete;
+  DmaBuffer(Memory &mem, size_t size) : _virt(mem.GetVirtPtr<uint8_t>()), _phys(mem.GetPhysPtr()), _size(size) {
+  }
+  DmaBuffer(uint8_t *virt, phys_addr phys, size_t size) : _virt(virt), _phys(phys), _size(size) {
+  }
+  template<class T>
+  T *GetVirtPtr() {
+    return reinterpret_cast<T *>(_virt);
+  }
+  phys_addr GetPhysPtr() {
+    return _phys;
+  }
+  size_t GetSize() {
+    return _size;
+  }
+private:
+  friend class DmaBufferPool;
+  uint8_t *_virt;
+  phys_addr _phys;
+  size_t _size;
+  // free list of the pool
+  DmaBuffer *_next = nullptr;
+  // size class in the pool (-1: not pooled)
+  int _class = -1;
+  Memory *_mem = nullptr;
+};
+
+// size-classed pool of DMA buffers for control transfers and other transient I/O.
+// buffers are carved from large chunks, so the physical address of each one is resolved only once.
+// each thread caches a few free buffers per size class, and the shared free lists are used beyond that.
+class DmaBufferPool {
+public:
+  static DmaBufferPool &GetInstance() {
+    static DmaBufferPool pool;
+    return pool;
+  }
+  // return: a buffer of at least size bytes.
+  // a buffer larger than the largest size class is allocated (and freed) directly.
+  DmaBuffer *Alloc(size_t size) {
+    int c = GetClass(size);
+    if (c < 0) {
+      Memory *mem = new Memory(size);
+      DmaBuffer *buf = new DmaBuffer(*mem, size);
+      buf->_mem = mem;
+      return buf;
+    }
+    ThreadCache &cache = GetThreadCache();
+    if (cache.num[c] == 0) {
+      Refill(c, cache);
+    }
+    return cache.buf[c][--cache.num[c]];
+  }
+  void Free(DmaBuffer *buf) {
+    if (buf->_class < 0) {
+      delete buf->_mem;
+      delete buf;
+      return;
+    }
+    int c = buf->_class;
+    ThreadCache &cache = GetThreadCache();
+    if (cache.num[c] == kThreadCacheSize) {
+      Flush(c, cache);
+    }
+    cache.buf[c][cache.num[c]++] = buf;
+  }
+private:
+  static const int kClassNum = 4;
+  // 64B, 256B, 1KB, 4KB
+  static size_t GetClassSize(int c) {
+    return 64 << (c * 2);
+  }
+  static int GetClass(size_t size) {
+    for (int c = 0; c < kClassNum; c++) {
+      if (size <= GetClassSize(c)) {
+        return c;
+      }
+    }
+    return -1;
+  }
+  static const size_t kChunkSize = 64 * 1024;
+  // a TRB buffer must not cross a 64KB boundary (see 6.4.1)
+  static const phys_addr kBoundary = 64 * 1024;
+  static const int kThreadCacheSize = 16;
+
+  struct ThreadCache {
+    DmaBuffer *buf[kClassNum][kThreadCacheSize];
+    int num[kClassNum];
+    // short-lived threads (e.g. probing a device) return their buffers when they exit
+    ~ThreadCache() {
+      GetInstance().FlushAll(*this);
+    }
+  };
+  static ThreadCache &GetThreadCache() {
+    static thread_local ThreadCache cache = {{{nullptr}}, {0}};
+    return cache;
+  }
+
+  DmaBufferPool() {
+    pthread_mutex_init(&_lock, NULL);
+    for (int c = 0; c < kClassNum; c++) {
+      _free[c] = nullptr;
+    }
+  }
+  // move half of the thread cache from the shared free list (carve a new chunk if empty)
+  void Refill(int c, ThreadCache &cache) {
+    pthread_mutex_lock(&_lock);
+    if (_free[c] == nullptr) {
+      Carve(c);
+    }
+    while(_free[c] != nullptr && cache.num[c] < kThreadCacheSize / 2) {
+      DmaBuffer *buf = _free[c];
+      _free[c] = buf->_next;
+      cache.buf[c][cache.num[c]++] = buf;
+    }
+    pthread_mutex_unlock(&_lock);
+    assert(cache.num[c] > 0);
+  }
+  // move half of the thread cache back to the shared free list
+  void Flush(int c, ThreadCache &cache) {
+    pthread_mutex_lock(&_lock);
+    while(cache.num[c] > kThreadCacheSize / 2) {
+      DmaBuffer *buf = cache.buf[c][--cache.num[c]];
+      buf->_next = _free[c];
+      _free[c] = buf;
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+  // move all buffers of the thread cache back to the shared free lists
+  void FlushAll(ThreadCache &cache) {
+    pthread_mutex_lock(&_lock);
+    for (int c = 0; c < kClassNum; c++) {
+      while(cache.num[c] > 0) {
+        DmaBuffer *buf = cache.buf[c][--cache.num[c]];
+        buf->_next = _free[c];
+        _free[c] = buf;
+      }
+    }
+    pthread_mutex_unlock(&_lock);
+  }
+  // called with _lock held
+  void Carve(int c) {
+    size_t size = GetClassSize(c);
+    Memory *mem = new Memory(kChunkSize);
+    uint8_t *virt = mem->GetVirtPtr<uint8_t>();
+    phys_addr phys = mem->GetPhysPtr();
+    for (size_t offset = 0; offset + size <= kChunkSize; offset += size) {
+      if ((phys + offset) / kBoundary != (phys + offset + size - 1) / kBoundary) {
+        continue;
+      }
+      DmaBuffer *buf = new DmaBuffer(virt + offset, phys + offset, size);
+      buf->_class = c;
+      buf->_next = _free[c];
+      _free[c] = buf;
+    }
+  }
+
+  pthread_mutex_t _lock;
+  DmaBuffer *_free[kClassNum];
+};
+
+// a buffer from DmaBufferPool, which is returned when it goes out of scope
+class ScopedDmaBuffer {
+public:
+  ScopedDmaBuffer() = delete;
+  ScopedDmaBuffer(const ScopedDmaBuffer &) = delete;
+  ScopedDmaBuffer(size_t size) : _buf(DmaBufferPool::GetInstance().Alloc(size)) {
+  }
+  ~ScopedDmaBuffer() {
+    DmaBufferPool::GetInstance().Free(_buf);
+  }
+  operator DmaBuffer &() {
+    return *_buf;
+  }
+  template<class T>
+  T *GetVirtPtr() {
+    return _buf->GetVirtPtr<T>();
+  }
+  phys_addr GetPhysPtr() {
+    return _buf->GetPhysPtr();
+  }
+private:
+  DmaBuffer * const _buf;
+};
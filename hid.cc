@@ -0,0 +1,357 @@
+#include "hid.h"
+
+static const UsbDeviceId kHidIds[] = {
+  {UsbDeviceId::kAny, UsbDeviceId::kAny, 3, UsbDeviceId::kAny, UsbDeviceId::kAny},
+};
+static const UsbDriver kHidDriver = {"hid", kHidIds, sizeof(kHidIds) / sizeof(kHidIds[0]), Hid::Probe};
+static UsbDriverRegistry::Registrar registrar(&kHidDriver);
+
+std::atomic<HidListener *> Hid::_listener{nullptr};
+
+ReturnState HidReportDecoder::Compile(const uint8_t *desc, int length) {
+  GlobalState global = {0, 0, 0, 0, 0, 0, 0};
+  GlobalState stack[kMaxGlobalStack];
+  int stack_depth = 0;
+  uint32_t usages[kMaxUsages];
+  int num_usages = 0;
+  uint32_t usage_min = 0;
+  uint32_t usage_max = 0;
+  bool usage_range = false;
+  // size of the input report of each report ID so far
+  uint32_t report_bits[kMaxReportIds];
+  for (int i = 0; i < kMaxReportIds; i++) {
+    report_bits[i] = 0;
+  }
+
+  for (int offset = 0; offset < length;) {
+    uint8_t prefix = desc[offset];
+    if (prefix == kLongItemPrefix) {
+      // long items are reserved (6.2.2.3)
+      if (offset + 1 >= length) {
+        return ReturnState::kErrInvalid;
+      }
+      offset += 3 + desc[offset + 1];
+      continue;
+    }
+    int size = ((prefix & 3) == 3) ? 4 : (prefix & 3);
+    if (offset + 1 + size > length) {
+      return ReturnState::kErrInvalid;
+    }
+    uint32_t data = 0;
+    for (int i = 0; i < size; i++) {
+      data |= static_cast<uint32_t>(desc[offset + 1 + i]) << (i * 8);
+    }
+    // data of signed items (e.g. Logical Minimum) is sign extended
+    int32_t signed_data = (size == 0 || size == 4) ? static_cast<int32_t>(data) : static_cast<int32_t>(data << (32 - size * 8)) >> (32 - size * 8);
+    ItemType type = static_cast<ItemType>((prefix >> 2) & 3);
+    uint8_t tag = prefix >> 4;
+    offset += 1 + size;
+
+    switch(type) {
+    case ItemType::kMain: {
+      if (static_cast<MainItemTag>(tag) == MainItemTag::kInput) {
+        uint32_t &bits = report_bits[global.report_id];
+        if (bits + static_cast<uint64_t>(global.report_size) * global.report_count > 0xFFFF - kPadding * 8) {
+          return ReturnState::kErrInvalid;
+        }
+        if (IsFlagClear(data, kMainItemFlagConstant) && global.report_size >= 1 && global.report_size <= kMaxFieldSize) {
+          bool variable = IsFlagSet(data, kMainItemFlagVariable);
+          for (uint32_t i = 0; i < global.report_count; i++) {
+            uint32_t usage = 0;
+            if (variable && i < static_cast<uint32_t>(num_usages)) {
+              usage = usages[i];
+            } else if (usage_range) {
+              // each entry of an array selects one of the range
+              usage = variable ? usage_min + (i - num_usages) : usage_min;
+              if (usage > usage_max) {
+                usage = usage_max;
+              }
+            } else if (num_usages > 0) {
+              usage = usages[variable ? num_usages - 1 : 0];
+            }
+            Field field;
+            field.report_id = global.report_id;
+            field.bit_size = global.report_size;
+            field.bit_offset = bits + i * global.report_size;
+            // an extended usage has its usage page in the upper 16 bits (6.2.2.8)
+            field.usage_page = ((usage >> 16) != 0) ? (usage >> 16) : global.usage_page;
+            field.usage = usage & 0xFFFF;
+            field.logical_min = global.logical_min;
+            // both extents are unsigned unless Logical Minimum is negative
+            field.logical_max = global.logical_max;
+            if (global.logical_min >= 0 && global.logical_max < 0) {
+              field.logical_max = (global.logical_max_data > INT32_MAX) ? INT32_MAX : static_cast<int32_t>(global.logical_max_data);
+            }
+            if (field.logical_max < field.logical_min) {
+              // Logical Maximum is missing. no entry is left out.
+              field.logical_max = INT32_MAX;
+            }
+            field.array = variable ? 0 : 1;
+            field.mask = (static_cast<uint64_t>(1) << global.report_size) - 1;
+            field.sign_bit = (global.logical_min < 0) ? (static_cast<uint64_t>(1) << (global.report_size - 1)) : 0;
+            AddField(field);
+          }
+        }
+        bits += global.report_size * global.report_count;
+      }
+      // output and feature reports are not decoded. local items are only valid for the main item.
+      num_usages = 0;
+      usage_range = false;
+      break;
+    }
+    case ItemType::kGlobal: {
+      switch(static_cast<GlobalItemTag>(tag)) {
+      case GlobalItemTag::kUsagePage: {
+        global.usage_page = data;
+        break;
+      }
+      case GlobalItemTag::kLogicalMinimum: {
+        global.logical_min = signed_data;
+        break;
+      }
+      case GlobalItemTag::kLogicalMaximum: {
+        global.logical_max_data = data;
+        global.logical_max = signed_data;
+        break;
+      }
+      case GlobalItemTag::kReportSize: {
+        global.report_size = data;
+        break;
+      }
+      case GlobalItemTag::kReportId: {
+        if (data == 0 || data >= kMaxReportIds) {
+          return ReturnState::kErrInvalid;
+        }
+        global.report_id = data;
+        _has_report_id = true;
+        if (report_bits[data] == 0) {
+          // the report ID occupies the first byte
+          report_bits[data] = 8;
+        }
+        break;
+      }
+      case GlobalItemTag::kReportCount: {
+        global.report_count = data;
+        break;
+      }
+      case GlobalItemTag::kPush: {
+        if (stack_depth == kMaxGlobalStack) {
+          return ReturnState::kErrInvalid;
+        }
+        stack[stack_depth++] = global;
+        break;
+      }
+      case GlobalItemTag::kPop: {
+        if (stack_depth == 0) {
+          return ReturnState::kErrInvalid;
+        }
+        global = stack[--stack_depth];
+        break;
+      }
+      default: {
+        // physical extents and units do not change the layout
+        break;
+      }
+      }
+      break;
+    }
+    case ItemType::kLocal: {
+      switch(static_cast<LocalItemTag>(tag)) {
+      case LocalItemTag::kUsage: {
+        if (num_usages < kMaxUsages) {
+          usages[num_usages++] = data;
+        }
+        break;
+      }
+      case LocalItemTag::kUsageMinimum: {
+        usage_min = data;
+        usage_range = true;
+        break;
+      }
+      case LocalItemTag::kUsageMaximum: {
+        usage_max = data;
+        break;
+      }
+      default: {
+        break;
+      }
+      }
+      break;
+    }
+    default: {
+      // reserved
+      break;
+    }
+    }
+  }
+
+  // group the fields by report ID (stable, so that the fields keep the order of the descriptor)
+  for (int i = 1; i < _num_fields; i++) {
+    Field field = _fields[i];
+    int j = i;
+    for (; j > 0 && _fields[j - 1].report_id > field.report_id; j--) {
+      _fields[j] = _fields[j - 1];
+    }
+    _fields[j] = field;
+  }
+  for (int i = 0; i < kMaxReportIds; i++) {
+    _first[i] = 0;
+    _num[i] = 0;
+    _report_length[i] = (report_bits[i] + 7) / 8;
+    if (_report_length[i] > _max_report_length) {
+      _max_report_length = _report_length[i];
+    }
+  }
+  for (int i = 0; i < _num_fields; i++) {
+    uint8_t report_id = _fields[i].report_id;
+    if (_num[report_id] == 0) {
+      _first[report_id] = i;
+    }
+    _num[report_id]++;
+    if (_num[report_id] > _max_value_num) {
+      _max_value_num = _num[report_id];
+    }
+  }
+  return ReturnState::kSuccess;
+}
+
+void HidReportDecoder::AddField(const Field &field) {
+  if (_num_fields == _capacity) {
+    _capacity = (_capacity == 0) ? 16 : _capacity * 2;
+    Field *fields = new Field[_capacity];
+    for (int i = 0; i < _num_fields; i++) {
+      fields[i] = _fields[i];
+    }
+    delete[] _fields;
+    _fields = fields;
+  }
+  _fields[_num_fields++] = field;
+}
+
+int HidReportDecoder::Decode(const uint8_t *report, int length, uint8_t &report_id, HidValue *values) {
+  report_id = _has_report_id ? report[0] : 0;
+  if (length < _report_length[report_id]) {
+    return 0;
+  }
+  const Field *field = &_fields[_first[report_id]];
+  int num = _num[report_id];
+  int num_values = 0;
+  for (int i = 0; i < num; i++, field++) {
+    // reports are little endian (5.8), and so is the host
+    uint64_t word;
+    memcpy(&word, report + (field->bit_offset >> 3), sizeof(word));
+    uint64_t raw = (word >> (field->bit_offset & 7)) & field->mask;
+    // sign extension without branches (sign_bit is 0 for unsigned fields)
+    int32_t value = static_cast<int32_t>(static_cast<int64_t>(raw ^ field->sign_bit) - static_cast<int64_t>(field->sign_bit));
+    values[num_values].usage_page = field->usage_page;
+    values[num_values].usage = field->usage + field->array * (value - field->logical_min);
+    values[num_values].value = value + field->array * (1 - value);
+    // the entry is overwritten by the next one if an array entry is out of range
+    bool out_of_range = (value < field->logical_min) | (value > field->logical_max);
+    num_values += 1 - (field->array & static_cast<int32_t>(out_of_range));
+  }
+  return num_values;
+}
+
+DevUsb *Hid::Probe(UsbDevice *device, DescriptorIndex::Interface *interface) {
+  UsbCtrl::InterfaceDescriptor *interface_desc = interface->desc;
+  if (interface_desc->subclass_code == kSubclassBoot && interface_desc->protocol_code == kProtocolKeyboard) {
+    // boot keyboards are handled by Keyboard
+    return nullptr;
+  }
+  HidDescriptor *hid_desc = reinterpret_cast<HidDescriptor *>(device->GetDescriptorIndex().FindClassDescriptor(*interface, kHidDescriptorType));
+  if (hid_desc == nullptr || hid_desc->report_descriptor_type != kReportDescriptorType) {
+    printf("hid: error: no report descriptor\n");
+    return nullptr;
+  }
+  Hid *dev = new Hid(device, interface);
+  if (dev->InitSub(hid_desc) != ReturnState::kSuccess) {
+    delete dev;
+    return nullptr;
+  }
+  return dev;
+}
+
+ReturnState Hid::InitSub(HidDescriptor *hid_desc) {
+  uint8_t interface_number = GetInterface().desc->interface_number;
+  do {
+    // Get_Descriptor of the report descriptor
+    // see HID1_11 7.1.1 Get_Descriptor Request
+
+    int length = hid_desc->report_descriptor_length;
+    ScopedDmaBuffer mem(length);
+    UsbCtrl::DeviceRequest request;
+    request.MakePacket(0b10000001, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetDescriptor), (kReportDescriptorType << 8) + 0, interface_number, length);
+    assert(SendControlTransfer(request, mem, length));
+    if (_decoder.Compile(mem.GetVirtPtr<uint8_t>(), length) != ReturnState::kSuccess) {
+      printf("hid: error: malformed report descriptor\n");
+      return ReturnState::kErrInvalid;
+    }
+  } while(0);
+
+  UsbCtrl::EndpointDescriptor *ed = nullptr;
+  for (int i = 0; i < GetInterface().num_endpoints; i++) {
+    UsbCtrl::EndpointDescriptor *desc = GetEndpoint(i).desc;
+    if (desc->GetTransferType() == UsbCtrl::TransferType::kInterrupt && desc->GetDirection() == UsbCtrl::PacketIdentification::kIn) {
+      ed = desc;
+      break;
+    }
+  }
+  if (ed == nullptr) {
+    printf("hid: error: no interrupt IN endpoint\n");
+    return ReturnState::kErrInvalid;
+  }
+  if (_decoder.GetMaxReportLength() > ed->GetMaxPacketSize()) {
+    printf("hid: error: reports longer than a packet are not supported\n");
+    return ReturnState::kErrInvalid;
+  }
+
+  if (GetInterface().desc->subclass_code == kSubclassBoot) {
+    // Set Protocol
+    // boot devices may be left in boot protocol. see HID1_11 7.2.6 Set_Protocol Request
+
+    ScopedDmaBuffer mem(0);
+    UsbCtrl::DeviceRequest request;
+    request.MakePacket(0b00100001, kRequestSetProtocol, 1, interface_number, 0);
+    assert(SendControlTransfer(request, mem, 0));
+  }
+
+  if (SetupEndpoint(ed->GetEndpointNumber(), ed->GetInterval(), UsbCtrl::TransferType::kInterrupt, ed->GetDirection(), ed->GetMaxPacketSize(), &_buf) != ReturnState::kSuccess) {
+    printf("hid: error: failed to init endpoint\n");
+    return ReturnState::kErrInvalid;
+  }
+  printf("hid: info: attached (%04x:%04x, %d fields)\n", GetDeviceDescriptor().vendor_id, GetDeviceDescriptor().product_id, _decoder.GetFieldNum());
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, Handle, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  return ReturnState::kSuccess;
+}
+
+void Hid::HandleSub() {
+  int max_length = _decoder.GetMaxReportLength();
+  uint8_t *report = new uint8_t[max_length + HidReportDecoder::kPadding]();
+  HidValue *values = new HidValue[_decoder.GetMaxValueNum()];
+  InTransferLease leases[16];
+  while(true) {
+    int num = _buf.PopBatch(leases, sizeof(leases) / sizeof(leases[0]));
+    for (int i = 0; i < num; i++) {
+      // the packet is copied to the padded buffer, so that the lease is returned right away
+      int length = leases[i].GetLength();
+      if (length > max_length) {
+        length = max_length;
+      }
+      memcpy(report, leases[i].GetData(), length);
+      leases[i].Release();
+
+      uint8_t report_id;
+      int num_values = _decoder.Decode(report, length, report_id, values);
+      HidListener *listener = _listener.load(std::memory_order_acquire);
+      if (num_values != 0 && listener != nullptr) {
+        listener->OnReport(this, report_id, values, num_values);
+      }
+    }
+  }
+}
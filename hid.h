@@ -0,0 +1,196 @@
+// reference: Device Class Definition for Human Interface Devices (HID) Version 1.11
+//            HID Usage Tables Version 1.12
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "ringbuffer.h"
+#include "usb.h"
+
+// a value of an input report and its usage (5.5)
+struct HidValue {
+  uint16_t usage_page;
+  uint16_t usage;
+  int32_t value;
+};
+
+// the report descriptor compiled into a flat table of the input fields.
+// decoding a report never interprets the descriptor, so that it keeps up with report rates of several kHz.
+class HidReportDecoder {
+public:
+  // reports passed to Decode() should be followed by kPadding readable bytes
+  static const int kPadding = 8;
+
+  HidReportDecoder() {
+  }
+  ~HidReportDecoder() {
+    delete[] _fields;
+  }
+  // return: kErrInvalid if the descriptor is malformed
+  ReturnState Compile(const uint8_t *desc, int length);
+  // whether reports are prefixed with the report ID
+  bool HasReportId() {
+    return _has_report_id;
+  }
+  // in bytes, including the report ID
+  int GetMaxReportLength() {
+    return _max_report_length;
+  }
+  // max number of values of a report
+  int GetMaxValueNum() {
+    return _max_value_num;
+  }
+  int GetFieldNum() {
+    return _num_fields;
+  }
+  // values: should have GetMaxValueNum() entries
+  // return: number of the decoded values (0 if the report is unknown or too short)
+  // a value of an array field (e.g. keys of a keyboard) is reported as its selected usage with the value 1.
+  // array entries outside the logical range select nothing (6.2.2.5), and are left out.
+  int Decode(const uint8_t *report, int length, uint8_t &report_id, HidValue *values);
+private:
+  // a bit field of input reports (6.2.2.5)
+  struct Field {
+    uint8_t report_id;
+    uint8_t bit_size;
+    uint16_t bit_offset;
+    uint16_t usage_page;
+    // usage of the logical minimum for array fields
+    uint16_t usage;
+    int32_t logical_min;
+    int32_t logical_max;
+    // 1 if the field is an array, otherwise 0
+    int32_t array;
+    uint64_t mask;
+    // the sign bit of the field (0 if unsigned)
+    uint64_t sign_bit;
+  };
+
+  // 6.2.2.2 Short Items
+  enum class ItemType : uint8_t {
+    kMain = 0,
+    kGlobal = 1,
+    kLocal = 2,
+  };
+  // 6.2.2.4 Main Items
+  enum class MainItemTag : uint8_t {
+    kInput = 8,
+    kOutput = 9,
+    kCollection = 0xA,
+    kFeature = 0xB,
+    kEndCollection = 0xC,
+  };
+  // 6.2.2.7 Global Items
+  enum class GlobalItemTag : uint8_t {
+    kUsagePage = 0,
+    kLogicalMinimum = 1,
+    kLogicalMaximum = 2,
+    kReportSize = 7,
+    kReportId = 8,
+    kReportCount = 9,
+    kPush = 0xA,
+    kPop = 0xB,
+  };
+  // 6.2.2.8 Local Items
+  enum class LocalItemTag : uint8_t {
+    kUsage = 0,
+    kUsageMinimum = 1,
+    kUsageMaximum = 2,
+  };
+  static const uint8_t kLongItemPrefix = 0xFE;
+  // Input item data (6.2.2.5)
+  static const uint32_t kMainItemFlagConstant = 1 << 0;
+  static const uint32_t kMainItemFlagVariable = 1 << 1;
+
+  struct GlobalState {
+    uint16_t usage_page;
+    int32_t logical_min;
+    // the data of Logical Maximum. whether it is signed depends on Logical Minimum (6.2.2.7)
+    uint32_t logical_max_data;
+    int32_t logical_max;
+    uint32_t report_size;
+    uint32_t report_count;
+    uint8_t report_id;
+  };
+  static const int kMaxGlobalStack = 4;
+  // usages of a main item. extended usages (with the usage page) are kept as is.
+  static const int kMaxUsages = 64;
+  static const int kMaxReportIds = 256;
+  // Report Size of a field which can be extracted at once
+  static const uint32_t kMaxFieldSize = 32;
+
+  void AddField(const Field &field);
+
+  Field *_fields = nullptr;
+  int _num_fields = 0;
+  int _capacity = 0;
+  // fields of each report ID are contiguous in _fields
+  uint16_t _first[kMaxReportIds];
+  uint16_t _num[kMaxReportIds];
+  // in bytes, including the report ID
+  uint16_t _report_length[kMaxReportIds];
+  bool _has_report_id = false;
+  int _max_report_length = 0;
+  int _max_value_num = 0;
+};
+
+class Hid;
+
+// receives decoded input reports of HID devices
+class HidListener {
+public:
+  // called on the thread of the device for each report, so it should not block.
+  virtual void OnReport(Hid *hid, uint8_t report_id, const HidValue *values, int num) = 0;
+};
+
+// generic HID class driver for report protocol devices (e.g. mice, gamepads and vendor devices).
+// boot keyboards are left to Keyboard.
+class Hid : public DevUsb {
+public:
+  Hid() = delete;
+  Hid(UsbDevice *device, DescriptorIndex::Interface *interface) : DevUsb(device, interface), _buf(kLeaseNum) {
+  }
+  static DevUsb *Probe(UsbDevice *device, DescriptorIndex::Interface *interface);
+  // applies to all HID devices
+  static void SetListener(HidListener *listener) {
+    _listener.store(listener, std::memory_order_release);
+  }
+  virtual void Release() override {
+    printf("hid: info: detached\n");
+  }
+private:
+  // Table 7: Class Descriptor Types
+  static const uint8_t kHidDescriptorType = 0x21;
+  static const uint8_t kReportDescriptorType = 0x22;
+  // 7.2 Class-Specific Requests
+  static const uint8_t kRequestSetProtocol = 0x0B;
+  static const uint8_t kSubclassBoot = 1;
+  static const uint8_t kProtocolKeyboard = 1;
+  static const int kLeaseNum = 64;
+
+  // 6.2.1 HID Descriptor
+  class HidDescriptor {
+  public:
+    uint8_t length;
+    uint8_t type;
+    uint16_t hid_release_number;
+    uint8_t country_code;
+    uint8_t num_descriptors;
+    uint8_t report_descriptor_type;
+    uint16_t report_descriptor_length;
+  } __attribute__((__packed__));
+  static_assert(sizeof(HidDescriptor) == 9, "");
+
+  static std::atomic<HidListener *> _listener;
+
+  HidReportDecoder _decoder;
+  SpscRingBuffer<InTransferLease> _buf;
+
+  ReturnState InitSub(HidDescriptor *hid_desc);
+  static void *Handle(void *arg) {
+    reinterpret_cast<Hid *>(arg)->HandleSub();
+    return nullptr;
+  }
+  void HandleSub();
+};
@@ -1,110 +1,410 @@
 #include "hub.h"
 
-Hub *Hub::Init(DevUsbController *hc, int addr) {
-  Hub *dev = new Hub(hc, addr);
-  dev->LoadDeviceDescriptor();
-  dev->LoadCombinedDescriptors();
-  UsbCtrl::InterfaceDescriptor *interface_desc = dev->GetInterfaceDescriptorInCombinedDescriptors(0);
-  if (interface_desc->class_code == 9 && interface_desc->subclass_code == 0 && interface_desc->protocol_code == 0) {
+static const UsbDeviceId kHubIds[] = {
+  // bInterfaceClass of hubs (11.23.1 of USB 2.0 spec)
+  {UsbDeviceId::kAny, UsbDeviceId::kAny, 9, 0, UsbDeviceId::kAny},
+};
+static const UsbDriver kHubDriver = {"hub", kHubIds, sizeof(kHubIds) / sizeof(kHubIds[0]), Hub::Probe};
+static UsbDriverRegistry::Registrar registrar(&kHubDriver);
+
+DevUsb *Hub::Probe(UsbDevice *device, DescriptorIndex::Interface *interface) {
+  UsbCtrl::InterfaceDescriptor *interface_desc = interface->desc;
+  // the type of the hub is told by bDeviceProtocol. bInterfaceProtocol of the default interface is 0
+  // for superspeed hubs as well as full-speed ones, and 1 for both single and multi TT hubs.
+  Protocol protocol = static_cast<Protocol>(device->GetDeviceDescriptor().protocol_code);
+  if (protocol > Protocol::kSuperSpeed) {
+    printf("hub: error: unknown hub protocol (%d)\n", static_cast<int>(protocol));
+    return nullptr;
+  }
+  Hub *dev = new Hub(device, interface);
+  switch(protocol) {
+  case Protocol::kFullSpeed: {
     printf("hub: info: full-/low-speed hub attached\n");
-    dev->InitSub();
-    return dev;
+    break;
+  }
+  case Protocol::kSingleTt: {
+    printf("hub: info: high-speed hub (single TT) attached\n");
+    break;
+  }
+  case Protocol::kMultiTt: {
+    // the multiple TT interface is the alternate setting 1 (11.23.1 of USB 2.0 spec)
+    DescriptorIndex::Interface *mtt_interface = dev->GetDescriptorIndex().FindInterface(interface_desc->interface_number, 1);
+    if (mtt_interface != nullptr && static_cast<Protocol>(mtt_interface->desc->protocol_code) == Protocol::kMultiTt) {
+      dev->_multi_tt_interface = mtt_interface->desc;
+    }
+    printf("hub: info: high-speed hub (%s) attached\n", dev->_multi_tt_interface != nullptr ? "multi-TT" : "single TT");
+    break;
+  }
+  case Protocol::kSuperSpeed: {
+    dev->_superspeed = true;
+    printf("hub: info: superspeed hub attached\n");
+    break;
   }
-  delete dev;
-  return nullptr;
+  }
+  dev->InitSub();
+  return dev;
 }
 
 void Hub::InitSub() {
+  int power_good_delay;
+  int ttt;
   do {
     // Get Hub Descriptor
     
-    Memory mem(sizeof(HubDescriptor));
+    // the superspeed hub descriptor shares the leading fields with the hub descriptor
+    uint8_t type = _superspeed ? kSuperSpeedHubDescriptorType : kHubDescriptorType;
+    ScopedDmaBuffer mem(sizeof(HubDescriptor));
     UsbCtrl::DeviceRequest request;
-    request.MakePacket(0b10100000, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetDescriptor), (0x29 << 8) + 0, 0, sizeof(HubDescriptor));
+    request.MakePacket(0b10100000, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetDescriptor), (type << 8) + 0, 0, sizeof(HubDescriptor));
     assert(SendControlTransfer(request, mem, sizeof(HubDescriptor)));
 
-    _desc = mem.GetVirtPtr<HubDescriptor>();
-
-    InitHub(_desc->num_of_ports, MaskValue<HubDescriptor::TtThinkTime>(_desc->characteristics));
+    // the buffer is returned to the pool, so keep a copy
+    memcpy(&_desc, mem.GetVirtPtr<HubDescriptor>(), sizeof(HubDescriptor));
+    _num_of_ports = _desc.num_of_ports;
+    // in 2 ms intervals
+    power_good_delay = _desc.power_on_to_power_good * 2000;
+    // TT think time is reserved except for high-speed hubs
+    ttt = MaskValue<HubDescriptor::TtThinkTime>(_desc.characteristics);
   } while(0);
-  do {
-    // Set Configuration
+  SetConfiguration();
+  if (_multi_tt_interface != nullptr) {
+    // Set Interface
+    // select the multiple TT interface, so that each port has its own TT
     
-    Memory mem(0);
+    ScopedDmaBuffer mem(0);
     UsbCtrl::DeviceRequest request;
-    request.MakePacket(0b00000000, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetConfiguration), GetConfigurationDescriptorInCombinedDescriptors()->configuration_value, 0, 0);
+    request.MakePacket(0b00000001, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetInterface), _multi_tt_interface->alternate_setting, _multi_tt_interface->interface_number, 0);
     assert(SendControlTransfer(request, mem, 0));
-  } while(0);
+  }
+  if (_superspeed) {
+    // Set Hub Depth
+    // see 10.16.2.9 of USB 3.2 spec. the hub uses it to find its tier in route strings.
+    
+    ScopedDmaBuffer mem(0);
+    UsbCtrl::DeviceRequest request;
+    request.MakePacket(0b00100000, static_cast<uint8_t>(HubClassRequestCode::kSetHubDepth), GetHubDepth(), 0, 0);
+    assert(SendControlTransfer(request, mem, 0));
+  }
+  InitHub(_num_of_ports, ttt, _multi_tt_interface != nullptr);
   do {
     // Get Hub Status
     
-    Memory mem(4);
+    ScopedDmaBuffer mem(4);
     UsbCtrl::DeviceRequest request;
     request.MakePacket(0b10100000, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetStatus), 0, 0, 4);
     assert(SendControlTransfer(request, mem, 4));
     assert((mem.GetVirtPtr<uint16_t>()[0] & HubStatus::kFlagLocalPowerSource) == 0);
   } while(0);
 
-  UsbCtrl::EndpointDescriptor *ed0 = GetEndpointDescriptorInCombinedDescriptors(0);
+  UsbCtrl::EndpointDescriptor *ed0 = GetEndpoint(0).desc;
   assert(ed0->GetTransferType() == UsbCtrl::TransferType::kInterrupt);
   assert(ed0->GetDirection() == UsbCtrl::PacketIdentification::kIn);
 
-  RingBuffer<uint8_t *> buf(64);
-  if (SetupEndpoint(ed0->GetEndpointNumber(), ed0->GetInterval(), UsbCtrl::TransferType::kInterrupt, ed0->GetDirection(), ed0->GetMaxPacketSize(), &buf) != ReturnState::kSuccess) {
+  // bit 0 is the hub itself, bit N is port N
+  _bitmap_size = (_num_of_ports + 1 + 7) / 8;
+  assert(ed0->GetMaxPacketSize() >= _bitmap_size);
+  if (SetupEndpoint(ed0->GetEndpointNumber(), ed0->GetInterval(), UsbCtrl::TransferType::kInterrupt, ed0->GetDirection(), ed0->GetMaxPacketSize(), &_buf) != ReturnState::kSuccess) {
     printf("hub: error: failed to init endpoint\n");
     return;
   }
 
-  for (int i = 1; i <= _desc->num_of_ports; i++) {
-    SetPortFeature(i, HubClassFeatureSelector::kPortPower);
-    usleep(_desc->power_on_to_power_good * 2000);
-    if (GetPortStatus(i) & PortStatus::kFlagCurrentConnectStatus) {
+  _attached = new bool[_num_of_ports + 1];
+  for (int i = 0; i <= _num_of_ports; i++) {
+    _attached[i] = false;
+  }
+
+  // power on all ports, and wait for the power to be good only once
+  for (int i = 1; i <= _num_of_ports; i++) {
+    if (SetPortFeature(i, HubClassFeatureSelector::kPortPower) != ReturnState::kSuccess) {
+      printf("hub: error: failed to power on port %d\n", i);
+    }
+  }
+  usleep(power_good_delay);
+
+  // num_of_ports is at most 255
+  bool resetting[256];
+  pthread_mutex_lock(&_port_lock);
+  for (int i = 1; i <= _num_of_ports; i++) {
+    uint16_t status, change;
+    resetting[i] = GetPortStatus(i, status, change) == ReturnState::kSuccess && (status & PortStatus::kFlagCurrentConnectStatus) != 0;
+    if (resetting[i]) {
+      // a failure is noticed by the reset
       ClearPortFeature(i, HubClassFeatureSelector::kChangePortConnection);
       printf("hub: info: new present port\n");
-      SetPortFeature(i, HubClassFeatureSelector::kPortReset);
-      usleep(10 * 1000);
-      uint16_t status = GetPortStatus(i);
-      assert((status & PortStatus::kFlagPortEnabled) != 0);
-      assert((status & PortStatus::kFlagReset) == 0);
-      ClearPortFeature(i, HubClassFeatureSelector::kChangePortReset);
-      if (AttachDeviceToHostController(i) == nullptr) {
-        printf("hub: error: failed to attach device\n");
+    }
+  }
+  ResetAndAttach(resetting);
+  pthread_mutex_unlock(&_port_lock);
+
+  // later changes are notified through the interrupt endpoint
+  if (pthread_create(&_thread, NULL, Handle, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  _thread_started = true;
+}
+
+void Hub::ResetAndAttach(bool *resetting) {
+  // a device answers to the default address from the end of its reset until it is addressed,
+  // so the ports are reset one by one, each with the default address of the bus held.
+  // hubs below other root ports are on other buses, and proceed in parallel.
+  for (int i = 1; i <= _num_of_ports; i++) {
+    if (!resetting[i]) {
+      continue;
+    }
+    resetting[i] = false;
+    LockDefaultAddress();
+    if (ResetPort(i) != ReturnState::kSuccess) {
+      UnlockDefaultAddress();
+      continue;
+    }
+    // the enumeration proceeds in the background, and releases the default address once the device is addressed
+    if (AttachDeviceToHostController(i) != ReturnState::kSuccess) {
+      printf("hub: error: failed to attach device\n");
+      UnlockDefaultAddress();
+      continue;
+    }
+    _attached[i] = true;
+  }
+}
+
+ReturnState Hub::ResetPort(int port_id) {
+  if (SetPortFeature(port_id, HubClassFeatureSelector::kPortReset) != ReturnState::kSuccess) {
+    printf("hub: error: failed to reset port %d\n", port_id);
+    return ReturnState::kErrUnknown;
+  }
+  // a reset lasts 10ms at least (7.1.7.5)
+  usleep(10 * 1000);
+  for (int retry = 0;; retry++) {
+    if (retry == kResetTimeout) {
+      printf("hub: error: port reset timed out\n");
+      return ReturnState::kErrUnknown;
+    }
+    uint16_t status, change;
+    if (GetPortStatus(port_id, status, change) != ReturnState::kSuccess) {
+      printf("hub: error: failed to get status of port %d\n", port_id);
+      return ReturnState::kErrUnknown;
+    }
+    if ((change & PortChange::kFlagReset) != 0) {
+      RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortReset));
+      if ((status & PortStatus::kFlagPortEnabled) == 0) {
+        printf("hub: error: failed to enable port\n");
+        return ReturnState::kErrUnknown;
+      }
+      return ReturnState::kSuccess;
+    }
+    usleep(1000);
+  }
+}
+
+void Hub::Release() {
+  pthread_mutex_lock(&_port_lock);
+  _released = true;
+  if (_attached != nullptr) {
+    for (int i = 1; i <= _num_of_ports; i++) {
+      if (_attached[i]) {
+        DetachDeviceFromHostController(i);
+        _attached[i] = false;
+      }
+    }
+  }
+  pthread_mutex_unlock(&_port_lock);
+
+  // stop the status change thread. the endpoint is the only producer of _buf, so the thread is
+  // woken up to see _stop instead of pushing a sentinel.
+  if (_thread_started) {
+    _stop.store(true, std::memory_order_release);
+    _buf.Wake();
+    pthread_join(_thread, NULL);
+    uint8_t *data;
+    while(_buf.TryPop(data)) {
+      delete[] data;
+    }
+  }
+  printf("hub: info: detached\n");
+}
+
+void Hub::HandleSub() {
+  uint8_t *data[16];
+  while(true) {
+    int num = _buf.PopBatch(data, sizeof(data) / sizeof(data[0]), _stop);
+    if (num == 0) {
+      // stopped by Release()
+      return;
+    }
+    for (int j = 0; j < num; j++) {
+      pthread_mutex_lock(&_port_lock);
+      if (!_released) {
+        if ((data[j][0] & 1) != 0 && HandleHubChange() != ReturnState::kSuccess) {
+          printf("hub: error: failed to handle hub status change\n");
+        }
+        for (int i = 1; i <= _num_of_ports; i++) {
+          if ((data[j][i / 8] & (1 << (i % 8))) != 0 && HandlePortChange(i) != ReturnState::kSuccess) {
+            printf("hub: error: failed to handle status change of port %d\n", i);
+          }
+        }
       }
+      pthread_mutex_unlock(&_port_lock);
+      delete[] data[j];
     }
   }
 }
 
-uint16_t Hub::GetPortStatus(int port_id) {
-  Memory mem(4);
+ReturnState Hub::HandleHubChange() {
+  ScopedDmaBuffer mem(4);
   UsbCtrl::DeviceRequest request;
-  request.MakePacket(0b10100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetStatus), 0, port_id, 4);
-  assert(SendControlTransfer(request, mem, 4));
-  return mem.GetVirtPtr<uint16_t>()[0];
+  request.MakePacket(0b10100000, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetStatus), 0, 0, 4);
+  if (!SendControlTransfer(request, mem, 4)) {
+    return ReturnState::kErrUnknown;
+  }
+  uint16_t change = mem.GetVirtPtr<uint16_t>()[1];
+  if ((change & HubChange::kFlagLocalPowerStatus) != 0) {
+    RETURN_IF_ERR(ClearHubFeature(HubClassFeatureSelector::kChangeHubLocalPower));
+  }
+  if ((change & HubChange::kFlagOverCurrent) != 0) {
+    printf("hub: warning: over-current condition\n");
+    RETURN_IF_ERR(ClearHubFeature(HubClassFeatureSelector::kChangeHubOverCurrent));
+  }
+  return ReturnState::kSuccess;
+}
+
+// called with _port_lock held
+ReturnState Hub::HandlePortChange(int port_id) {
+  uint16_t status, change;
+  RETURN_IF_ERR(GetPortStatus(port_id, status, change));
+
+  // acknowledge changes other than the connection
+  if ((change & PortChange::kFlagPortEnable) != 0) {
+    RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortEnable));
+  }
+  if ((change & PortChange::kFlagSuspend) != 0) {
+    RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortSuspend));
+  }
+  if ((change & PortChange::kFlagOverCurrent) != 0) {
+    printf("hub: warning: over-current condition on port %d\n", port_id);
+    RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortOverCurrent));
+  }
+  if ((change & PortChange::kFlagReset) != 0) {
+    RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortReset));
+  }
+  if (_superspeed) {
+    if ((change & PortChange::kFlagBhReset) != 0) {
+      RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangeBhPortReset));
+    }
+    if ((change & PortChange::kFlagLinkState) != 0) {
+      RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortLinkState));
+    }
+    if ((change & PortChange::kFlagConfigError) != 0) {
+      printf("hub: warning: link configuration error on port %d\n", port_id);
+      RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortConfigError));
+    }
+  }
+  if ((change & PortChange::kFlagConnectStatus) == 0) {
+    return ReturnState::kSuccess;
+  }
+  RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortConnection));
+
+  // the device may have been replaced, so detach the old one anyway
+  if (_attached[port_id]) {
+    printf("hub: info: port %d disconnected\n", port_id);
+    DetachDeviceFromHostController(port_id);
+    _attached[port_id] = false;
+  }
+
+  bool connected;
+  if (Debounce(port_id, connected) != ReturnState::kSuccess) {
+    printf("hub: warning: connection of port %d is unstable\n", port_id);
+    return ReturnState::kSuccess;
+  }
+  if (connected) {
+    printf("hub: info: new present port\n");
+    bool resetting[256];
+    for (int i = 1; i <= _num_of_ports; i++) {
+      resetting[i] = (i == port_id);
+    }
+    ResetAndAttach(resetting);
+  }
+  return ReturnState::kSuccess;
 }
 
-void Hub::SetPortFeature(int port_id, HubClassFeatureSelector selector) {
-  Memory mem(0);
+ReturnState Hub::Debounce(int port_id, bool &connected) {
+  int stable_time = 0;
+  uint16_t status, change;
+  RETURN_IF_ERR(GetPortStatus(port_id, status, change));
+  connected = (status & PortStatus::kFlagCurrentConnectStatus) != 0;
+  for (int elapsed = 0; elapsed < kDebounceTimeout; elapsed += kDebouncePollInterval) {
+    usleep(kDebouncePollInterval * 1000);
+    RETURN_IF_ERR(GetPortStatus(port_id, status, change));
+    bool current = (status & PortStatus::kFlagCurrentConnectStatus) != 0;
+    if ((change & PortChange::kFlagConnectStatus) != 0) {
+      RETURN_IF_ERR(ClearPortFeature(port_id, HubClassFeatureSelector::kChangePortConnection));
+      stable_time = 0;
+    } else if (current == connected) {
+      stable_time += kDebouncePollInterval;
+      if (stable_time >= kDebounceStableTime) {
+        return ReturnState::kSuccess;
+      }
+    } else {
+      stable_time = 0;
+    }
+    connected = current;
+  }
+  return ReturnState::kErrUnknown;
+}
+
+ReturnState Hub::GetPortStatus(int port_id, uint16_t &status, uint16_t &change) {
+  ScopedDmaBuffer mem(4);
   UsbCtrl::DeviceRequest request;
-  request.MakePacket(0b00100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetFeature), static_cast<uint16_t>(selector), port_id, 0);
-  assert(SendControlTransfer(request, mem, 0));
+  request.MakePacket(0b10100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kGetStatus), 0, port_id, 4);
+  if (!SendControlTransfer(request, mem, 4)) {
+    return ReturnState::kErrUnknown;
+  }
+  status = mem.GetVirtPtr<uint16_t>()[0];
+  change = mem.GetVirtPtr<uint16_t>()[1];
+  return ReturnState::kSuccess;
 }
 
-void Hub::ClearPortFeature(int port_id, HubClassFeatureSelector selector) {
-  Memory mem(0);
+ReturnState Hub::SendRequest(uint8_t request_type, uint8_t request_code, uint16_t value, uint16_t index) {
+  ScopedDmaBuffer mem(0);
   UsbCtrl::DeviceRequest request;
-  request.MakePacket(0b00100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kClearFeature), static_cast<uint16_t>(selector), port_id, 0);
-  assert(SendControlTransfer(request, mem, 0));
+  request.MakePacket(request_type, request_code, value, index, 0);
+  return SendControlTransfer(request, mem, 0) ? ReturnState::kSuccess : ReturnState::kErrUnknown;
+}
+
+ReturnState Hub::SetPortFeature(int port_id, HubClassFeatureSelector selector) {
+  return SendRequest(0b00100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetFeature), static_cast<uint16_t>(selector), port_id);
+}
+
+ReturnState Hub::ClearPortFeature(int port_id, HubClassFeatureSelector selector) {
+  return SendRequest(0b00100011, static_cast<uint8_t>(UsbCtrl::RequestCode::kClearFeature), static_cast<uint16_t>(selector), port_id);
+}
+
+ReturnState Hub::ClearHubFeature(HubClassFeatureSelector selector) {
+  return SendRequest(0b00100000, static_cast<uint8_t>(UsbCtrl::RequestCode::kClearFeature), static_cast<uint16_t>(selector), 0);
 }
 
 UsbCtrl::PortSpeed Hub::GetPortSpeed(int port_id) {
-  if ((GetPortStatus(port_id) & PortStatus::kFlagLowSpeed) != 0) {
+  if (_superspeed) {
+    // usb 2.0 devices are attached to the companion high-speed hub
+    return UsbCtrl::PortSpeed::kSuperSpeed;
+  }
+  uint16_t status, change;
+  if (GetPortStatus(port_id, status, change) != ReturnState::kSuccess) {
+    return UsbCtrl::PortSpeed::kUnknown;
+  }
+  if ((status & PortStatus::kFlagLowSpeed) != 0) {
     return UsbCtrl::PortSpeed::kLowSpeed;
+  } else if ((status & PortStatus::kFlagHighSpeed) != 0) {
+    return UsbCtrl::PortSpeed::kHighSpeed;
   } else {
     return UsbCtrl::PortSpeed::kFullSpeed;
   }
 }
 
 void Hub::Reset(int port_id) {
-  SetPortFeature(port_id, HubClassFeatureSelector::kPortReset);
+  if (SetPortFeature(port_id, HubClassFeatureSelector::kPortReset) != ReturnState::kSuccess) {
+    printf("hub: error: failed to reset port %d\n", port_id);
+    return;
+  }
   usleep(20 * 1000);
 }
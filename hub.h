@@ -1,4 +1,6 @@
 // reference: Universal Serial Bus Specification Revision 1.1
+//            Universal Serial Bus Specification Revision 2.0 (high-speed hubs)
+//            Universal Serial Bus 3.2 Specification (superspeed hubs)
 
 #pragma once
 
@@ -7,16 +9,32 @@
 class Hub : public DevUsb {
 public:
   Hub() = delete;
-  Hub(DevUsbController *hc, int addr) : DevUsb(hc, addr) {
+  Hub(UsbDevice *device, DescriptorIndex::Interface *interface) : DevUsb(device, interface), _buf(64) {
+    pthread_mutex_init(&_port_lock, NULL);
   }
-  static Hub *Init(DevUsbController *hc, int addr);
+  static DevUsb *Probe(UsbDevice *device, DescriptorIndex::Interface *interface);
   UsbCtrl::PortSpeed GetPortSpeed(int port_id);
   void Reset(int port_id);
-  virtual void Release() override {
-    printf("hub: info: detached\n");
-    assert(false);
-  }
+  // detaches all downstream devices
+  virtual void Release() override;
 private:
+  // bDeviceProtocol and bInterfaceProtocol of hubs (11.23.1 of USB 2.0 spec, 10.15.1 of USB 3.2 spec)
+  enum class Protocol : uint8_t {
+    kFullSpeed = 0,
+    kSingleTt = 1,
+    kMultiTt = 2,
+    kSuperSpeed = 3,
+  };
+
+  static const uint8_t kHubDescriptorType = 0x29;
+  // Table 10-3. SuperSpeed Hub Descriptor (USB 3.2)
+  static const uint8_t kSuperSpeedHubDescriptorType = 0x2A;
+
+  // Table 10-7. Hub Class Requests (USB 3.2)
+  enum class HubClassRequestCode : uint8_t {
+    kSetHubDepth = 12,
+  };
+
   // Table 11-8. Hub Descriptor
   class HubDescriptor {
   public:
@@ -50,6 +68,10 @@ private:
     kChangePortSuspend = 18,
     kChangePortOverCurrent = 19,
     kChangePortReset = 20,
+    // Table 10-9 of USB 3.2 spec
+    kChangePortLinkState = 25,
+    kChangePortConfigError = 26,
+    kChangeBhPortReset = 29,
   };
 
   // Table 11-13. Hub Status Field, wHubStatus
@@ -57,6 +79,12 @@ private:
     static const uint16_t kFlagLocalPowerSource = 1 << 0;
   };
 
+  // Table 11-14. Hub Change Field, wHubChange
+  struct HubChange {
+    static const uint16_t kFlagLocalPowerStatus = 1 << 0;
+    static const uint16_t kFlagOverCurrent = 1 << 1;
+  };
+
   // Table 11-15. Port Status Field, wPortStatus
   struct PortStatus {
     static const uint16_t kFlagCurrentConnectStatus = 1 << 0;
@@ -66,16 +94,82 @@ private:
     static const uint16_t kFlagReset = 1 << 4;
     static const uint16_t kFlagPower = 1 << 8;
     static const uint16_t kFlagLowSpeed = 1 << 9;
+    // Table 11-21 of USB 2.0 spec
+    static const uint16_t kFlagHighSpeed = 1 << 10;
   };
 
+  // Table 11-16. Port Change Field, wPortChange
+  struct PortChange {
+    static const uint16_t kFlagConnectStatus = 1 << 0;
+    static const uint16_t kFlagPortEnable = 1 << 1;
+    static const uint16_t kFlagSuspend = 1 << 2;
+    static const uint16_t kFlagOverCurrent = 1 << 3;
+    static const uint16_t kFlagReset = 1 << 4;
+    // Table 10-14 of USB 3.2 spec (superspeed hubs only)
+    static const uint16_t kFlagBhReset = 1 << 5;
+    static const uint16_t kFlagLinkState = 1 << 6;
+    static const uint16_t kFlagConfigError = 1 << 7;
+  };
+
+  // how many times ports are polled (in 1ms intervals) for the completion of resets
+  static const int kResetTimeout = 50;
+  // the connection should be stable for 100ms before the port is reset (7.1.7.3)
+  static const int kDebounceStableTime = 100;
+  static const int kDebouncePollInterval = 25;
+  static const int kDebounceTimeout = 1500;
+
   int _num_of_ports = 0;
-  HubDescriptor *_desc;
+  HubDescriptor _desc;
+  // status change bitmaps from the interrupt IN endpoint (11.12.4)
+  SpscRingBuffer<uint8_t *> _buf;
+  int _bitmap_size;
+
+  // serializes attach/detach of downstream ports
+  pthread_mutex_t _port_lock;
+  // whether a device is attached to the port. indexed by port id (1 origin).
+  bool *_attached = nullptr;
+  bool _released = false;
+  // the status change thread (HandleSub) exits when set
+  std::atomic<bool> _stop{false};
+  bool _thread_started = false;
+  pthread_t _thread;
+  bool _superspeed = false;
+  // alternate setting of the multiple TT interface (nullptr if single TT or not a high-speed hub)
+  UsbCtrl::InterfaceDescriptor *_multi_tt_interface = nullptr;
   
   void InitSub();
-  uint16_t GetPortStatus(int port_id);
-  void SetPortFeature(int port_id, HubClassFeatureSelector selector);
-  void ClearPortFeature(int port_id, HubClassFeatureSelector selector);
-  DevUsb *AttachDeviceToHostController(int port_id) {
+  static void *Handle(void *arg) {
+    reinterpret_cast<Hub *>(arg)->HandleSub();
+    return nullptr;
+  }
+  void HandleSub();
+  // the hub may be unplugged at any time, so failed requests are reported instead of asserted.
+  ReturnState HandleHubChange();
+  ReturnState HandlePortChange(int port_id);
+  // return: kSuccess if the connection is stable. connected is set to the status of the port.
+  ReturnState Debounce(int port_id, bool &connected);
+  // resets the ports and attaches devices to them. called with _port_lock held.
+  // resetting[port_id] indicates the ports to be reset. it is cleared on return.
+  void ResetAndAttach(bool *resetting);
+  // return: kSuccess if the port is enabled after the reset
+  ReturnState ResetPort(int port_id);
+  // status: wPortStatus, change: wPortChange
+  ReturnState GetPortStatus(int port_id, uint16_t &status, uint16_t &change);
+  ReturnState SetPortFeature(int port_id, HubClassFeatureSelector selector);
+  ReturnState ClearPortFeature(int port_id, HubClassFeatureSelector selector);
+  ReturnState ClearHubFeature(HubClassFeatureSelector selector);
+  // sends a request without data
+  ReturnState SendRequest(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index);
+  ReturnState AttachDeviceToHostController(int port_id) {
     return GetHostController()->AttachDevice(this, GetAddr(), port_id);
   }
+  void DetachDeviceFromHostController(int port_id) {
+    GetHostController()->DetachDevice(GetAddr(), port_id);
+  }
+  void LockDefaultAddress() {
+    GetHostController()->LockDefaultAddress(GetAddr());
+  }
+  void UnlockDefaultAddress() {
+    GetHostController()->UnlockDefaultAddress(GetAddr());
+  }
 };
@@ -1,21 +1,25 @@
 #include "keyboard.h"
 
-Keyboard *Keyboard::Init(DevUsbController *hc, int addr) {
-  Keyboard *dev = new Keyboard(hc, addr);
-  dev->LoadDeviceDescriptor();
-  dev->LoadCombinedDescriptors();
-  UsbCtrl::InterfaceDescriptor *interface_desc = dev->GetInterfaceDescriptorInCombinedDescriptors(0);
-  if (interface_desc->class_code == 3 && interface_desc->subclass_code == 1 && interface_desc->protocol_code == 1) {
-    printf("keyboard: info: attched\n");
-    dev->InitSub();
-    return dev;
-  }
-  delete dev;
-  return nullptr;
+// HID boot interface keyboards (HID1_11 4.2, 4.3)
+static const UsbDeviceId kKeyboardIds[] = {
+  {UsbDeviceId::kAny, UsbDeviceId::kAny, 3, 1, 1},
+};
+static const UsbDriver kKeyboardDriver = {"keyboard", kKeyboardIds, sizeof(kKeyboardIds) / sizeof(kKeyboardIds[0]), Keyboard::Probe};
+static UsbDriverRegistry::Registrar registrar(&kKeyboardDriver);
+
+pthread_mutex_t Keyboard::_listener_lock = PTHREAD_MUTEX_INITIALIZER;
+KeyEventListener *Keyboard::_listeners[kMaxListeners];
+std::atomic<int> Keyboard::_num_listeners{0};
+
+DevUsb *Keyboard::Probe(UsbDevice *device, DescriptorIndex::Interface *interface) {
+  Keyboard *dev = new Keyboard(device, interface);
+  printf("keyboard: info: attched\n");
+  dev->InitSub();
+  return dev;
 }
 
 void Keyboard::InitSub() {
-  UsbCtrl::EndpointDescriptor *ed0 = GetEndpointDescriptorInCombinedDescriptors(0);
+  UsbCtrl::EndpointDescriptor *ed0 = GetEndpoint(0).desc;
   assert(ed0->GetMaxPacketSize() == kMaxPacketSize);
   assert(ed0->GetTransferType() == UsbCtrl::TransferType::kInterrupt);
   assert(ed0->GetDirection() == UsbCtrl::PacketIdentification::kIn);
@@ -29,14 +33,103 @@ void Keyboard::InitSub() {
     // Set Protocol
     // see HID1_11 7.2.6 Set_Protocol Request 
     
-    Memory mem(0);
+    ScopedDmaBuffer mem(0);
     UsbCtrl::DeviceRequest request;
-    request.MakePacket(0b00100001, 0x0B, 0, 0, 0);
+    request.MakePacket(0b00100001, kRequestSetProtocol, 0, GetInterface().desc->interface_number, 0);
     assert(SendControlTransfer(request, mem, 0));
   } while(0);
+  do {
+    // Set Idle
+    // report only on changes, since events are generated from the differences of reports.
+    // see HID1_11 7.2.4 Set_Idle Request (a keyboard may stall it)
+
+    ScopedDmaBuffer mem(0);
+    UsbCtrl::DeviceRequest request;
+    request.MakePacket(0b00100001, kRequestSetIdle, 0, GetInterface().desc->interface_number, 0);
+    if (!SendControlTransfer(request, mem, 0)) {
+      printf("keyboard: warning: Set_Idle is not supported\n");
+    }
+  } while(0);
   pthread_t tid;
   if (pthread_create(&tid, NULL, Handle, this) != 0) {
     perror("pthread_create:");
     exit(1);
   }
 }
+
+void Keyboard::Subscribe(KeyEventListener *listener) {
+  pthread_mutex_lock(&_listener_lock);
+  int num = _num_listeners.load(std::memory_order_relaxed);
+  assert(num < kMaxListeners);
+  _listeners[num] = listener;
+  _num_listeners.store(num + 1, std::memory_order_release);
+  pthread_mutex_unlock(&_listener_lock);
+}
+
+void Keyboard::HandleSub() {
+  InTransferLease leases[kLeaseNum];
+  KeyEvent events[kLeaseNum * kMaxEventsPerReport];
+  while(true) {
+    int num = _buf.PopBatch(leases, kLeaseNum);
+    int num_events = 0;
+    for (int i = 0; i < num; i++) {
+      if (leases[i].GetLength() >= kMaxPacketSize) {
+        num_events += Diff(leases[i].GetData(), leases[i].GetTimestamp(), events + num_events);
+      }
+      leases[i].Release();
+    }
+    if (num_events == 0) {
+      continue;
+    }
+    int num_listeners = _num_listeners.load(std::memory_order_acquire);
+    for (int i = 0; i < num_listeners; i++) {
+      _listeners[i]->OnKeyEvents(this, events, num_events);
+    }
+  }
+}
+
+int Keyboard::Diff(const uint8_t *report, uint64_t timestamp, KeyEvent *events) {
+  int num = 0;
+  uint8_t modifiers = report[kReportOffsetModifiers];
+  const uint8_t *keys = report + kReportOffsetKeys;
+
+  uint8_t changed = _modifiers ^ modifiers;
+  for (int bit = 0; bit < 8; bit++) {
+    if ((changed & (1 << bit)) != 0) {
+      KeyEvent &event = events[num++];
+      event.type = ((modifiers & (1 << bit)) != 0) ? KeyEvent::Type::kDown : KeyEvent::Type::kUp;
+      event.usage = kUsageLeftControl + bit;
+      event.modifiers = modifiers;
+      event.timestamp = timestamp;
+    }
+  }
+  _modifiers = modifiers;
+
+  // more keys than the report can hold are pressed. the keys are unknown, so keep the last state (HID1_11 Appendix C)
+  if (keys[0] == kUsageErrorRollOver) {
+    return num;
+  }
+
+  for (int i = 0; i < kReportKeyNum; i++) {
+    if (_keys[i] < kUsageFirstKey || memchr(keys, _keys[i], kReportKeyNum) != nullptr) {
+      continue;
+    }
+    KeyEvent &event = events[num++];
+    event.type = KeyEvent::Type::kUp;
+    event.usage = _keys[i];
+    event.modifiers = modifiers;
+    event.timestamp = timestamp;
+  }
+  for (int i = 0; i < kReportKeyNum; i++) {
+    if (keys[i] < kUsageFirstKey || memchr(_keys, keys[i], kReportKeyNum) != nullptr) {
+      continue;
+    }
+    KeyEvent &event = events[num++];
+    event.type = KeyEvent::Type::kDown;
+    event.usage = keys[i];
+    event.modifiers = modifiers;
+    event.timestamp = timestamp;
+  }
+  memcpy(_keys, keys, kReportKeyNum);
+  return num;
+}
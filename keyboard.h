@@ -1,35 +1,80 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 #include "ringbuffer.h"
 #include "usb.h"
 
+// a key pressed or released
+struct KeyEvent {
+  enum class Type : uint8_t {
+    kDown,
+    kUp,
+  };
+  Type type;
+  // usage of the Keyboard/Keypad page (HUT1_12 10). modifiers are 0xE0 (LeftControl) - 0xE7 (Right GUI)
+  uint8_t usage;
+  // modifier byte of the report which caused the event
+  uint8_t modifiers;
+  // CLOCK_MONOTONIC in ns when the report was received
+  uint64_t timestamp;
+};
+
+class Keyboard;
+
+// receives key events of keyboards
+class KeyEventListener {
+public:
+  // events of the reports received at once are delivered in a batch.
+  // called on the thread of the keyboard, so it should not block.
+  virtual void OnKeyEvents(Keyboard *keyboard, const KeyEvent *events, int num) = 0;
+};
+
 class Keyboard : public DevUsb {
 public:
   Keyboard() = delete;
-  Keyboard(DevUsbController *hc, int addr) : DevUsb(hc, addr), _buf(64) {
+  Keyboard(UsbDevice *device, DescriptorIndex::Interface *interface) : DevUsb(device, interface), _buf(64) {
   }
-  static Keyboard *Init(DevUsbController *hc, int addr);
+  static DevUsb *Probe(UsbDevice *device, DescriptorIndex::Interface *interface);
+  // listeners are shared by all keyboards, and cannot be removed
+  static void Subscribe(KeyEventListener *listener);
   virtual void Release() override {
     printf("keyboard: info: detached\n");
   }
 private:
   static const int kMaxPacketSize = 8;
-  RingBuffer<uint8_t *> _buf;
-  
+  // HID1_11 Appendix B.1 Protocol 1 (Keyboard)
+  static const int kReportOffsetModifiers = 0;
+  static const int kReportOffsetKeys = 2;
+  static const int kReportKeyNum = 6;
+  // HUT1_12 10: keys in the report which do not name a key
+  static const uint8_t kUsageErrorRollOver = 0x01;
+  static const uint8_t kUsageFirstKey = 0x04;
+  static const uint8_t kUsageLeftControl = 0xE0;
+  // 7.2 Class-Specific Requests
+  static const uint8_t kRequestSetIdle = 0x0A;
+  static const uint8_t kRequestSetProtocol = 0x0B;
+  static const int kLeaseNum = 16;
+  // a report produces at most 8 modifier and 12 key events
+  static const int kMaxEventsPerReport = 8 + kReportKeyNum * 2;
+  static const int kMaxListeners = 4;
+
+  // _listener_lock serializes Subscribe(). the consumer threads read _num_listeners without the lock.
+  static pthread_mutex_t _listener_lock;
+  static KeyEventListener *_listeners[kMaxListeners];
+  static std::atomic<int> _num_listeners;
+
+  SpscRingBuffer<InTransferLease> _buf;
+  // the last report (only the consumer thread touches them)
+  uint8_t _modifiers = 0;
+  uint8_t _keys[kReportKeyNum] = {0};
+
   void InitSub();
   static void *Handle(void *arg) {
     reinterpret_cast<Keyboard *>(arg)->HandleSub();
     return nullptr;
   }
-  void HandleSub() {
-    while(true) {
-      uint8_t *data = _buf.Pop();
-      for (int i = 0; i < kMaxPacketSize; i++) {
-        printf("%02x ", data[i]);
-      }
-      printf("\n");
-      delete data;
-    }
-  }
+  void HandleSub();
+  // return: number of events stored to events
+  int Diff(const uint8_t *report, uint64_t timestamp, KeyEvent *events);
 };
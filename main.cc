@@ -1,8 +1,41 @@
+#include <stdlib.h>
+#include <unistd.h>
 #include "xhci.h"
 
+static void Usage(const char *name) {
+  fprintf(stderr, "usage: %s [interrupt|poll|hybrid] [number of interrupters (1-%d)]\n", name, DevXhci::kMaxInterrupters);
+}
+
 int main(int argc, const char **argv)
 {
   auto dev = new DevXhci;
+  if (argc > 1) {
+    if (strcmp(argv[1], "poll") == 0) {
+      dev->SetPollMode(DevXhci::PollMode::kPolling);
+    } else if (strcmp(argv[1], "hybrid") == 0) {
+      dev->SetPollMode(DevXhci::PollMode::kHybrid);
+    } else if (strcmp(argv[1], "interrupt") != 0) {
+      Usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc > 2) {
+    char *end;
+    long num = strtol(argv[2], &end, 10);
+    if (*argv[2] == '\0' || *end != '\0' || num < 1 || num > DevXhci::kMaxInterrupters) {
+      Usage(argv[0]);
+      return 1;
+    }
+    dev->SetInterrupterNum(num);
+    // one interrupter per core. interrupters beyond the number of online cores share them.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+      cores = 1;
+    }
+    for (int i = 0; i < num; i++) {
+      dev->SetInterrupterAffinity(i, i % cores);
+    }
+  }
   dev->Init();
   dev->Run();
   return 0;
@@ -0,0 +1,601 @@
+#include "msc.h"
+#include <unistd.h>
+
+// SCSI transparent command set over Bulk-Only Transport (Mass Storage Class Specification Overview 2, 3)
+static const UsbDeviceId kMscIds[] = {
+  {UsbDeviceId::kAny, UsbDeviceId::kAny, 8, 6, 0x50},
+};
+static const UsbDriver kMscDriver = {"msc", kMscIds, sizeof(kMscIds) / sizeof(kMscIds[0]), Msc::Probe};
+static UsbDriverRegistry::Registrar registrar(&kMscDriver);
+
+std::atomic<MscListener *> Msc::_listener{nullptr};
+
+// fields of SCSI commands and parameter data are big endian
+static void PutBigEndian(uint8_t *buf, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    buf[i] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+static uint64_t GetBigEndian(const uint8_t *buf, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value = (value << 8) | buf[i];
+  }
+  return value;
+}
+
+DevUsb *Msc::Probe(UsbDevice *device, DescriptorIndex::Interface *interface) {
+  Msc *dev = new Msc(device, interface);
+  if (dev->InitSub() != ReturnState::kSuccess) {
+    delete dev;
+    return nullptr;
+  }
+  MscListener *listener = _listener.load(std::memory_order_acquire);
+  if (listener != nullptr) {
+    listener->OnAttach(dev);
+  }
+  return dev;
+}
+
+ReturnState Msc::InitSub() {
+  UsbCtrl::EndpointDescriptor *ed_in = nullptr;
+  UsbCtrl::EndpointDescriptor *ed_out = nullptr;
+  for (int i = 0; i < GetInterface().num_endpoints; i++) {
+    UsbCtrl::EndpointDescriptor *ed = GetEndpoint(i).desc;
+    if (ed->GetTransferType() != UsbCtrl::TransferType::kBulk) {
+      continue;
+    }
+    if (ed->GetDirection() == UsbCtrl::PacketIdentification::kIn) {
+      ed_in = (ed_in == nullptr) ? ed : ed_in;
+    } else {
+      ed_out = (ed_out == nullptr) ? ed : ed_out;
+    }
+  }
+  if (ed_in == nullptr || ed_out == nullptr) {
+    printf("msc: error: no bulk endpoints\n");
+    return ReturnState::kErrInvalid;
+  }
+  _endpt_in = ed_in->GetEndpointNumber();
+  _endpt_out = ed_out->GetEndpointNumber();
+  if (SetupEndpoint(_endpt_in, 0, UsbCtrl::TransferType::kBulk, UsbCtrl::PacketIdentification::kIn, ed_in->GetMaxPacketSize()) != ReturnState::kSuccess ||
+      SetupEndpoint(_endpt_out, 0, UsbCtrl::TransferType::kBulk, UsbCtrl::PacketIdentification::kOut, ed_out->GetMaxPacketSize()) != ReturnState::kSuccess) {
+    printf("msc: error: failed to init endpoints\n");
+    return ReturnState::kErrUnknown;
+  }
+
+  _wrappers = new Memory(kQueueDepth * kWrapperSize);
+  for (int i = 0; i < kMaxRequests; i++) {
+    _requests[i].next = _free_requests;
+    _free_requests = &_requests[i];
+  }
+  for (int i = 0; i < kQueueDepth; i++) {
+    Command &command = _commands[i];
+    command.index = i;
+    command.requests = nullptr;
+    for (int j = 0; j < Command::kPhaseNum; j++) {
+      command.completions[j].msc = this;
+      command.completions[j].command = &command;
+      command.completions[j].phase = j;
+    }
+    _free_commands[_num_free_commands++] = i;
+  }
+
+  // only LUN 0 is used, so Get Max LUN (which may stall the default pipe) is not issued
+
+  for (int i = 0;; i++) {
+    // Test Unit Ready
+    uint8_t cb[6] = {static_cast<uint8_t>(ScsiOpcode::kTestUnitReady)};
+    if (Execute(cb, sizeof(cb), false, nullptr, 0) == ReturnState::kSuccess) {
+      break;
+    }
+    // the sense data (e.g. Unit Attention after a reset) should be cleared before the next command
+    if (i == kTestUnitReadyRetry || RequestSense() != ReturnState::kSuccess) {
+      printf("msc: error: the unit is not ready\n");
+      return ReturnState::kErrUnknown;
+    }
+    usleep(100 * 1000);
+  }
+
+  Memory mem(64);
+  do {
+    // Inquiry
+    uint8_t cb[6] = {static_cast<uint8_t>(ScsiOpcode::kInquiry), 0, 0, 0, kInquiryLength, 0};
+    RETURN_IF_ERR(Execute(cb, sizeof(cb), true, &mem, kInquiryLength));
+    char vendor[9];
+    char product[17];
+    memcpy(vendor, mem.GetVirtPtr<uint8_t>() + 8, 8);
+    memcpy(product, mem.GetVirtPtr<uint8_t>() + 16, 16);
+    vendor[8] = '\0';
+    product[16] = '\0';
+    printf("msc: info: %s %s attached\n", vendor, product);
+  } while(0);
+  do {
+    // Read Capacity (10)
+    uint8_t cb[10] = {static_cast<uint8_t>(ScsiOpcode::kReadCapacity10)};
+    RETURN_IF_ERR(Execute(cb, sizeof(cb), true, &mem, 8));
+    uint64_t last_lba = GetBigEndian(mem.GetVirtPtr<uint8_t>(), 4);
+    _block_size = GetBigEndian(mem.GetVirtPtr<uint8_t>() + 4, 4);
+    if (last_lba == 0xFFFFFFFF) {
+      // Read Capacity (16) for devices beyond 2TB (SBC-3 5.16)
+      uint8_t cb16[16] = {static_cast<uint8_t>(ScsiOpcode::kServiceActionIn16), kServiceActionReadCapacity16};
+      PutBigEndian(cb16 + 10, 32, 4);
+      RETURN_IF_ERR(Execute(cb16, sizeof(cb16), true, &mem, 32));
+      last_lba = GetBigEndian(mem.GetVirtPtr<uint8_t>(), 8);
+      _block_size = GetBigEndian(mem.GetVirtPtr<uint8_t>() + 8, 4);
+    }
+    _block_num = last_lba + 1;
+  } while(0);
+  if (_block_size == 0 || _block_size > kMaxTransferLength) {
+    printf("msc: error: unsupported block size (%u)\n", _block_size);
+    return ReturnState::kErrInvalid;
+  }
+  printf("msc: info: %llu blocks of %u bytes\n", static_cast<unsigned long long>(_block_num), _block_size);
+
+  if (pthread_create(&_recovery_thread, NULL, RecoveryThread, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  return ReturnState::kSuccess;
+}
+
+void Msc::BuildWrapper(CommandBlockWrapper *cbw, uint32_t tag, const uint8_t *cb, int cb_length, bool in, uint32_t length) {
+  cbw->signature = CommandBlockWrapper::kSignature;
+  cbw->tag = tag;
+  cbw->data_transfer_length = length;
+  cbw->flags = in ? CommandBlockWrapper::kFlagDataIn : 0;
+  cbw->lun = 0;
+  cbw->cb_length = cb_length;
+  memset(cbw->cb, 0, sizeof(cbw->cb));
+  memcpy(cbw->cb, cb, cb_length);
+}
+
+ReturnState Msc::Execute(const uint8_t *cb, int cb_length, bool in, Memory *mem, size_t length) {
+  // the wrappers of the command slot 0, which is not in use
+  CommandBlockWrapper *cbw = _wrappers->GetVirtPtr<CommandBlockWrapper>();
+  CommandStatusWrapper *csw = reinterpret_cast<CommandStatusWrapper *>(_wrappers->GetVirtPtr<uint8_t>() + kCswOffset);
+  BuildWrapper(cbw, ++_tag, cb, cb_length, in, length);
+
+  size_t transferred;
+  UsbCtrl::IoVector cbw_iov = {_wrappers, 0, sizeof(CommandBlockWrapper)};
+  if (BulkTransfer(_endpt_out, UsbCtrl::PacketIdentification::kOut, &cbw_iov, 1, transferred) != ReturnState::kSuccess) {
+    // the CBW is not accepted (6.6.1)
+    printf("msc: error: CBW failed\n");
+    ResetRecovery();
+    return ReturnState::kErrUnknown;
+  }
+  if (length != 0) {
+    UsbCtrl::IoVector data_iov = {mem, 0, length};
+    uint8_t endpt = in ? _endpt_in : _endpt_out;
+    UsbCtrl::PacketIdentification direction = in ? UsbCtrl::PacketIdentification::kIn : UsbCtrl::PacketIdentification::kOut;
+    if (BulkTransfer(endpt, direction, &data_iov, 1, transferred) != ReturnState::kSuccess) {
+      // the device stalled the data phase. the CSW follows once the pipe is cleared (6.7.2, 6.7.3).
+      if (ClearEndpointHalt(endpt, direction) != ReturnState::kSuccess) {
+        ResetRecovery();
+        return ReturnState::kErrUnknown;
+      }
+    }
+  }
+  if (ReadCsw(kCswOffset) != ReturnState::kSuccess || !IsValidCsw(kCswOffset, cbw->tag)) {
+    printf("msc: error: invalid CSW\n");
+    ResetRecovery();
+    return ReturnState::kErrUnknown;
+  }
+  switch(static_cast<CommandStatus>(csw->status)) {
+  case CommandStatus::kPassed:
+    return ReturnState::kSuccess;
+  case CommandStatus::kFailed:
+    // the caller issues REQUEST SENSE if needed
+    return ReturnState::kErrUnknown;
+  default:
+    printf("msc: error: phase error\n");
+    ResetRecovery();
+    return ReturnState::kErrUnknown;
+  }
+}
+
+ReturnState Msc::RequestSense(uint8_t *sense) {
+  Memory mem(kSenseLength);
+  uint8_t cb[6] = {static_cast<uint8_t>(ScsiOpcode::kRequestSense), 0, 0, 0, kSenseLength, 0};
+  RETURN_IF_ERR(Execute(cb, sizeof(cb), true, &mem, kSenseLength));
+  if (sense != nullptr) {
+    memcpy(sense, mem.GetVirtPtr<uint8_t>(), kSenseLength);
+  }
+  return ReturnState::kSuccess;
+}
+
+ReturnState Msc::ReadCsw(size_t offset) {
+  UsbCtrl::IoVector csw_iov = {_wrappers, offset, sizeof(CommandStatusWrapper)};
+  size_t transferred;
+  for (int i = 0; i < 2; i++) {
+    if (BulkTransfer(_endpt_in, UsbCtrl::PacketIdentification::kIn, &csw_iov, 1, transferred) == ReturnState::kSuccess) {
+      return (transferred == sizeof(CommandStatusWrapper)) ? ReturnState::kSuccess : ReturnState::kErrUnknown;
+    }
+    RETURN_IF_ERR(ClearEndpointHalt(_endpt_in, UsbCtrl::PacketIdentification::kIn));
+  }
+  return ReturnState::kErrUnknown;
+}
+
+bool Msc::IsValidCsw(size_t offset, uint32_t tag) {
+  CommandStatusWrapper *csw = reinterpret_cast<CommandStatusWrapper *>(_wrappers->GetVirtPtr<uint8_t>() + offset);
+  return csw->signature == CommandStatusWrapper::kSignature && csw->tag == tag;
+}
+
+ReturnState Msc::ResetRecovery() {
+  printf("msc: info: reset recovery\n");
+  ScopedDmaBuffer buf(0);
+  UsbCtrl::DeviceRequest request;
+  request.MakePacket(0b00100001, kRequestBulkOnlyReset, 0, GetInterface().desc->interface_number, 0);
+  if (!SendControlTransfer(request, buf, 0)) {
+    printf("msc: error: Bulk-Only Mass Storage Reset failed\n");
+    return ReturnState::kErrUnknown;
+  }
+  // the reset does not clear the halts (5.3.4)
+  RETURN_IF_ERR(ClearEndpointHalt(_endpt_in, UsbCtrl::PacketIdentification::kIn));
+  RETURN_IF_ERR(ClearEndpointHalt(_endpt_out, UsbCtrl::PacketIdentification::kOut));
+  return ReturnState::kSuccess;
+}
+
+int Msc::BuildReadWrite(uint8_t *cb, bool write, uint64_t lba, uint32_t num_blocks) {
+  if (lba + num_blocks <= (static_cast<uint64_t>(1) << 32) && num_blocks <= 0xFFFF) {
+    // READ (10) / WRITE (10)
+    memset(cb, 0, 10);
+    cb[0] = static_cast<uint8_t>(write ? ScsiOpcode::kWrite10 : ScsiOpcode::kRead10);
+    PutBigEndian(cb + 2, lba, 4);
+    PutBigEndian(cb + 7, num_blocks, 2);
+    return 10;
+  }
+  // READ (16) / WRITE (16)
+  memset(cb, 0, 16);
+  cb[0] = static_cast<uint8_t>(write ? ScsiOpcode::kWrite16 : ScsiOpcode::kRead16);
+  PutBigEndian(cb + 2, lba, 8);
+  PutBigEndian(cb + 10, num_blocks, 4);
+  return 16;
+}
+
+ReturnState Msc::Submit(bool write, uint64_t lba, uint32_t num_blocks, Memory *mem, size_t offset, BlockCompletion *completion) {
+  if (num_blocks == 0 || lba + num_blocks > _block_num || static_cast<size_t>(num_blocks) * _block_size > kMaxTransferLength) {
+    return ReturnState::kErrInvalid;
+  }
+  pthread_mutex_lock(&_lock);
+  if (_broken) {
+    pthread_mutex_unlock(&_lock);
+    return ReturnState::kErrUnknown;
+  }
+  Request *request = _free_requests;
+  if (request == nullptr) {
+    pthread_mutex_unlock(&_lock);
+    return ReturnState::kErrNoHwResource;
+  }
+  _free_requests = request->next;
+  request->write = write;
+  request->lba = lba;
+  request->num_blocks = num_blocks;
+  request->mem = mem;
+  request->offset = offset;
+  request->completion = completion;
+  request->next = nullptr;
+  if (_pending_tail == nullptr) {
+    _pending_head = request;
+  } else {
+    _pending_tail->next = request;
+  }
+  _pending_tail = request;
+  Dispatch();
+  pthread_mutex_unlock(&_lock);
+  return ReturnState::kSuccess;
+}
+
+void Msc::BeginBatch() {
+  pthread_mutex_lock(&_lock);
+  _batch_depth++;
+  pthread_mutex_unlock(&_lock);
+}
+
+void Msc::EndBatch() {
+  pthread_mutex_lock(&_lock);
+  assert(_batch_depth > 0);
+  _batch_depth--;
+  Dispatch();
+  pthread_mutex_unlock(&_lock);
+}
+
+void Msc::Dispatch() {
+  if (_batch_depth > 0 || _broken || _failed_command != nullptr) {
+    return;
+  }
+  // the TDs of all commands are kicked by a doorbell per endpoint
+  SubmissionBatch batch(GetHostController());
+  while(_pending_head != nullptr && _num_free_commands > 0) {
+    // merge the following requests while they are contiguous in the same direction
+    Request *first = _pending_head;
+    Request *last = first;
+    size_t length = static_cast<size_t>(first->num_blocks) * _block_size;
+    for (int num = 1; num < kMaxMerge && last->next != nullptr; num++) {
+      Request *next = last->next;
+      size_t next_length = static_cast<size_t>(next->num_blocks) * _block_size;
+      if (next->write != first->write || next->lba != last->lba + last->num_blocks || length + next_length > kMaxTransferLength) {
+        break;
+      }
+      length += next_length;
+      last = next;
+    }
+    _pending_head = last->next;
+    if (_pending_head == nullptr) {
+      _pending_tail = nullptr;
+    }
+    last->next = nullptr;
+
+    Command &command = _commands[_free_commands[--_num_free_commands]];
+    command.tag = ++_tag;
+    command.failed = false;
+    command.length = length;
+    command.requests = first;
+    Issue(command);
+  }
+}
+
+void Msc::Issue(Command &command) {
+  bool write = command.requests->write;
+  uint8_t cb[16];
+  int cb_length = BuildReadWrite(cb, write, command.requests->lba, command.length / _block_size);
+  size_t wrapper_offset = command.index * kWrapperSize;
+  BuildWrapper(reinterpret_cast<CommandBlockWrapper *>(_wrappers->GetVirtPtr<uint8_t>() + wrapper_offset), command.tag, cb, cb_length, !write, command.length);
+  command.remaining = Command::kPhaseNum;
+
+  UsbCtrl::IoVector cbw_iov = {_wrappers, wrapper_offset, sizeof(CommandBlockWrapper)};
+  // the merged requests are transferred as a scatter list
+  UsbCtrl::IoVector data_iov[kMaxMerge];
+  int iovcnt = 0;
+  for (Request *request = command.requests; request != nullptr; request = request->next) {
+    data_iov[iovcnt].mem = request->mem;
+    data_iov[iovcnt].offset = request->offset;
+    data_iov[iovcnt].length = static_cast<size_t>(request->num_blocks) * _block_size;
+    iovcnt++;
+  }
+  UsbCtrl::IoVector csw_iov = {_wrappers, wrapper_offset + kCswOffset, sizeof(CommandStatusWrapper)};
+
+  // all phases are queued at once. the endpoints process their TDs in order, so the phases of
+  // the following commands line up behind them (5.3: the host never reorders the phases).
+  ReturnState state = SubmitBulkTransfer(_endpt_out, UsbCtrl::PacketIdentification::kOut, &cbw_iov, 1, &command.completions[Command::kCbw]);
+  assert(state == ReturnState::kSuccess);
+  if (write) {
+    state = SubmitBulkTransfer(_endpt_out, UsbCtrl::PacketIdentification::kOut, data_iov, iovcnt, &command.completions[Command::kData]);
+  } else {
+    state = SubmitBulkTransfer(_endpt_in, UsbCtrl::PacketIdentification::kIn, data_iov, iovcnt, &command.completions[Command::kData]);
+  }
+  assert(state == ReturnState::kSuccess);
+  state = SubmitBulkTransfer(_endpt_in, UsbCtrl::PacketIdentification::kIn, &csw_iov, 1, &command.completions[Command::kCsw]);
+  assert(state == ReturnState::kSuccess);
+}
+
+void Msc::PhaseCompletion::Complete(bool success, size_t transferred) {
+  msc->CompletePhase(command, phase, success);
+}
+
+void Msc::CompletePhase(Command *command, int phase, bool success) {
+  // a failed phase does not stop the others. the halted endpoint is recovered by the host controller,
+  // and the TDs behind it complete (or are cancelled by the recovery thread).
+  command->succeeded[phase] = success;
+  if (command->remaining.fetch_sub(1) == 1) {
+    FinishCommand(command);
+  }
+}
+
+void Msc::FinishCommand(Command *command) {
+  CommandStatusWrapper *csw = reinterpret_cast<CommandStatusWrapper *>(_wrappers->GetVirtPtr<uint8_t>() + command->index * kWrapperSize + kCswOffset);
+  bool transferred = command->succeeded[Command::kCbw] && command->succeeded[Command::kData] && command->succeeded[Command::kCsw];
+  bool passed = transferred && IsValidCsw(command->index * kWrapperSize + kCswOffset, command->tag) && static_cast<CommandStatus>(csw->status) == CommandStatus::kPassed;
+  // a short transfer is a failure for block requests, but needs no recovery
+  bool success = passed && csw->data_residue == 0;
+
+  pthread_mutex_lock(&_lock);
+  if (_broken) {
+    // the requests have been aborted
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  Request *requests = nullptr;
+  if (passed) {
+    requests = command->requests;
+    command->requests = nullptr;
+    // the slot is reused before the completions run, so that the pipeline does not drain
+    _free_commands[_num_free_commands++] = command->index;
+    Dispatch();
+  } else {
+    // the requests are kept for the recovery thread
+    command->failed = true;
+    if (_failed_command == nullptr) {
+      _failed_command = command;
+    }
+  }
+  pthread_cond_broadcast(&_recovery_cond);
+  pthread_mutex_unlock(&_lock);
+  CompleteRequests(requests, success);
+}
+
+void *Msc::RecoveryThread(void *arg) {
+  Msc *that = reinterpret_cast<Msc *>(arg);
+  pthread_mutex_lock(&that->_lock);
+  while(true) {
+    while(!that->_stop_recovery && that->_failed_command == nullptr) {
+      pthread_cond_wait(&that->_recovery_cond, &that->_lock);
+    }
+    if (that->_stop_recovery) {
+      break;
+    }
+    pthread_mutex_unlock(&that->_lock);
+    that->Recover();
+    pthread_mutex_lock(&that->_lock);
+  }
+  pthread_mutex_unlock(&that->_lock);
+  return nullptr;
+}
+
+bool Msc::IsQuiescent() {
+  for (int i = 0; i < kQueueDepth; i++) {
+    if (_commands[i].requests != nullptr && !_commands[i].failed) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Msc::Recover() {
+  // the pipeline behind the failure is cancelled, and the halts of both pipes are cleared (6.7).
+  // the host side is reset as well, so the data toggles of both sides restart from DATA0.
+  bool reset = (ClearEndpointHalt(_endpt_out, UsbCtrl::PacketIdentification::kOut) != ReturnState::kSuccess
+                || ClearEndpointHalt(_endpt_in, UsbCtrl::PacketIdentification::kIn) != ReturnState::kSuccess);
+
+  pthread_mutex_lock(&_lock);
+  // completions of the cancelled phases may still be running
+  while(!_broken && !IsQuiescent()) {
+    pthread_cond_wait(&_recovery_cond, &_lock);
+  }
+  Command *failed = _failed_command;
+  // the device accepts a CBW only after it has sent the CSW of the previous command (5.3).
+  // if one of the cancelled commands has been accepted, the device is still executing it.
+  bool executing = false;
+  for (int i = 0; i < kQueueDepth; i++) {
+    if (&_commands[i] != failed && _commands[i].requests != nullptr && _commands[i].succeeded[Command::kCbw]) {
+      executing = true;
+    }
+  }
+  bool broken = _broken;
+  pthread_mutex_unlock(&_lock);
+
+  ReturnState state = ReturnState::kSuccess;
+  if (!broken) {
+    size_t csw_offset = failed->index * kWrapperSize + kCswOffset;
+    CommandStatusWrapper *csw = reinterpret_cast<CommandStatusWrapper *>(_wrappers->GetVirtPtr<uint8_t>() + csw_offset);
+    bool csw_read = failed->succeeded[Command::kCsw];
+    if (!reset && !executing && !csw_read && failed->succeeded[Command::kCbw]) {
+      // the data or the CSW phase stalled. the CSW is sent after the pipe is cleared (6.7.2, 6.7.3).
+      csw_read = (ReadCsw(csw_offset) == ReturnState::kSuccess);
+    }
+    bool valid = csw_read && IsValidCsw(csw_offset, failed->tag);
+    CommandStatus status = valid ? static_cast<CommandStatus>(csw->status) : CommandStatus::kPhaseError;
+    printf("msc: error: command failed (tag %u, %s)\n", failed->tag, !valid ? "invalid CSW" : (status == CommandStatus::kPhaseError) ? "phase error" : (status == CommandStatus::kFailed) ? "failed" : "transfer error");
+    if (reset || executing || status == CommandStatus::kPhaseError) {
+      state = ResetRecovery();
+    }
+    if (state == ReturnState::kSuccess && status != CommandStatus::kPassed) {
+      // the sense data tells the cause, and clears it (e.g. Unit Attention) for the next command
+      uint8_t sense[kSenseLength];
+      if (RequestSense(sense) == ReturnState::kSuccess) {
+        printf("msc: info: sense key %x, ASC %02x, ASCQ %02x\n", sense[2] & 0xF, sense[12], sense[13]);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&_lock);
+  Request *failed_requests = failed->requests;
+  failed->requests = nullptr;
+  Request *aborted = nullptr;
+  if (_broken || state != ReturnState::kSuccess) {
+    if (!_broken) {
+      printf("msc: error: failed to recover the device\n");
+      _broken = true;
+    }
+    aborted = Abort();
+  } else {
+    Requeue();
+  }
+  _failed_command = nullptr;
+  Dispatch();
+  pthread_mutex_unlock(&_lock);
+  CompleteRequests(failed_requests, false);
+  CompleteRequests(aborted, false);
+}
+
+void Msc::Requeue() {
+  Request *head = nullptr;
+  Request *tail = nullptr;
+  while(true) {
+    // the oldest cancelled command
+    Command *command = nullptr;
+    for (int i = 0; i < kQueueDepth; i++) {
+      if (_commands[i].requests != nullptr && (command == nullptr || static_cast<int32_t>(_commands[i].tag - command->tag) < 0)) {
+        command = &_commands[i];
+      }
+    }
+    if (command == nullptr) {
+      break;
+    }
+    Request *last = command->requests;
+    while(last->next != nullptr) {
+      last = last->next;
+    }
+    if (tail == nullptr) {
+      head = command->requests;
+    } else {
+      tail->next = command->requests;
+    }
+    tail = last;
+    command->requests = nullptr;
+  }
+  if (tail != nullptr) {
+    tail->next = _pending_head;
+    if (_pending_head == nullptr) {
+      _pending_tail = tail;
+    }
+    _pending_head = head;
+  }
+  // no command is in flight
+  _num_free_commands = 0;
+  for (int i = 0; i < kQueueDepth; i++) {
+    _free_commands[_num_free_commands++] = i;
+  }
+}
+
+Msc::Request *Msc::Abort() {
+  Request *requests = _pending_head;
+  _pending_head = nullptr;
+  _pending_tail = nullptr;
+  for (int i = 0; i < kQueueDepth; i++) {
+    Request *request = _commands[i].requests;
+    if (request == nullptr) {
+      continue;
+    }
+    while(request->next != nullptr) {
+      request = request->next;
+    }
+    request->next = requests;
+    requests = _commands[i].requests;
+    _commands[i].requests = nullptr;
+  }
+  return requests;
+}
+
+void Msc::CompleteRequests(Request *requests, bool success) {
+  if (requests == nullptr) {
+    return;
+  }
+  Request *last = nullptr;
+  for (Request *request = requests; request != nullptr; request = request->next) {
+    request->completion->Complete(success);
+    last = request;
+  }
+  pthread_mutex_lock(&_lock);
+  last->next = _free_requests;
+  _free_requests = requests;
+  pthread_mutex_unlock(&_lock);
+}
+
+void Msc::Release() {
+  pthread_mutex_lock(&_lock);
+  _broken = true;
+  _stop_recovery = true;
+  Request *requests = Abort();
+  pthread_cond_broadcast(&_recovery_cond);
+  pthread_mutex_unlock(&_lock);
+  // a recovery in progress gives up, since the transfers fail on the detached device
+  pthread_join(_recovery_thread, NULL);
+  CompleteRequests(requests, false);
+  MscListener *listener = _listener.load(std::memory_order_acquire);
+  if (listener != nullptr) {
+    listener->OnDetach(this);
+  }
+  printf("msc: info: detached\n");
+}
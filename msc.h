@@ -0,0 +1,230 @@
+// reference: Universal Serial Bus Mass Storage Class Bulk-Only Transport Revision 1.0
+//            SCSI Block Commands - 3 (SBC-3)
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include "usb.h"
+
+// notified when a block request completes.
+// Complete() is called from the event handler thread, so it should not block.
+class BlockCompletion {
+public:
+  virtual void Complete(bool success) = 0;
+};
+
+class Msc;
+
+// notified when mass storage devices come and go
+class MscListener {
+public:
+  virtual void OnAttach(Msc *msc) = 0;
+  // requests which have not completed yet are failed before this is called
+  virtual void OnDetach(Msc *msc) = 0;
+};
+
+// mass storage class driver of Bulk-Only Transport devices with the SCSI transparent command set (LUN 0 only).
+// each command is queued as CBW, data and CSW TDs at once, so that up to kQueueDepth commands are
+// pipelined on the bulk endpoints without waiting for the phases in between.
+// when a command fails, the recovery thread cancels the pipeline, clears the pipes (5.3.4, 6.7)
+// and issues the cancelled commands again.
+class Msc : public DevUsb {
+public:
+  Msc() = delete;
+  Msc(UsbDevice *device, DescriptorIndex::Interface *interface) : DevUsb(device, interface) {
+    pthread_mutex_init(&_lock, NULL);
+    pthread_cond_init(&_recovery_cond, NULL);
+  }
+  virtual ~Msc() {
+    delete _wrappers;
+  }
+  static DevUsb *Probe(UsbDevice *device, DescriptorIndex::Interface *interface);
+  static void SetListener(MscListener *listener) {
+    _listener.store(listener, std::memory_order_release);
+  }
+  virtual void Release() override;
+  uint64_t GetBlockNum() {
+    return _block_num;
+  }
+  uint32_t GetBlockSize() {
+    return _block_size;
+  }
+  // mem: num_blocks * GetBlockSize() bytes from offset (at most kMaxTransferLength), which should be kept until completion.
+  // return: kErrNoHwResource if too many requests are outstanding, kErrInvalid if the request is out of range
+  ReturnState SubmitRead(uint64_t lba, uint32_t num_blocks, Memory *mem, size_t offset, BlockCompletion *completion) {
+    return Submit(false, lba, num_blocks, mem, offset, completion);
+  }
+  ReturnState SubmitWrite(uint64_t lba, uint32_t num_blocks, Memory *mem, size_t offset, BlockCompletion *completion) {
+    return Submit(true, lba, num_blocks, mem, offset, completion);
+  }
+  // requests submitted in between (by any thread) are dispatched at EndBatch(), so that contiguous ones are merged into one command.
+  // requests waiting for a free command slot are merged as well.
+  void BeginBatch();
+  void EndBatch();
+  // a command transfers at most this length
+  static const size_t kMaxTransferLength = 256 * 1024;
+private:
+  // 5.1 Command Block Wrapper (CBW)
+  class CommandBlockWrapper {
+  public:
+    static const uint32_t kSignature = 0x43425355;
+    static const uint8_t kFlagDataIn = 1 << 7;
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((__packed__));
+  static_assert(sizeof(CommandBlockWrapper) == 31, "");
+
+  // 5.2 Command Status Wrapper (CSW)
+  class CommandStatusWrapper {
+  public:
+    static const uint32_t kSignature = 0x53425355;
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;
+  } __attribute__((__packed__));
+  static_assert(sizeof(CommandStatusWrapper) == 13, "");
+  // Table 5.3 Command Block Status Values
+  enum class CommandStatus : uint8_t {
+    kPassed = 0,
+    kFailed = 1,
+    kPhaseError = 2,
+  };
+
+  // SCSI operation codes (SBC-3, SPC-4)
+  enum class ScsiOpcode : uint8_t {
+    kTestUnitReady = 0x00,
+    kRequestSense = 0x03,
+    kInquiry = 0x12,
+    kReadCapacity10 = 0x25,
+    kRead10 = 0x28,
+    kWrite10 = 0x2A,
+    kRead16 = 0x88,
+    kWrite16 = 0x8A,
+    kServiceActionIn16 = 0x9E,
+  };
+  static const uint8_t kServiceActionReadCapacity16 = 0x10;
+  // 3.1 Bulk-Only Mass Storage Reset
+  static const uint8_t kRequestBulkOnlyReset = 0xFF;
+  static const int kSenseLength = 18;
+  static const int kInquiryLength = 36;
+  // a unit may report "not ready" for a while after it is attached
+  static const int kTestUnitReadyRetry = 10;
+
+  // commands in flight on the bulk endpoints
+  static const int kQueueDepth = 8;
+  // requests which have been submitted and not completed (queued or in flight)
+  static const int kMaxRequests = 256;
+  // a command merges at most kMaxMerge requests
+  static const int kMaxMerge = 32;
+  // CBW and CSW of a command slot share a cache line
+  static const int kWrapperSize = 64;
+  static const int kCswOffset = 32;
+
+  struct Request {
+    bool write;
+    uint64_t lba;
+    uint32_t num_blocks;
+    Memory *mem;
+    size_t offset;
+    BlockCompletion *completion;
+    Request *next;
+  };
+
+  class Command;
+  // completion of a phase (CBW, data, CSW) of a command
+  class PhaseCompletion : public TransferCompletion {
+  public:
+    virtual void Complete(bool success, size_t transferred) override;
+    Msc *msc;
+    Command *command;
+    int phase;
+  };
+  class Command {
+  public:
+    enum Phase {
+      kCbw,
+      kData,
+      kCsw,
+      kPhaseNum,
+    };
+    int index;
+    uint32_t tag;
+    uint32_t length;
+    // merged requests
+    Request *requests;
+    // phases which have not completed
+    std::atomic<int> remaining;
+    bool succeeded[kPhaseNum];
+    // all phases have completed, and the command waits for the recovery. protected by _lock.
+    bool failed;
+    PhaseCompletion completions[kPhaseNum];
+  };
+
+  static std::atomic<MscListener *> _listener;
+
+  uint8_t _endpt_in;
+  uint8_t _endpt_out;
+  uint64_t _block_num = 0;
+  uint32_t _block_size = 0;
+  // CBW and CSW of each command slot
+  Memory *_wrappers = nullptr;
+
+  pthread_mutex_t _lock;
+  // below are protected by _lock
+  Request _requests[kMaxRequests];
+  Request *_free_requests = nullptr;
+  // submitted requests which wait for a command slot (FIFO)
+  Request *_pending_head = nullptr;
+  Request *_pending_tail = nullptr;
+  Command _commands[kQueueDepth];
+  int _free_commands[kQueueDepth];
+  int _num_free_commands = 0;
+  uint32_t _tag = 0;
+  int _batch_depth = 0;
+  // set when the device is released, or when the recovery fails
+  bool _broken = false;
+  // the command which started the recovery. no command is dispatched until the recovery finishes.
+  Command *_failed_command = nullptr;
+  bool _stop_recovery = false;
+  pthread_cond_t _recovery_cond;
+  pthread_t _recovery_thread;
+
+  ReturnState InitSub();
+  // executes a command synchronously. only used while no block request is in flight.
+  // return: kSuccess if the CSW reports "passed". the pipes are recovered on errors.
+  ReturnState Execute(const uint8_t *cb, int cb_length, bool in, Memory *mem, size_t length);
+  // sense: kSenseLength bytes (nullptr if not needed)
+  ReturnState RequestSense(uint8_t *sense = nullptr);
+  // reads the CSW into the wrappers at offset. a stalled CSW is read again after clearing the pipe (5.3.3).
+  ReturnState ReadCsw(size_t offset);
+  bool IsValidCsw(size_t offset, uint32_t tag);
+  // 5.3.4 Reset Recovery
+  ReturnState ResetRecovery();
+  static void *RecoveryThread(void *arg);
+  void Recover();
+  // all commands in flight have completed or wait for the recovery. called with _lock held.
+  bool IsQuiescent();
+  // returns the requests of the cancelled commands to the head of the pending queue in the issued order.
+  // called with _lock held.
+  void Requeue();
+  ReturnState Submit(bool write, uint64_t lba, uint32_t num_blocks, Memory *mem, size_t offset, BlockCompletion *completion);
+  // issues pending requests to free command slots. called with _lock held.
+  void Dispatch();
+  void Issue(Command &command);
+  void CompletePhase(Command *command, int phase, bool success);
+  void FinishCommand(Command *command);
+  // takes all outstanding requests (pending or in flight) to fail them. called with _lock held.
+  Request *Abort();
+  // calls completions of the requests, and returns them to the free list
+  void CompleteRequests(Request *requests, bool success);
+  // builds the CDB of READ/WRITE (10) or (16). return: length of the CDB
+  int BuildReadWrite(uint8_t *cb, bool write, uint64_t lba, uint32_t num_blocks);
+  void BuildWrapper(CommandBlockWrapper *cbw, uint32_t tag, const uint8_t *cb, int cb_length, bool in, uint32_t length);
+};
@@ -1,6 +1,19 @@
 #pragma once
 #include <assert.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  asm volatile("pause":::"memory");
+#else
+  asm volatile("":::"memory");
+#endif
+}
 
 template<class T>
 class RingBuffer {
@@ -63,3 +76,283 @@ private:
   pthread_cond_t _cond;
   pthread_mutex_t _mutex;
 };
+
+// how a consumer of a lock-free ring buffer waits for data
+enum class RingBufferWaitStrategy {
+  kSpin,           // busy wait. lowest latency, but burns the core
+  kSpinThenFutex,  // busy wait for a while, then sleep on a futex
+  kBlocking,       // sleep on a condition variable immediately
+};
+
+// sleep/wakeup helper of the lock-free ring buffers.
+// the producer only pays an atomic load as long as nobody sleeps.
+class RingBufferWaiter {
+public:
+  RingBufferWaiter() = delete;
+  RingBufferWaiter(RingBufferWaitStrategy strategy) : _strategy(strategy) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+  ~RingBufferWaiter() {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+  }
+  // wait until ready() returns true
+  template<class F>
+  void Wait(F ready) {
+    if (_strategy == RingBufferWaitStrategy::kSpin) {
+      while(!ready()) {
+        CpuRelax();
+      }
+      return;
+    }
+    if (_strategy == RingBufferWaitStrategy::kSpinThenFutex) {
+      for (int i = 0; i < kSpinCount; i++) {
+        if (ready()) {
+          return;
+        }
+        CpuRelax();
+      }
+    }
+    while(true) {
+      uint32_t seq = _seq.load(std::memory_order_acquire);
+      _sleepers.fetch_add(1, std::memory_order_seq_cst);
+      // pairs with the fence of Notify(): either the producer sees the sleeper, or ready() sees the data
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (ready()) {
+        _sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return;
+      }
+      if (_strategy == RingBufferWaitStrategy::kSpinThenFutex) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_seq), FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+      } else {
+        pthread_mutex_lock(&_mutex);
+        while(_seq.load(std::memory_order_acquire) == seq) {
+          pthread_cond_wait(&_cond, &_mutex);
+        }
+        pthread_mutex_unlock(&_mutex);
+      }
+      _sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+  }
+  // must be called after the new data is published
+  void Notify() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleepers.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    if (_strategy == RingBufferWaitStrategy::kSpinThenFutex) {
+      _seq.fetch_add(1, std::memory_order_release);
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&_seq), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+    } else {
+      pthread_mutex_lock(&_mutex);
+      _seq.fetch_add(1, std::memory_order_release);
+      pthread_cond_broadcast(&_cond);
+      pthread_mutex_unlock(&_mutex);
+    }
+  }
+private:
+  static const int kSpinCount = 4096;
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32bit");
+
+  const RingBufferWaitStrategy _strategy;
+  std::atomic<uint32_t> _seq{0};
+  std::atomic<int> _sleepers{0};
+  pthread_cond_t _cond;
+  pthread_mutex_t _mutex;
+};
+
+static const int kRingBufferCacheLineSize = 64;
+
+static inline int RingBufferRoundUpSize(int size) {
+  assert(size > 0);
+  int rounded = 1;
+  while(rounded < size) {
+    rounded *= 2;
+  }
+  return rounded;
+}
+
+// lock-free single-producer/single-consumer queue.
+// head and tail live on separate cache lines, and each side caches the
+// other side's index so that the shared lines are touched only when the
+// cached value says the buffer looks full (or empty).
+template<class T>
+class SpscRingBuffer {
+public:
+  SpscRingBuffer() = delete;
+  SpscRingBuffer(int size, RingBufferWaitStrategy strategy = RingBufferWaitStrategy::kSpinThenFutex) : _size(RingBufferRoundUpSize(size)), _waiter(strategy) {
+    _buf = new T[_size];
+  }
+  ~SpscRingBuffer() {
+    delete[] _buf;
+  }
+  // return: successfully pushed or not
+  bool Push(const T &data) {
+    return PushBatch(&data, 1) == 1;
+  }
+  // never blocks. return: number of pushed elements
+  int PushBatch(const T *data, int num) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    if (head + num - _cached_tail > static_cast<uint64_t>(_size)) {
+      _cached_tail = _tail.load(std::memory_order_acquire);
+      uint64_t space = _size - (head - _cached_tail);
+      if (static_cast<uint64_t>(num) > space) {
+        num = space;
+      }
+    }
+    if (num == 0) {
+      return 0;
+    }
+    for (int i = 0; i < num; i++) {
+      _buf[(head + i) & (_size - 1)] = data[i];
+    }
+    _head.store(head + num, std::memory_order_release);
+    _waiter.Notify();
+    return num;
+  }
+  bool TryPop(T &data) {
+    return TryPopBatch(&data, 1) == 1;
+  }
+  // never blocks. return: number of popped elements
+  int TryPopBatch(T *data, int max) {
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    if (_cached_head - tail < static_cast<uint64_t>(max)) {
+      _cached_head = _head.load(std::memory_order_acquire);
+    }
+    uint64_t available = _cached_head - tail;
+    int num = (available < static_cast<uint64_t>(max)) ? available : max;
+    for (int i = 0; i < num; i++) {
+      data[i] = _buf[(tail + i) & (_size - 1)];
+    }
+    if (num != 0) {
+      _tail.store(tail + num, std::memory_order_release);
+    }
+    return num;
+  }
+  T Pop() {
+    T data;
+    PopBatch(&data, 1);
+    return data;
+  }
+  // blocks until at least one element is available
+  int PopBatch(T *data, int max) {
+    int num = 0;
+    _waiter.Wait([&]() { return (num = TryPopBatch(data, max)) != 0; });
+    return num;
+  }
+  // same as PopBatch(), but returns 0 once stop is set (see Wake())
+  int PopBatch(T *data, int max, const std::atomic<bool> &stop) {
+    int num = 0;
+    _waiter.Wait([&]() { return (num = TryPopBatch(data, max)) != 0 || stop.load(std::memory_order_acquire); });
+    return num;
+  }
+  // wakes the consumer to check the stop flag. unlike Push(), it can be called from any thread.
+  void Wake() {
+    _waiter.Notify();
+  }
+private:
+  // producer
+  std::atomic<uint64_t> _head{0};
+  uint64_t _cached_tail = 0;
+  char _pad1[kRingBufferCacheLineSize - sizeof(std::atomic<uint64_t>) - sizeof(uint64_t)];
+  // consumer
+  std::atomic<uint64_t> _tail{0};
+  uint64_t _cached_head = 0;
+  char _pad2[kRingBufferCacheLineSize - sizeof(std::atomic<uint64_t>) - sizeof(uint64_t)];
+
+  T *_buf;
+  const int _size;
+  RingBufferWaiter _waiter;
+};
+
+// lock-free multi-producer/single-consumer queue.
+// producers reserve slots by CAS on head and publish each slot with its
+// own sequence number, so a slow producer never blocks the other ones.
+template<class T>
+class MpscRingBuffer {
+public:
+  MpscRingBuffer() = delete;
+  MpscRingBuffer(int size, RingBufferWaitStrategy strategy = RingBufferWaitStrategy::kSpinThenFutex) : _size(RingBufferRoundUpSize(size)), _waiter(strategy) {
+    _slots = new Slot[_size];
+    for (int i = 0; i < _size; i++) {
+      _slots[i].seq.store(0, std::memory_order_relaxed);
+    }
+  }
+  ~MpscRingBuffer() {
+    delete[] _slots;
+  }
+  // return: successfully pushed or not
+  bool Push(const T &data) {
+    return PushBatch(&data, 1) == 1;
+  }
+  // never blocks. return: number of pushed elements
+  int PushBatch(const T *data, int num) {
+    uint64_t head = _head.load(std::memory_order_relaxed);
+    while(true) {
+      uint64_t space = _size - (head - _tail.load(std::memory_order_acquire));
+      if (static_cast<uint64_t>(num) > space) {
+        num = space;
+      }
+      if (num == 0) {
+        return 0;
+      }
+      if (_head.compare_exchange_weak(head, head + num, std::memory_order_relaxed, std::memory_order_relaxed)) {
+        break;
+      }
+    }
+    for (int i = 0; i < num; i++) {
+      Slot &slot = _slots[(head + i) & (_size - 1)];
+      slot.data = data[i];
+      slot.seq.store(head + i + 1, std::memory_order_release);
+    }
+    _waiter.Notify();
+    return num;
+  }
+  bool TryPop(T &data) {
+    return TryPopBatch(&data, 1) == 1;
+  }
+  // never blocks. return: number of popped elements
+  int TryPopBatch(T *data, int max) {
+    uint64_t tail = _tail.load(std::memory_order_relaxed);
+    int num = 0;
+    for (; num < max; num++) {
+      Slot &slot = _slots[(tail + num) & (_size - 1)];
+      if (slot.seq.load(std::memory_order_acquire) != tail + num + 1) {
+        break;
+      }
+      data[num] = slot.data;
+    }
+    if (num != 0) {
+      _tail.store(tail + num, std::memory_order_release);
+    }
+    return num;
+  }
+  T Pop() {
+    T data;
+    PopBatch(&data, 1);
+    return data;
+  }
+  // blocks until at least one element is available
+  int PopBatch(T *data, int max) {
+    int num = 0;
+    _waiter.Wait([&]() { return (num = TryPopBatch(data, max)) != 0; });
+    return num;
+  }
+private:
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    T data;
+  };
+
+  // producers
+  std::atomic<uint64_t> _head{0};
+  char _pad1[kRingBufferCacheLineSize - sizeof(std::atomic<uint64_t>)];
+  // consumer
+  std::atomic<uint64_t> _tail{0};
+  char _pad2[kRingBufferCacheLineSize - sizeof(std::atomic<uint64_t>)];
+
+  Slot *_slots;
+  const int _size;
+  RingBufferWaiter _waiter;
+};
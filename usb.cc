@@ -1,19 +1,19 @@
 #include "usb.h"
 
-void DevUsb::LoadDeviceDescriptor() {
-  Memory mem(sizeof(UsbCtrl::DeviceDescriptor));
+void UsbDevice::LoadDeviceDescriptor() {
+  ScopedDmaBuffer mem(sizeof(UsbCtrl::DeviceDescriptor));
   UsbCtrl::DeviceRequest request;
   request.MakePacketOfGetDescriptorRequest(UsbCtrl::DescriptorType::kDevice, 0, sizeof(UsbCtrl::DeviceDescriptor));
   assert(SendControlTransfer(request, mem, sizeof(UsbCtrl::DeviceDescriptor)));
   memcpy(&_device_desc, mem.GetVirtPtr<uint8_t>(), sizeof(UsbCtrl::DeviceDescriptor));
 }
 
-void DevUsb::LoadCombinedDescriptors() {
+void UsbDevice::LoadCombinedDescriptors() {
   int length;
   do {
     UsbCtrl::ConfigurationDescriptor config_desc;
     
-    Memory mem(sizeof(UsbCtrl::ConfigurationDescriptor));
+    ScopedDmaBuffer mem(sizeof(UsbCtrl::ConfigurationDescriptor));
     UsbCtrl::DeviceRequest request;
     request.MakePacketOfGetDescriptorRequest(UsbCtrl::DescriptorType::kConfiguration, 0, sizeof(UsbCtrl::ConfigurationDescriptor));
     assert(SendControlTransfer(request, mem, sizeof(UsbCtrl::ConfigurationDescriptor)));
@@ -25,21 +25,53 @@ void DevUsb::LoadCombinedDescriptors() {
   _combined_desc = new uint8_t[length];
 
   do {
-    Memory mem(sizeof(UsbCtrl::ConfigurationDescriptor));
+    ScopedDmaBuffer mem(length);
     UsbCtrl::DeviceRequest request;
     request.MakePacketOfGetDescriptorRequest(UsbCtrl::DescriptorType::kConfiguration, 0, length);
     assert(SendControlTransfer(request, mem, length));
     memcpy(_combined_desc, mem.GetVirtPtr<uint8_t>(), length);
   } while(0);
+
+  _desc_index.Build(_combined_desc);
+}
+
+void UsbDevice::SetConfiguration() {
+  pthread_mutex_lock(&_lock);
+  if (!_configured) {
+    ScopedDmaBuffer mem(0);
+    UsbCtrl::DeviceRequest request;
+    request.MakePacket(0b00000000, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetConfiguration), _desc_index.GetConfiguration()->configuration_value, 0, 0);
+    assert(SendControlTransfer(request, mem, 0));
+    _configured = true;
+  }
+  pthread_mutex_unlock(&_lock);
 }
 
 UsbCtrl::DummyDescriptor *DevUsb::GetDescriptorInCombinedDescriptors(UsbCtrl::DescriptorType type, int desc_index) {
   assert(desc_index >= 0);
 
-  UsbCtrl::ConfigurationDescriptor *config_desc = reinterpret_cast<UsbCtrl::ConfigurationDescriptor *>(_combined_desc);
+  switch(type) {
+  case UsbCtrl::DescriptorType::kConfiguration: {
+    assert(desc_index == 0);
+    return reinterpret_cast<UsbCtrl::DummyDescriptor *>(GetDescriptorIndex().GetConfiguration());
+  }
+  case UsbCtrl::DescriptorType::kInterface: {
+    return reinterpret_cast<UsbCtrl::DummyDescriptor *>(GetDescriptorIndex().GetInterface(desc_index).desc);
+  }
+  case UsbCtrl::DescriptorType::kEndpoint: {
+    return reinterpret_cast<UsbCtrl::DummyDescriptor *>(GetDescriptorIndex().GetEndpoint(desc_index).desc);
+  }
+  default: {
+    break;
+  }
+  }
+
+  // descriptors which are not indexed
+  uint8_t *combined_desc = _device->GetCombinedDescriptors();
+  UsbCtrl::ConfigurationDescriptor *config_desc = reinterpret_cast<UsbCtrl::ConfigurationDescriptor *>(combined_desc);
 
   for (uint16_t index = 0; index < config_desc->total_length;) {
-    UsbCtrl::DummyDescriptor *dummy_desc = reinterpret_cast<UsbCtrl::DummyDescriptor *>(_combined_desc + index);
+    UsbCtrl::DummyDescriptor *dummy_desc = reinterpret_cast<UsbCtrl::DummyDescriptor *>(combined_desc + index);
     assert(dummy_desc->length != 0);
     if (static_cast<UsbCtrl::DescriptorType>(dummy_desc->type) == type) {
       if (desc_index == 0) {
@@ -53,3 +85,134 @@ UsbCtrl::DummyDescriptor *DevUsb::GetDescriptorInCombinedDescriptors(UsbCtrl::De
 
   assert(false);
 }
+
+void DescriptorIndex::Build(uint8_t *combined_desc) {
+  Clear();
+  _config = reinterpret_cast<UsbCtrl::ConfigurationDescriptor *>(combined_desc);
+  _num_interfaces = 0;
+  _num_endpoints = 0;
+  _num_class_descs = 0;
+  _num_interface_numbers = 0;
+
+  // count descriptors first, and then fill the index
+  for (int pass = 0; pass < 2; pass++) {
+    int interface_index = -1;
+    int endpoint_index = -1;
+    int class_desc_index = 0;
+    // whether class-specific descriptors belong to the last interface or the last endpoint
+    bool in_endpoint = false;
+    for (uint16_t offset = _config->length; offset < _config->total_length;) {
+      UsbCtrl::DummyDescriptor *desc = reinterpret_cast<UsbCtrl::DummyDescriptor *>(combined_desc + offset);
+      assert(desc->length != 0);
+      switch(static_cast<UsbCtrl::DescriptorType>(desc->type)) {
+      case UsbCtrl::DescriptorType::kInterface: {
+        interface_index++;
+        in_endpoint = false;
+        UsbCtrl::InterfaceDescriptor *interface_desc = reinterpret_cast<UsbCtrl::InterfaceDescriptor *>(desc);
+        if (pass == 0) {
+          if (interface_desc->interface_number >= _num_interface_numbers) {
+            _num_interface_numbers = interface_desc->interface_number + 1;
+          }
+        } else {
+          Interface &interface = _interfaces[interface_index];
+          interface.desc = interface_desc;
+          interface.first_class_desc = class_desc_index;
+          interface.num_class_descs = 0;
+          interface.first_endpoint = endpoint_index + 1;
+          interface.num_endpoints = 0;
+          if (_first_alternate[interface_desc->interface_number] < 0) {
+            _first_alternate[interface_desc->interface_number] = interface_index;
+          }
+        }
+        break;
+      }
+      case UsbCtrl::DescriptorType::kEndpoint: {
+        endpoint_index++;
+        in_endpoint = true;
+        if (pass == 1) {
+          Endpoint &endpoint = _endpoints[endpoint_index];
+          endpoint.desc = reinterpret_cast<UsbCtrl::EndpointDescriptor *>(desc);
+          endpoint.companion = nullptr;
+          endpoint.first_class_desc = class_desc_index;
+          endpoint.num_class_descs = 0;
+          if (interface_index >= 0) {
+            _interfaces[interface_index].num_endpoints++;
+          }
+        }
+        break;
+      }
+      case UsbCtrl::DescriptorType::kSuperSpeedEndpointCompanion: {
+        if (pass == 1 && in_endpoint) {
+          _endpoints[endpoint_index].companion = reinterpret_cast<UsbCtrl::SuperSpeedEndpointCompanionDescriptor *>(desc);
+        }
+        break;
+      }
+      default: {
+        if (!UsbCtrl::IsClassSpecificDescriptorType(desc->type)) {
+          // e.g. interface association descriptors
+          break;
+        }
+        if (pass == 1) {
+          _class_descs[class_desc_index] = desc;
+          if (in_endpoint) {
+            _endpoints[endpoint_index].num_class_descs++;
+          } else if (interface_index >= 0) {
+            _interfaces[interface_index].num_class_descs++;
+          }
+        }
+        class_desc_index++;
+        break;
+      }
+      }
+      offset += desc->length;
+    }
+
+    if (pass == 0) {
+      _num_interfaces = interface_index + 1;
+      _num_endpoints = endpoint_index + 1;
+      _num_class_descs = class_desc_index;
+      _interfaces = new Interface[_num_interfaces];
+      _endpoints = new Endpoint[_num_endpoints];
+      _class_descs = new UsbCtrl::DummyDescriptor *[_num_class_descs];
+      _first_alternate = new int[_num_interface_numbers];
+      for (int i = 0; i < _num_interface_numbers; i++) {
+        _first_alternate[i] = -1;
+      }
+    }
+  }
+}
+
+bool UsbDeviceId::Match(UsbCtrl::DeviceDescriptor &device_desc, UsbCtrl::InterfaceDescriptor &interface_desc) const {
+  return (vendor_id == kAny || vendor_id == device_desc.vendor_id) &&
+    (product_id == kAny || product_id == device_desc.product_id) &&
+    (class_code == kAny || class_code == interface_desc.class_code) &&
+    (subclass_code == kAny || subclass_code == interface_desc.subclass_code) &&
+    (protocol_code == kAny || protocol_code == interface_desc.protocol_code);
+}
+
+int UsbDriverRegistry::Probe(UsbDevice *device, DevUsb **bound, int max_bound) {
+  DescriptorIndex &index = device->GetDescriptorIndex();
+  int num_bound = 0;
+  for (int i = 0; i < index.GetInterfaceNum() && num_bound < max_bound; i++) {
+    DescriptorIndex::Interface &interface = index.GetInterface(i);
+    if (interface.desc->alternate_setting != 0) {
+      continue;
+    }
+    DevUsb *dev = nullptr;
+    for (int j = 0; j < _num_drivers && dev == nullptr; j++) {
+      const UsbDriver *driver = _drivers[j];
+      for (int k = 0; k < driver->num_ids; k++) {
+        if (driver->ids[k].Match(device->GetDeviceDescriptor(), *interface.desc)) {
+          dev = driver->probe(device, &interface);
+          break;
+        }
+      }
+    }
+    if (dev == nullptr) {
+      printf("usb: info: no driver for interface %d (class %02x:%02x:%02x)\n", interface.desc->interface_number, interface.desc->class_code, interface.desc->subclass_code, interface.desc->protocol_code);
+      continue;
+    }
+    bound[num_bound++] = dev;
+  }
+  return num_bound;
+}
@@ -27,8 +27,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 #include "mem.h"
 #include "ringbuffer.h"
+#include "dmapool.h"
 
 // maximum data payload size for Control Transfers
 // quoted from 5.5.3 Control Transfer Packet Size Constraints
@@ -90,6 +92,12 @@ public:
     }
   }
   
+  // see Table 9-6 Standard Feature Selectors
+  enum class FeatureSelector : uint16_t {
+    kEndpointHalt = 0,
+    kDeviceRemoteWakeup = 1,
+  };
+
   // see Table 9-5 Descriptor Types
   enum class DescriptorType : uint8_t {
     kDevice = 0x1,
@@ -97,7 +105,15 @@ public:
     kString = 0x3,
     kInterface = 0x4,
     kEndpoint = 0x5,
+    // see Table 9-6 of USB 3.2 spec
+    kInterfaceAssociation = 0xB,
+    kSuperSpeedEndpointCompanion = 0x30,
   };
+  // class-specific descriptors use types from 0x20 to 0x3F (e.g. HID, CS_INTERFACE),
+  // except the superspeed endpoint companion descriptors
+  static bool IsClassSpecificDescriptorType(uint8_t type) {
+    return (type & 0xE0) == 0x20 && type != static_cast<uint8_t>(DescriptorType::kSuperSpeedEndpointCompanion);
+  }
   
   // see Table 9-7 Standard Device Descriptor
   class DeviceDescriptor {
@@ -176,6 +192,32 @@ public:
   } __attribute__((__packed__));
   static_assert(sizeof(EndpointDescriptor) == 7, "");
 
+  // see Table 9-27 SuperSpeed Endpoint Companion Descriptor of USB 3.2 spec
+  class SuperSpeedEndpointCompanionDescriptor {
+  public:
+    uint8_t GetMaxBurst() {
+      return max_burst;
+    }
+    // bulk endpoints only. number of streams is 2^MaxStreams.
+    uint8_t GetMaxStreams() {
+      return attributes & 0b11111;
+    }
+    // isochronous endpoints only
+    uint8_t GetMult() {
+      return attributes & 0b11;
+    }
+    uint16_t GetBytesPerInterval() {
+      return bytes_per_interval;
+    }
+  private:
+    uint8_t length;
+    uint8_t type;
+    uint8_t max_burst;
+    uint8_t attributes;
+    uint16_t bytes_per_interval;
+  } __attribute__((__packed__));
+  static_assert(sizeof(SuperSpeedEndpointCompanionDescriptor) == 6, "");
+
   class DummyDescriptor {
   public:
     uint8_t length;
@@ -186,7 +228,7 @@ public:
   // see Table 9-2
   class DeviceRequest {
   public:
-    void MakePacketOfGetDescriptorRequest(DescriptorType desc_type, uint16_t index, uint8_t length) {
+    void MakePacketOfGetDescriptorRequest(DescriptorType desc_type, uint16_t index, uint16_t length) {
       // see 9.4.3
       _request_type = 0b10000000;
       _request = static_cast<uint8_t>(RequestCode::kGetDescriptor);
@@ -220,7 +262,264 @@ public:
   } __attribute__((__packed__));
   static_assert(sizeof(DeviceRequest) == 8, "");
 
+  // a fragment of the scatter list of a bulk transfer
+  struct IoVector {
+    Memory *mem;
+    size_t offset;
+    size_t length;
+  };
+
+private:
+};
+
+// index of a configuration descriptor and the descriptors which follow it (see 9.4.3).
+// built once when the descriptors are loaded, so that drivers look up descriptors without scanning them.
+// the index points into the descriptors, so it is valid as long as they are.
+class DescriptorIndex {
+public:
+  struct Endpoint {
+    UsbCtrl::EndpointDescriptor *desc;
+    // nullptr unless the device is a superspeed one
+    UsbCtrl::SuperSpeedEndpointCompanionDescriptor *companion;
+    // class-specific descriptors which follow the endpoint descriptor
+    int first_class_desc;
+    int num_class_descs;
+  };
+  struct Interface {
+    UsbCtrl::InterfaceDescriptor *desc;
+    // class-specific descriptors between the interface descriptor and its first endpoint (e.g. HID descriptor)
+    int first_class_desc;
+    int num_class_descs;
+    // endpoints of the interface (index of GetEndpoint())
+    int first_endpoint;
+    int num_endpoints;
+  };
+
+  DescriptorIndex() {
+  }
+  ~DescriptorIndex() {
+    Clear();
+  }
+  void Build(uint8_t *combined_desc);
+  UsbCtrl::ConfigurationDescriptor *GetConfiguration() {
+    return _config;
+  }
+  // all interface descriptors (including alternate settings) in the order of appearance
+  int GetInterfaceNum() {
+    return _num_interfaces;
+  }
+  Interface &GetInterface(int index) {
+    assert(index >= 0 && index < _num_interfaces);
+    return _interfaces[index];
+  }
+  // return: nullptr if not found
+  Interface *FindInterface(int interface_number, int alternate_setting) {
+    if (interface_number >= _num_interface_numbers || _first_alternate[interface_number] < 0) {
+      return nullptr;
+    }
+    // alternate settings of an interface are contiguous and usually numbered in order (see 9.6.5)
+    int index = _first_alternate[interface_number] + alternate_setting;
+    if (index < _num_interfaces && _interfaces[index].desc->interface_number == interface_number && _interfaces[index].desc->alternate_setting == alternate_setting) {
+      return &_interfaces[index];
+    }
+    for (index = _first_alternate[interface_number]; index < _num_interfaces && _interfaces[index].desc->interface_number == interface_number; index++) {
+      if (_interfaces[index].desc->alternate_setting == alternate_setting) {
+        return &_interfaces[index];
+      }
+    }
+    return nullptr;
+  }
+  // all endpoint descriptors in the order of appearance
+  int GetEndpointNum() {
+    return _num_endpoints;
+  }
+  Endpoint &GetEndpoint(int index) {
+    assert(index >= 0 && index < _num_endpoints);
+    return _endpoints[index];
+  }
+  // index-th endpoint of the interface
+  Endpoint &GetEndpoint(Interface &interface, int index) {
+    assert(index >= 0 && index < interface.num_endpoints);
+    return _endpoints[interface.first_endpoint + index];
+  }
+  UsbCtrl::DummyDescriptor *GetClassDescriptor(int index) {
+    assert(index >= 0 && index < _num_class_descs);
+    return _class_descs[index];
+  }
+  // return: the first class-specific descriptor of the type which belongs to the interface (nullptr if not found)
+  UsbCtrl::DummyDescriptor *FindClassDescriptor(Interface &interface, uint8_t type) {
+    for (int i = 0; i < interface.num_class_descs; i++) {
+      UsbCtrl::DummyDescriptor *desc = _class_descs[interface.first_class_desc + i];
+      if (desc->type == type) {
+        return desc;
+      }
+    }
+    return nullptr;
+  }
+private:
+  void Clear() {
+    delete[] _interfaces;
+    delete[] _endpoints;
+    delete[] _class_descs;
+    delete[] _first_alternate;
+    _interfaces = nullptr;
+    _endpoints = nullptr;
+    _class_descs = nullptr;
+    _first_alternate = nullptr;
+  }
+  UsbCtrl::ConfigurationDescriptor *_config = nullptr;
+  Interface *_interfaces = nullptr;
+  int _num_interfaces = 0;
+  Endpoint *_endpoints = nullptr;
+  int _num_endpoints = 0;
+  UsbCtrl::DummyDescriptor **_class_descs = nullptr;
+  int _num_class_descs = 0;
+  // index of the alternate setting 0 of each interface number (-1 if absent)
+  int *_first_alternate = nullptr;
+  int _num_interface_numbers = 0;
+};
+
+// a completed IN packet which still lives in the DMA buffer of the endpoint.
+// the buffer is not handed back to the host controller until Release() is called.
+class InTransferLease {
+public:
+  class Owner {
+  public:
+    virtual void ReturnLease(int index) = 0;
+  };
+  InTransferLease() : _owner(nullptr), _index(0), _data(nullptr), _length(0), _timestamp(0) {
+  }
+  InTransferLease(Owner *owner, int index, uint8_t *data, int length, uint64_t timestamp) : _owner(owner), _index(index), _data(data), _length(length), _timestamp(timestamp) {
+  }
+  uint8_t *GetData() {
+    return _data;
+  }
+  // actual length of the received packet
+  int GetLength() {
+    return _length;
+  }
+  // CLOCK_MONOTONIC in ns when the transfer event was handled
+  uint64_t GetTimestamp() {
+    return _timestamp;
+  }
+  void Release() {
+    assert(_owner != nullptr);
+    _owner->ReturnLease(_index);
+    _owner = nullptr;
+  }
+private:
+  Owner *_owner;
+  int _index;
+  uint8_t *_data;
+  int _length;
+  uint64_t _timestamp;
+};
+
+// data of an isochronous endpoint for a service interval, which lives in the DMA buffer of the endpoint.
+// IN: a received packet. call Release() to recycle the buffer.
+// OUT: an empty buffer. fill it and call Submit() to schedule it.
+class IsochPacket {
+public:
+  class Owner {
+  public:
+    virtual void ReturnIsochPacket(int index, int length) = 0;
+  };
+  enum class Status {
+    kSuccess,
+    kMissedService,  // the interval was missed. no data was transferred
+    kRingUnderrun,   // (OUT) the stream ran dry before this packet. it was rescheduled
+    kRingOverrun,    // (IN) the stream ran out of buffers before this packet. data was lost in between
+    kError,
+  };
+  IsochPacket() : _owner(nullptr), _index(0), _data(nullptr), _length(0), _capacity(0), _status(Status::kSuccess) {
+  }
+  IsochPacket(Owner *owner, int index, uint8_t *data, int length, int capacity, Status status) : _owner(owner), _index(index), _data(data), _length(length), _capacity(capacity), _status(status) {
+  }
+  uint8_t *GetData() {
+    return _data;
+  }
+  // IN: actual length of the received data
+  int GetLength() {
+    return _length;
+  }
+  // max payload of a service interval
+  int GetCapacity() {
+    return _capacity;
+  }
+  // status of the previous transfer on this buffer (OUT) or of this transfer (IN)
+  Status GetStatus() {
+    return _status;
+  }
+  void Release() {
+    assert(_owner != nullptr);
+    _owner->ReturnIsochPacket(_index, _capacity);
+    _owner = nullptr;
+  }
+  void Submit(int length) {
+    assert(_owner != nullptr);
+    assert(0 <= length && length <= _capacity);
+    _owner->ReturnIsochPacket(_index, length);
+    _owner = nullptr;
+  }
+private:
+  Owner *_owner;
+  int _index;
+  uint8_t *_data;
+  int _length;
+  int _capacity;
+  Status _status;
+};
+
+// notified when an asynchronous transfer completes.
+// Complete() is called from the event handler thread, so it should not block.
+class TransferCompletion {
+public:
+  // transferred: number of bytes actually transferred
+  virtual void Complete(bool success, size_t transferred) = 0;
+};
+
+// a TransferCompletion which can be waited for
+class TransferFuture : public TransferCompletion {
+public:
+  TransferFuture() : _done(false), _success(false), _transferred(0) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+  }
+  ~TransferFuture() {
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+  }
+  virtual void Complete(bool success, size_t transferred) override {
+    pthread_mutex_lock(&_mutex);
+    _success = success;
+    _transferred = transferred;
+    _done = true;
+    pthread_cond_broadcast(&_cond);
+    pthread_mutex_unlock(&_mutex);
+  }
+  bool IsDone() {
+    pthread_mutex_lock(&_mutex);
+    bool done = _done;
+    pthread_mutex_unlock(&_mutex);
+    return done;
+  }
+  // return value: success or not
+  bool Wait(size_t &transferred) {
+    pthread_mutex_lock(&_mutex);
+    while(!_done) {
+      pthread_cond_wait(&_cond, &_mutex);
+    }
+    transferred = _transferred;
+    bool success = _success;
+    pthread_mutex_unlock(&_mutex);
+    return success;
+  }
 private:
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  bool _done;
+  bool _success;
+  size_t _transferred;
 };
 
 class Hub;
@@ -228,48 +527,202 @@ class DevUsb;
 
 class DevUsbController {
 public:
-  virtual bool SendControlTransfer(UsbCtrl::DeviceRequest &request, Memory &mem, size_t data_size, int device_addr) = 0;
-  virtual void InitHub(int number_of_ports, int ttt, int device_addr) = 0;
-  virtual DevUsb *AttachDevice(Hub *hub, int hub_addr, int hub_port_id) = 0;
-  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, RingBuffer<uint8_t *> *buf) = 0;
+  virtual bool SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size, int device_addr) = 0;
+  // mtt: the hub is a high-speed hub and its multiple TT interface is selected
+  virtual void InitHub(int number_of_ports, int ttt, bool mtt, int device_addr) = 0;
+  // number of hubs between the root hub and the hub (used by Set Hub Depth request)
+  virtual int GetHubDepth(int device_addr) = 0;
+  // starts enumerating the device on the port of the hub. returns without waiting for it.
+  // the caller should hold the default address, which is released by the enumeration on success.
+  virtual ReturnState AttachDevice(Hub *hub, int hub_addr, int hub_port_id) = 0;
+  // a device answers to the default address (0) from the end of its port reset until it is addressed,
+  // and requests to the address reach every such device on the same bus (the tree below a root port).
+  // so a hub holds the default address of its bus while a port is reset and the device is attached.
+  virtual void LockDefaultAddress(int hub_addr) = 0;
+  virtual void UnlockDefaultAddress(int hub_addr) = 0;
+  // releases the device attached by AttachDevice(). does nothing if no device is attached to the port.
+  virtual void DetachDevice(int hub_addr, int hub_port_id) = 0;
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<uint8_t *> *buf) = 0;
+  // zero-copy variant: packets are delivered as leases on the DMA buffer
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<InTransferLease> *lease_buf) = 0;
+  // no buffer is posted. data is moved by BulkTransfer().
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize) = 0;
+  // isochronous streaming. interval: bInterval of the endpoint descriptor.
+  // max_burst, mult: bMaxBurst and Mult of the SuperSpeed companion descriptor (0 otherwise)
+  // (high-bandwidth high-speed endpoints encode additional transactions in bits 11-12 of max_packetsize)
+  // buf should be able to hold as many packets as the ring queues (DevXhci: 64).
+  virtual ReturnState SetupIsochEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) = 0;
+  // bulk endpoint of a SuperSpeed device with streams (e.g. UAS). no buffer is posted.
+  // num_streams: number of streams to allocate (up to 2^MaxStreams of the companion descriptor).
+  // updated to the number actually allocated. streams are identified by 1..num_streams.
+  virtual ReturnState SetupStreamEndpoint(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int &num_streams) = 0;
+  // transfer the scatter list as a single submission. blocks until the transfer completes.
+  // stream_id: stream of the endpoint (0 if the endpoint has no streams)
+  // transferred: number of bytes actually transferred (less than requested on a short packet)
+  virtual ReturnState BulkTransfer(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred) = 0;
+  // same as BulkTransfer(), but returns as soon as the TD is queued. many TDs can be queued on an endpoint (or a stream).
+  // the scatter list can be reused after return. the buffers should be kept until completion.
+  virtual ReturnState SubmitBulkTransfer(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) = 0;
+  // cancels the TDs queued on a bulk or interrupt endpoint (their completions are notified with failure),
+  // and resets the host side of the endpoint, including its data toggle. blocks until done, so this
+  // should not be called from completions.
+  virtual ReturnState ResetEndpoint(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction) = 0;
+  // doorbells of asynchronous submissions (and returned leases) on this thread are deferred
+  // until the outermost EndSubmissionBatch(), and each endpoint is kicked once.
+  // synchronous transfers are not affected.
+  virtual void BeginSubmissionBatch() = 0;
+  virtual void EndSubmissionBatch() = 0;
 };
 
+class SubmissionBatch {
+public:
+  SubmissionBatch(DevUsbController *hc) : _hc(hc) {
+    _hc->BeginSubmissionBatch();
+  }
+  ~SubmissionBatch() {
+    _hc->EndSubmissionBatch();
+  }
+private:
+  DevUsbController *_hc;
+};
+
+// a device on the bus, which is shared by the drivers bound to its interfaces.
+// the descriptors are fetched once at the enumeration, and drivers are matched against this copy.
+class UsbDevice {
+public:
+  UsbDevice() = delete;
+  UsbDevice(DevUsbController *hc, int addr) : _hc(hc), _addr(addr) {
+    pthread_mutex_init(&_lock, NULL);
+  }
+  ~UsbDevice() {
+    delete[] _combined_desc;
+  }
+  void LoadDescriptors() {
+    LoadDeviceDescriptor();
+    LoadCombinedDescriptors();
+  }
+  // the configuration is set only once, since Set Configuration resets all endpoints of the device (9.1.1.5)
+  void SetConfiguration();
+  UsbCtrl::DeviceDescriptor &GetDeviceDescriptor() {
+    return _device_desc;
+  }
+  uint8_t *GetCombinedDescriptors() {
+    return _combined_desc;
+  }
+  DescriptorIndex &GetDescriptorIndex() {
+    return _desc_index;
+  }
+  DevUsbController *GetHostController() {
+    return _hc;
+  }
+  int GetAddr() {
+    return _addr;
+  }
+private:
+  void LoadDeviceDescriptor();
+  void LoadCombinedDescriptors();
+  bool SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size) {
+    return _hc->SendControlTransfer(request, buf, data_size, _addr);
+  }
+
+  DevUsbController * const _hc;
+  const int _addr;
+  UsbCtrl::DeviceDescriptor _device_desc;
+  uint8_t *_combined_desc = nullptr;
+  // built by LoadCombinedDescriptors()
+  DescriptorIndex _desc_index;
+  pthread_mutex_t _lock;
+  bool _configured = false;
+};
+
+// a driver instance bound to an interface of a device.
+// the device is shared with the other interfaces, and is valid until Release() returns.
 class DevUsb {
 public:
+  virtual ~DevUsb() {
+  }
   virtual void Release() = 0;
 protected:
   DevUsb() = delete;
-  DevUsb(DevUsbController *hc, int addr) : _hc(hc), _addr(addr), _combined_desc(nullptr) {
+  DevUsb(UsbDevice *device, DescriptorIndex::Interface *interface) : _device(device), _interface(interface), _hc(device->GetHostController()), _addr(device->GetAddr()) {
   }
-  ~DevUsb() {
-    delete _combined_desc;
-  }
-  void LoadDeviceDescriptor();
-  void LoadCombinedDescriptors();
   UsbCtrl::InterfaceDescriptor *GetInterfaceDescriptorInCombinedDescriptors(int desc_index) {
     return reinterpret_cast<UsbCtrl::InterfaceDescriptor *>(GetDescriptorInCombinedDescriptors(UsbCtrl::DescriptorType::kInterface, desc_index));
   }
   UsbCtrl::ConfigurationDescriptor *GetConfigurationDescriptorInCombinedDescriptors() {
-    return reinterpret_cast<UsbCtrl::ConfigurationDescriptor *>(_combined_desc);
+    return _device->GetDescriptorIndex().GetConfiguration();
   }
   UsbCtrl::EndpointDescriptor *GetEndpointDescriptorInCombinedDescriptors(int desc_index) {
     return reinterpret_cast<UsbCtrl::EndpointDescriptor *>(GetDescriptorInCombinedDescriptors(UsbCtrl::DescriptorType::kEndpoint, desc_index));
   }
+  // buf should be taken from DmaBufferPool (see ScopedDmaBuffer) unless it is reused
+  bool SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size) {
+    return _hc->SendControlTransfer(request, buf, data_size, _addr);
+  }
   bool SendControlTransfer(UsbCtrl::DeviceRequest &request, Memory &mem, size_t data_size) {
-    return _hc->SendControlTransfer(request, mem, data_size, _addr);
+    DmaBuffer buf(mem, data_size);
+    return SendControlTransfer(request, buf, data_size);
   }
-  ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, RingBuffer<uint8_t *> *buf) {
+  ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<uint8_t *> *buf) {
     RETURN_IF_ERR(_hc->SetupEndpoint(endpt_address, _addr, interval, type, direction, max_packetsize, buf));
-    do {
-      Memory mem(0);
-      UsbCtrl::DeviceRequest request;
-      request.MakePacket(0b00000000, static_cast<uint8_t>(UsbCtrl::RequestCode::kSetConfiguration), GetConfigurationDescriptorInCombinedDescriptors()->configuration_value, 0, 0);
-      assert(SendControlTransfer(request, mem, 0));
-    } while(0);
+    SetConfiguration();
+    return ReturnState::kSuccess;
+  }
+  ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<InTransferLease> *lease_buf) {
+    RETURN_IF_ERR(_hc->SetupEndpoint(endpt_address, _addr, interval, type, direction, max_packetsize, lease_buf));
+    SetConfiguration();
+    return ReturnState::kSuccess;
+  }
+  ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize) {
+    RETURN_IF_ERR(_hc->SetupEndpoint(endpt_address, _addr, interval, type, direction, max_packetsize));
+    SetConfiguration();
+    return ReturnState::kSuccess;
+  }
+  ReturnState SetupIsochEndpoint(uint8_t endpt_address, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) {
+    RETURN_IF_ERR(_hc->SetupIsochEndpoint(endpt_address, _addr, interval, direction, max_packetsize, max_burst, mult, buf));
+    SetConfiguration();
+    return ReturnState::kSuccess;
+  }
+  ReturnState SetupStreamEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int &num_streams) {
+    RETURN_IF_ERR(_hc->SetupStreamEndpoint(endpt_address, _addr, direction, max_packetsize, max_burst, num_streams));
+    SetConfiguration();
     return ReturnState::kSuccess;
   }
-  void InitHub(int number_of_ports, int ttt) {
-    _hc->InitHub(number_of_ports, ttt, _addr);
+  ReturnState BulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred) {
+    return _hc->BulkTransfer(endpt_address, _addr, direction, 0, iov, iovcnt, transferred);
+  }
+  ReturnState BulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred) {
+    return _hc->BulkTransfer(endpt_address, _addr, direction, stream_id, iov, iovcnt, transferred);
+  }
+  ReturnState BulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, Memory &mem, size_t length, size_t &transferred) {
+    UsbCtrl::IoVector iov = {&mem, 0, length};
+    return BulkTransfer(endpt_address, direction, &iov, 1, transferred);
+  }
+  ReturnState SubmitBulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) {
+    return _hc->SubmitBulkTransfer(endpt_address, _addr, direction, 0, iov, iovcnt, completion);
+  }
+  ReturnState SubmitBulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) {
+    return _hc->SubmitBulkTransfer(endpt_address, _addr, direction, stream_id, iov, iovcnt, completion);
+  }
+  // clears the halt of the endpoint on both sides (9.4.5), so that they restart from DATA0.
+  // the TDs queued on the endpoint are cancelled.
+  ReturnState ClearEndpointHalt(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
+    RETURN_IF_ERR(_hc->ResetEndpoint(endpt_address, _addr, direction));
+    ScopedDmaBuffer buf(0);
+    UsbCtrl::DeviceRequest request;
+    // the endpoint address has the direction in bit 7 (9.3.4)
+    uint16_t index = endpt_address | ((direction == UsbCtrl::PacketIdentification::kIn) ? 0x80 : 0);
+    request.MakePacket(0b00000010, static_cast<uint8_t>(UsbCtrl::RequestCode::kClearFeature), static_cast<uint16_t>(UsbCtrl::FeatureSelector::kEndpointHalt), index, 0);
+    return SendControlTransfer(request, buf, 0) ? ReturnState::kSuccess : ReturnState::kErrUnknown;
+  }
+  void SetConfiguration() {
+    _device->SetConfiguration();
+  }
+  void InitHub(int number_of_ports, int ttt, bool mtt) {
+    _hc->InitHub(number_of_ports, ttt, mtt, _addr);
+  }
+  int GetHubDepth() {
+    return _hc->GetHubDepth(_addr);
   }
   DevUsbController *GetHostController() {
     return _hc;
@@ -279,9 +732,74 @@ protected:
   }
 public:
   UsbCtrl::DummyDescriptor *GetDescriptorInCombinedDescriptors(UsbCtrl::DescriptorType type, int desc_index);
+  UsbCtrl::DeviceDescriptor &GetDeviceDescriptor() {
+    return _device->GetDeviceDescriptor();
+  }
+  DescriptorIndex &GetDescriptorIndex() {
+    return _device->GetDescriptorIndex();
+  }
+  // the interface which the driver is bound to
+  DescriptorIndex::Interface &GetInterface() {
+    return *_interface;
+  }
+  // index-th endpoint of the bound interface
+  DescriptorIndex::Endpoint &GetEndpoint(int index) {
+    return GetDescriptorIndex().GetEndpoint(*_interface, index);
+  }
 
-  UsbCtrl::DeviceDescriptor _device_desc;
-  uint8_t *_combined_desc;
+  UsbDevice * const _device;
+  DescriptorIndex::Interface * const _interface;
   DevUsbController * const _hc;
   const int _addr;
 };
+
+// match table entry of a driver. fields set to kAny match any value.
+// vendor_id and product_id are compared with the device descriptor, and the codes with the interface descriptor.
+struct UsbDeviceId {
+  static const int kAny = -1;
+  int vendor_id;
+  int product_id;
+  int class_code;
+  int subclass_code;
+  int protocol_code;
+  bool Match(UsbCtrl::DeviceDescriptor &device_desc, UsbCtrl::InterfaceDescriptor &interface_desc) const;
+};
+
+struct UsbDriver {
+  const char *name;
+  const UsbDeviceId *ids;
+  int num_ids;
+  // return: the instance bound to the interface (nullptr if the driver declines it)
+  DevUsb *(*probe)(UsbDevice *device, DescriptorIndex::Interface *interface);
+};
+
+// drivers register themselves with UsbDriverRegistry::Registrar, so that a new driver needs no change of the host controller.
+class UsbDriverRegistry {
+public:
+  static UsbDriverRegistry &GetInstance() {
+    static UsbDriverRegistry registry;
+    return registry;
+  }
+  // drivers are probed in the order of registration
+  void Register(const UsbDriver *driver) {
+    assert(_num_drivers < kMaxDrivers);
+    _drivers[_num_drivers++] = driver;
+  }
+  // binds a driver to each interface (alternate setting 0) of the device, so that a composite device has several drivers.
+  // the descriptors of the device should be loaded.
+  // return: the number of bound instances, which are stored in bound
+  int Probe(UsbDevice *device, DevUsb **bound, int max_bound);
+  // registers a driver at static initialization
+  class Registrar {
+  public:
+    Registrar(const UsbDriver *driver) {
+      GetInstance().Register(driver);
+    }
+  };
+private:
+  UsbDriverRegistry() {
+  }
+  static const int kMaxDrivers = 32;
+  const UsbDriver *_drivers[kMaxDrivers];
+  int _num_drivers = 0;
+};
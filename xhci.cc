@@ -1,6 +1,5 @@
 #include "xhci.h"
 #include "hub.h"
-#include "keyboard.h"
 
 // Table 138: TRB Completion Code Definitions
 const char* const DevXhci::_completion_code_table[] = {
@@ -43,7 +42,19 @@ const char* const DevXhci::_completion_code_table[] = {
   "Split Transaction Error",
 };
 
+thread_local int DevXhci::_submission_batch_depth = 0;
+
 void DevXhci::Init() {
+  for (int i = 0; i < kDoorbellNum; i++) {
+    _pending_doorbell[i] = 0;
+  }
+  for (int i = 0; i < kDoorbellNum / 64; i++) {
+    _pending_doorbell_slots[i] = 0;
+  }
+  for (int i = 0; i <= kMaxPorts; i++) {
+    _port_status_change_pending[i] = false;
+  }
+
   _pci.Init();
   uint16_t vid, did;
   _pci.ReadPciReg(DevPci::kVendorIDReg, vid);
@@ -79,6 +90,10 @@ void DevXhci::Init() {
     asm volatile("":::"memory");
   }
 
+  // take the controller from the BIOS before it is reset
+  _excapreg_base_addr = _capreg_base_addr32 + MaskValue<CapReg32HccParams1Xecp>(_capreg_base_addr32[kCapReg32OffsetHccParams1]);
+  _ext_caps.Init(_excapreg_base_addr);
+
   if (IsFlagClear(_opreg_base_addr[kOpRegOffsetUsbSts], kOpRegUsbStsFlagHchalted)) {
     // halt controller
     _opreg_base_addr[kOpRegOffsetUsbCmd] &= ~kOpRegUsbCmdFlagRunStop;
@@ -97,7 +112,15 @@ void DevXhci::Init() {
 
   // get information
   _max_slots = MaskValue<CapReg32HcsParams1MaxSlots>(_capreg_base_addr32[kCapReg32OffsetHcsParams1]);
-  _excapreg_base_addr = _capreg_base_addr32 + MaskValue<CapReg32HccParams1Xecp>(_capreg_base_addr32[kCapReg32OffsetHccParams1]);
+  int max_psa_size = MaskValue<CapReg32HccParams1MaxPsaSize>(_capreg_base_addr32[kCapReg32OffsetHccParams1]);
+  _max_psa_size = (max_psa_size == 0) ? 0 : (2 << max_psa_size);
+  uint32_t ist = MaskValue<CapReg32HcsParams2Ist>(_capreg_base_addr32[kCapReg32OffsetHcsParams2]);
+  if (IsFlagSet(ist, kCapReg32HcsParams2IstFlagFrames)) {
+    _ist_frames = ist & ~kCapReg32HcsParams2IstFlagFrames;
+  } else {
+    // microframes, rounded up to frames
+    _ist_frames = (ist + 7) / 8;
+  }
   _doorbell_array_base_addr = _capreg_base_addr32 + MaskValue<CapReg32DboffDoorbellArrayOffset>(_capreg_base_addr32[kCapReg32OffsetDboff]);
   _runtime_base_addr = _capreg_base_addr32 + MaskValue<CapReg32TrsoffRuntimeSpaceOffset>(_capreg_base_addr32[kCapReg32OffsetRtsoff]) * 8;
 
@@ -118,16 +141,36 @@ void DevXhci::Init() {
 
   SetupScratchPad();
 
+#ifndef NDEBUG
+  TrbRing::CheckGrowth(this);
+#endif
+
   // Define the Command Ring Dequeue Pointer by programming the Command Ring Control Register (5.4.5) with a 64-bit address pointing to the starting address of the first TRB of the Command Ring.
   _command_ring.Init(this);
   _opreg_base_addr[kOpRegOffsetCrcr] = (_command_ring.GetMemory().GetPhysPtr() & kOpRegCrcrMaskCommandRingPointer) | kOpRegCrcrFlagRingCycleStatus;
   _opreg_base_addr[kOpRegOffsetCrcr + 1] = _command_ring.GetMemory().GetPhysPtr() >> 32;
 
   // Initialize interrupts
-  _event_ring.Init(this);
-  _event_ring_segment_table.Init(&_event_ring);
+  int max_interrupters = MaskValue<CapReg32HcsParams1MaxIntrs>(_capreg_base_addr32[kCapReg32OffsetHcsParams1]);
+  if (_num_interrupters > max_interrupters) {
+    _num_interrupters = max_interrupters;
+  }
+  // ERSTSZ should not exceed 2^ERST Max (e.g. 1 on QEMU)
+  int erst_max = MaskValue<CapReg32HcsParams2ErstMax>(_capreg_base_addr32[kCapReg32OffsetHcsParams2]);
+  int num_event_ring_segments = EventRing::kDefaultSegmentNum;
+  if (num_event_ring_segments > (1 << erst_max)) {
+    num_event_ring_segments = 1 << erst_max;
+  }
+  for (int i = 0; i < _num_interrupters; i++) {
+    _event_ring[i].Init(this, num_event_ring_segments);
+    _event_ring_segment_table[i].Init(&_event_ring[i]);
+    sem_init(&_interrupter_wakeup[i], 0, 0);
+    _interrupter_sleeping[i] = false;
+  }
     _opreg_base_addr[kOpRegOffsetUsbCmd] |= kOpRegUsbCmdFlagInterrupterEnable;
-  _interrupter.Init(_runtime_base_addr + kRunRegIntRegSet, &_event_ring_segment_table, &_event_ring);
+  for (int i = 0; i < _num_interrupters; i++) {
+    _interrupter[i].Init(_runtime_base_addr + kRunRegIntRegSet + i * kRunRegIntRegSetSize, &_event_ring_segment_table[i], &_event_ring[i]);
+  }
     
   // start controller
   _opreg_base_addr[kOpRegOffsetUsbCmd] |= kOpRegUsbCmdFlagRunStop;
@@ -147,21 +190,220 @@ void DevXhci::Init() {
     _root_hub_device_list[i] = nullptr;
   }
 
-  if (pthread_mutex_init(&_mp, NULL) < 0) {
+  if (pthread_rwlock_init(&_device_list_lock, NULL) != 0) {
+    perror("pthread_rwlock_init:");
+  }
+  _root_port_lock = new pthread_mutex_t[max_ports + 1];
+  for (int i = 0; i <= max_ports; i++) {
+    if (pthread_mutex_init(&_root_port_lock[i], NULL) != 0) {
+      perror("pthread_mutex_init:");
+    }
+  }
+  if (pthread_mutex_init(&_default_address_lock, NULL) != 0) {
     perror("pthread_mutex_init:");
   }
+  pthread_cond_init(&_default_address_cond, NULL);
+  _default_address_busy = new bool[max_ports + 1];
+  for (int i = 0; i <= max_ports; i++) {
+    _default_address_busy[i] = false;
+  }
 
   printf("xhci: info: successfully initialized!\n");
 }
 
+void DevXhci::Run() {
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, HandleEnumeration, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  if (pthread_create(&tid, NULL, HandlePortStatusChange, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  if (pthread_create(&tid, NULL, AttachAll, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
+  }
+  for (int i = 1; i < _num_interrupters; i++) {
+    auto container = new ContainerForInterrupterThread;
+    container->that = this;
+    container->index = i;
+    if (pthread_create(&tid, NULL, HandleInterrupter, container) != 0) {
+      perror("pthread_create:");
+      exit(1);
+    }
+  }
+  RunInterrupter(0);
+}
+
+void DevXhci::RunInterrupter(int index) {
+  if (_interrupter_core[index] >= 0) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(_interrupter_core[index], &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+      perror("pthread_setaffinity_np:");
+    }
+  }
+  while(true) {
+    if (_poll_mode != PollMode::kPolling) {
+      WaitInterrupt(index);
+      // TRBs re-posted by completion handlers are kicked once per budget
+      BeginSubmissionBatch();
+      bool remaining = _interrupter[index].Handle(_event_budget);
+      EndSubmissionBatch();
+      while(remaining) {
+        // let consumers of the completions run between budgets
+        sched_yield();
+        BeginSubmissionBatch();
+        remaining = _interrupter[index].Continue(_event_budget);
+        EndSubmissionBatch();
+      }
+      _interrupter[index].AdaptModeration();
+    }
+    if (_poll_mode != PollMode::kInterrupt) {
+      PollEvents(index);
+    }
+  }
+}
+
+// uio_pci_generic only provides INTx, which is shared by all interrupters.
+// the primary interrupter waits for it and wakes up the secondary ones.
+void DevXhci::WaitInterrupt(int index) {
+  if (index == 0) {
+    _pci.WaitInterrupt();
+    WakeupInterrupters();
+    return;
+  }
+  _interrupter_sleeping[index] = true;
+  if (_interrupter[index].IsPending() && _interrupter_sleeping[index].exchange(false)) {
+    return;
+  }
+  sem_wait(&_interrupter_wakeup[index]);
+}
+
+void DevXhci::WakeupInterrupters() {
+  for (int i = 1; i < _num_interrupters; i++) {
+    if (_interrupter_sleeping[i] && _interrupter[i].IsPending() && _interrupter_sleeping[i].exchange(false)) {
+      sem_post(&_interrupter_wakeup[i]);
+    }
+  }
+}
+
+// spin on the cycle bit of the event ring.
+// in kHybrid mode, return when no event arrives within the idle budget (like NAPI).
+void DevXhci::PollEvents(int index) {
+  struct timespec idle_start;
+  bool idle = false;
+  int spins = 0;
+  while(true) {
+    if (index == 0 && ++spins == kWakeupCheckSpins) {
+      // nobody waits for INTx while polling. IMAN is read through MMIO, so not on every spin.
+      spins = 0;
+      WakeupInterrupters();
+    }
+    if (_interrupter[index].HasPendingEvent()) {
+      BeginSubmissionBatch();
+      int handled = _interrupter[index].Poll(_event_budget);
+      EndSubmissionBatch();
+      _interrupter[index].AdaptModeration();
+      if (handled == _event_budget) {
+        sched_yield();
+      }
+      idle = false;
+      continue;
+    }
+    if (_poll_mode == PollMode::kPolling) {
+      CpuRelax();
+      continue;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!idle) {
+      idle = true;
+      idle_start = now;
+    } else if ((now.tv_sec - idle_start.tv_sec) * 1000000 + (now.tv_nsec - idle_start.tv_nsec) / 1000 >= _poll_idle_budget_us) {
+      if (index == 0) {
+        WakeupInterrupters();
+      }
+      break;
+    }
+    CpuRelax();
+  }
+
+  // go back to the interrupt mode.
+  // the pending flag was left set while polling, so clear it to avoid a spurious wakeup,
+  // and then pick up events which arrived before clearing it.
+  // no interrupt is raised for events left in the ring, so drain all of them.
+  _interrupter[index].ClearPending();
+  while(true) {
+    BeginSubmissionBatch();
+    int handled = _interrupter[index].Poll(_event_budget);
+    EndSubmissionBatch();
+    if (handled < _event_budget) {
+      break;
+    }
+    sched_yield();
+  }
+  _interrupter[index].AdaptModeration();
+}
+
+void DevXhci::FlushDoorbells() {
+  for (int i = 0; i < kDoorbellNum / 64; i++) {
+    uint64_t slots = _pending_doorbell_slots[i].exchange(0, std::memory_order_acquire);
+    while(slots != 0) {
+      int slot_id = i * 64 + __builtin_ctzll(slots);
+      slots &= slots - 1;
+      uint32_t targets = _pending_doorbell[slot_id].exchange(0, std::memory_order_acquire);
+      while(targets != 0) {
+        int target = __builtin_ctz(targets);
+        targets &= targets - 1;
+        if (slot_id == 0) {
+          RingCommandDoorbell();
+        } else {
+          RingEndpointDoorbell(slot_id, target);
+        }
+      }
+    }
+  }
+}
+
 void DevXhci::AttachAllSub() {
   int max_ports = MaskValue<CapReg32HcsParams1MaxPorts>(_capreg_base_addr32[kCapReg32OffsetHcsParams1]);
+  // MaxPorts is 8 bits wide
+  bool resetting[256];
+
+  // reset all connected ports at once, instead of waiting for each reset in turn.
+  // locks are taken in ascending order of port id.
+  for (int i = 0; i < max_ports; i++) {
+    int root_port_id = i + 1;
+    volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
+    pthread_mutex_lock(&_root_port_lock[root_port_id]);
+    resetting[i] = IsFlagSet(*portsc, kOpRegPortscFlagCcs) && IsFlagClear(*portsc, kOpRegPortscFlagPortEnabled) && _root_hub_device_list[root_port_id] == nullptr;
+    if (resetting[i]) {
+      StartReset(root_port_id);
+    }
+  }
+
+  for (int i = 0; i < max_ports; i++) {
+    int root_port_id = i + 1;
+    if (resetting[i]) {
+      while(!IsResetCompleted(root_port_id)) {
+        asm volatile("":::"memory");
+      }
+      FinishReset(root_port_id);
+    }
+  }
+
+  // enumeration proceeds in the background
   for (int i = 0; i < max_ports; i++) {
     int root_port_id = i + 1;
     volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
     if (IsFlagSet(*portsc, kOpRegPortscFlagCcs)) {
       Attach(root_port_id);
     }
+    pthread_mutex_unlock(&_root_port_lock[root_port_id]);
   }
 }
 
@@ -176,7 +418,7 @@ void DevXhci::Attach(int root_port_id) {
       Reset(root_port_id);
     }
 
-    device->Init();
+    device->StartEnumeration();
   }
 }
 
@@ -190,6 +432,14 @@ void DevXhci::Detach(int root_port_id) {
 }
 
 void DevXhci::Reset(int root_port_id) {
+  StartReset(root_port_id);
+  while(!IsResetCompleted(root_port_id)) {
+    asm volatile("":::"memory");
+  }
+  FinishReset(root_port_id);
+}
+
+void DevXhci::StartReset(int root_port_id) {
   volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
   
   // reset the port
@@ -198,108 +448,230 @@ void DevXhci::Reset(int root_port_id) {
     asm volatile("":::"memory");
   }
   *portsc = (*portsc & ~kOpRegPortscFlagsRwcBits) | kOpRegPortscFlagPortReset;
+}
 
-  while(IsFlagClear(*portsc, kOpRegPortscFlagPrc)) {
-    asm volatile("":::"memory");
-  }
+bool DevXhci::IsResetCompleted(int root_port_id) {
+  volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
+  return IsFlagSet(*portsc, kOpRegPortscFlagPrc);
+}
+
+void DevXhci::FinishReset(int root_port_id) {
+  volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
   *portsc = (*portsc & ~kOpRegPortscFlagsRwcBits) | kOpRegPortscFlagPrc;
 
   assert(IsFlagSet(*portsc, kOpRegPortscFlagPortEnabled));
 }
 
-DevUsb *DevXhci::Device::Init() {
+void DevXhci::Device::StartEnumeration(bool default_address_locked) {
+  _default_address_locked = default_address_locked;
   // 4.3.3 Device Slot Initialization
-  do {
-    CommandRing::EnableSlotCommandTrb com(_hc->GetSlotType(_root_port_id));
-    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
-    if (info.completion_code != TrbCompletionCode::kSuccess) {
-      return nullptr;
+  CommandRing::EnableSlotCommandTrb com(_hc->GetSlotType(_root_port_id));
+  _enumeration_state = EnumerationState::kEnableSlot;
+  _hc->_command_ring.Submit(com, _command_handler);
+}
+
+void DevXhci::Device::AdvanceEnumeration() {
+  switch(_enumeration_state) {
+  case EnumerationState::kEnableSlot: {
+    if (_command_info.completion_code != TrbCompletionCode::kSuccess) {
+      FailEnumeration("enable slot", _command_info.completion_code);
+      return;
     }
-    _slot_id = info.slot_id;
-  } while(0);
+    _slot_id = _command_info.slot_id;
+    _interrupter_target = _hc->GetDefaultInterrupterTarget(_slot_id);
 
-  _hc->RegisterDevice(this);
+    _hc->RegisterDevice(this);
 
-  if (SetRouteString() != ReturnState::kSuccess) {
-    return nullptr;
-  }
-  if (_input_context.Init(this)) {
-    return nullptr;
-  }
-  _output_context.Init(this);
-  _hc->SetDcbaap(_output_context.GetPhysAddr(), _slot_id);
+    if (SetRouteString() != ReturnState::kSuccess) {
+      FailEnumeration("set route string");
+      return;
+    }
+    if (_input_context.Init(this)) {
+      FailEnumeration("init input context");
+      return;
+    }
+    _output_context.Init(this);
+    _hc->SetDcbaap(_output_context.GetPhysAddr(), _slot_id);
 
-  do {
     CommandRing::AddressDeviceCommandTrb com(_input_context.GetPhysAddr(), _slot_id, true);
-    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
-    if (info.completion_code != TrbCompletionCode::kSuccess) {
-      return nullptr;
+    _enumeration_state = EnumerationState::kAddressDeviceBsr;
+    _hc->_command_ring.Submit(com, _command_handler);
+    return;
+  }
+  case EnumerationState::kAddressDeviceBsr: {
+    if (_command_info.completion_code != TrbCompletionCode::kSuccess) {
+      FailEnumeration("address device (BSR=1)", _command_info.completion_code);
+      return;
     }
-  } while(0);
-  do {
     CommandRing::AddressDeviceCommandTrb com(_input_context.GetPhysAddr(), _slot_id, false);
-    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
-    if (info.completion_code != TrbCompletionCode::kSuccess) {
-      return nullptr;
+    _enumeration_state = EnumerationState::kAddressDevice;
+    _hc->_command_ring.Submit(com, _command_handler);
+    return;
+  }
+  case EnumerationState::kAddressDevice: {
+    // the device has left the default address (or never will)
+    UnlockDefaultAddress();
+    if (_command_info.completion_code != TrbCompletionCode::kSuccess) {
+      FailEnumeration("address device", _command_info.completion_code);
+      return;
     }
-  } while(0);
-
-  switch(GetPortSpeed()) {
-  case UsbCtrl::PortSpeed::kFullSpeed: {
-    do {
-      Memory mem(8);
+    if (GetPortSpeed() == UsbCtrl::PortSpeed::kFullSpeed) {
+      // the max packet size of the default control endpoint is unknown for full-speed devices
+      _enumeration_buf = DmaBufferPool::GetInstance().Alloc(8);
       UsbCtrl::DeviceRequest request;
       request.MakePacketOfGetDescriptorRequest(UsbCtrl::DescriptorType::kDevice, 0, 8);
-      if (!SendControlTransfer(request, mem, 8)) {
-        return nullptr;
-      }
-
-      _input_context.UpdateMaxPacketSizeOfEndpoint0(mem.GetVirtPtr<UsbCtrl::DeviceDescriptor>()->max_packet_size);
-    } while(0);
+      _enumeration_state = EnumerationState::kGetMaxPacketSize;
+      SubmitControlTransfer(request, *_enumeration_buf, 8);
+      return;
+    }
+    break;
+  }
+  case EnumerationState::kGetMaxPacketSize: {
+    if (!_transfer_success) {
+      DmaBufferPool::GetInstance().Free(_enumeration_buf);
+      _enumeration_buf = nullptr;
+      FailEnumeration("get descriptor");
+      return;
+    }
+    _input_context.UpdateMaxPacketSizeOfEndpoint0(_enumeration_buf->GetVirtPtr<UsbCtrl::DeviceDescriptor>()->max_packet_size);
+    DmaBufferPool::GetInstance().Free(_enumeration_buf);
+    _enumeration_buf = nullptr;
 
-    do {
-      CommandRing::EvaluateContextCommandTrb com(_input_context.GetPhysAddr(), _slot_id);
-      CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
-      if (info.completion_code != TrbCompletionCode::kSuccess) {
-        return nullptr;
-      }
-    } while(0);
+    CommandRing::EvaluateContextCommandTrb com(_input_context.GetPhysAddr(), _slot_id);
+    _enumeration_state = EnumerationState::kEvaluateContext;
+    _hc->_command_ring.Submit(com, _command_handler);
+    return;
+  }
+  case EnumerationState::kEvaluateContext: {
+    if (_command_info.completion_code != TrbCompletionCode::kSuccess) {
+      FailEnumeration("evaluate context", _command_info.completion_code);
+      return;
+    }
     break;
   }
+  default: {
+    assert(false);
+  }
   }
 
-  DevUsb *_dev_usb;
-
-  if (_dev_usb = Hub::Init(_hc, _slot_id)) {
-    RegisterDevUsb(_dev_usb);
-    return _dev_usb;
+  // the device is addressed. class drivers issue synchronous requests,
+  // so probe them in another thread not to block the enumeration of other devices.
+  _enumeration_state = EnumerationState::kProbe;
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, Probe, this) != 0) {
+    perror("pthread_create:");
+    exit(1);
   }
-  
-  if (_dev_usb = Keyboard::Init(_hc, _slot_id)) {
-    RegisterDevUsb(_dev_usb);
-    return _dev_usb;
+  // nobody waits for the thread (Release() waits for _enumerated instead)
+  pthread_detach(tid);
+}
+
+void *DevXhci::Device::Probe(void *arg) {
+  Device *that = reinterpret_cast<Device *>(arg);
+
+  that->_usb_device = new UsbDevice(that->_hc, that->_slot_id);
+  that->_usb_device->LoadDescriptors();
+  that->_num_dev_usb = UsbDriverRegistry::GetInstance().Probe(that->_usb_device, that->_dev_usb, kMaxDevUsb);
+  if (that->_num_dev_usb == 0) {
+    printf("usb: info: unknown device\n");
   }
 
-  printf("usb: info: unknown device\n");
-      
+  that->FinishEnumeration(EnumerationState::kDone);
   return nullptr;
 }
 
+void DevXhci::Device::SubmitControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size) {
+  // only IN data stages are used during the enumeration
+  assert(request._length != 0 && (request._request_type & 0b10000000) != 0);
+  TransferRing::TransferTrb *trb[3];
+  TransferRing::SetupStageTrb trb1(TransferRing::SetupStageTrb::ValueTransferType::kInDataStage, false, true, request);
+  TransferRing::DataStageTrb trb2(TrbRingBase::Trb::Direction::kIn, data_size, false, false, false, buf.GetPhysPtr());
+  TransferRing::StatusStageTrb trb3(TrbRingBase::Trb::Direction::kOut, false, true, false);
+
+  trb[0] = &trb1;
+  trb[1] = &trb2;
+  trb[2] = &trb3;
+
+  _input_context.Submit(1, trb, 3, &_transfer_completion);
+}
+
+void DevXhci::Device::FailEnumeration(const char *step, TrbCompletionCode code) {
+  printf("xhci: error: failed to enumerate the device on root port %d (%s, completion code %d)\n", _root_port_id, step, static_cast<int>(code));
+  UnlockDefaultAddress();
+  DisableSlot();
+  FinishEnumeration(EnumerationState::kFailed);
+}
+
+void DevXhci::Device::FailEnumeration(const char *step) {
+  printf("xhci: error: failed to enumerate the device on root port %d (%s)\n", _root_port_id, step);
+  UnlockDefaultAddress();
+  DisableSlot();
+  FinishEnumeration(EnumerationState::kFailed);
+}
+
+void DevXhci::Device::DisableSlot() {
+  if (_slot_id == 0) {
+    // Enable Slot failed
+    return;
+  }
+  _hc->UnRegisterDevice(this);
+  // called from the enumeration thread, so the command can be waited for (the event thread completes it)
+  CommandRing::DisableSlotCommandTrb com(_slot_id);
+  CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
+  if (info.completion_code != TrbCompletionCode::kSuccess) {
+    printf("xhci: warning: failed to disable slot %d (completion code %d)\n", _slot_id, static_cast<int>(info.completion_code));
+  }
+  _hc->SetDcbaap(0, _slot_id);
+  // Release() has nothing left to undo
+  _slot_id = 0;
+}
+
+void DevXhci::Device::UnlockDefaultAddress() {
+  if (_default_address_locked) {
+    _default_address_locked = false;
+    _hc->UnlockDefaultAddressOfRootPort(_root_port_id);
+  }
+}
+
+void DevXhci::Device::FinishEnumeration(EnumerationState state) {
+  pthread_mutex_lock(&_lock);
+  _enumeration_state = state;
+  _enumerated = true;
+  pthread_cond_broadcast(&_enumeration_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
 void DevXhci::Device::Release() {
+  pthread_mutex_lock(&_lock);
+  while(!_enumerated) {
+    pthread_cond_wait(&_enumeration_cond, &_lock);
+  }
+  // endpoints which halt from now on are left halted
+  _releasing = true;
+  while(_recoveries > 0) {
+    pthread_cond_wait(&_recovery_cond, &_lock);
+  }
+  pthread_mutex_unlock(&_lock);
+
+  if (_slot_id == 0) {
+    // no slot was enabled
+    return;
+  }
+
   UnRegisterDevUsb();
   
   _hc->UnRegisterDevice(this);
   
   do {
     CommandRing::DisableSlotCommandTrb com(_slot_id);
-    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
+    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
     if (info.completion_code != TrbCompletionCode::kSuccess) {
       return;
     }
   } while(0);
 }
 
-bool DevXhci::Device::SendControlTransfer(UsbCtrl::DeviceRequest &request, Memory &mem, size_t data_size) {
+bool DevXhci::Device::SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size) {
   if (request._length == 0) {
     TransferRing::TransferTrb *trb[2];
     TransferRing::SetupStageTrb trb1(TransferRing::SetupStageTrb::ValueTransferType::kNoDataStage, false, true, request);
@@ -308,7 +680,7 @@ bool DevXhci::Device::SendControlTransfer(UsbCtrl::DeviceRequest &request, Memor
     trb[0] = &trb1;
     trb[1] = &trb2;
 
-    TransferRing::CompletionInfo info = _input_context.Issue(1, trb, 2, &_hc->_mp);
+    TransferRing::CompletionInfo info = _input_context.Issue(1, trb, 2);
     if (info.completion_code != TrbCompletionCode::kSuccess) {
       return false;
     }
@@ -326,14 +698,14 @@ bool DevXhci::Device::SendControlTransfer(UsbCtrl::DeviceRequest &request, Memor
     }
     TransferRing::TransferTrb *trb[3];
     TransferRing::SetupStageTrb trb1(type, false, true, request);
-    TransferRing::DataStageTrb trb2(dir1, data_size, false, false, false, mem.GetPhysPtr());
+    TransferRing::DataStageTrb trb2(dir1, data_size, false, false, false, buf.GetPhysPtr());
     TransferRing::StatusStageTrb trb3(dir2, false, true, false);
 
     trb[0] = &trb1;
     trb[1] = &trb2;
     trb[2] = &trb3;
 
-    TransferRing::CompletionInfo info = _input_context.Issue(1, trb, 3, &_hc->_mp);
+    TransferRing::CompletionInfo info = _input_context.Issue(1, trb, 3);
     if (info.completion_code != TrbCompletionCode::kSuccess) {
       return false;
     }
@@ -341,30 +713,523 @@ bool DevXhci::Device::SendControlTransfer(UsbCtrl::DeviceRequest &request, Memor
   return true;
 }
 
-void DevXhci::Device::InitHub(int number_of_ports, int ttt) {
-  _input_context.InitHub(number_of_ports, ttt);
+ReturnState DevXhci::Device::BulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred) {
+  transferred = 0;
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].length;
+  }
+  if (length > TransferRing::kMaxBulkTransferLength) {
+    return ReturnState::kErrUnknown;
+  }
+  
+  TransferRing::CompletionInfo info = _input_context.IssueBulk(endpt_address, direction, stream_id, iov, iovcnt);
+  if (info.completion_code != TrbCompletionCode::kSuccess && info.completion_code != TrbCompletionCode::kShortPacket) {
+    return ReturnState::kErrUnknown;
+  }
+  assert(info.event_data);
+  transferred = info.transfer_length;
+  return ReturnState::kSuccess;
+}
+
+ReturnState DevXhci::Device::SubmitBulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) {
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].length;
+  }
+  if (length > TransferRing::kMaxBulkTransferLength) {
+    return ReturnState::kErrUnknown;
+  }
+
+  _input_context.SubmitBulk(endpt_address, direction, stream_id, iov, iovcnt, completion);
+  return ReturnState::kSuccess;
+}
+
+ReturnState DevXhci::Device::SetupIsochEndpoint(uint8_t endpt_address, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) {
+  pthread_mutex_lock(&_lock);
+  ReturnState state = _input_context.SetupIsochEndpoint(endpt_address, interval, direction, max_packetsize, max_burst, mult, buf);
+  if (state == ReturnState::kSuccess) {
+    CommandRing::ConfigureEndpointCommandTrb com(_input_context.GetPhysAddr(), _slot_id, false);
+    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
+    if (info.completion_code != TrbCompletionCode::kSuccess) {
+      printf("xhci: error: failed to configure isoch endpoint (%s)\n", GetString(info.completion_code));
+      state = ReturnState::kErrUnknown;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  RETURN_IF_ERR(state);
+  _input_context.RingEndpointDoorbell(endpt_address, direction);
+  return ReturnState::kSuccess;
+}
+
+ReturnState DevXhci::Device::SetupStreamEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int num_streams) {
+  UsbCtrl::PortSpeed speed = GetPortSpeed();
+  if (speed != UsbCtrl::PortSpeed::kSuperSpeed && speed != UsbCtrl::PortSpeed::kSuperSpeedPlus) {
+    printf("xhci: error: streams are only available on SuperSpeed devices\n");
+    return ReturnState::kErrUnknown;
+  }
+  pthread_mutex_lock(&_lock);
+  ReturnState state = _input_context.SetupStreamEndpoint(endpt_address, direction, max_packetsize, max_burst, num_streams);
+  if (state == ReturnState::kSuccess) {
+    CommandRing::ConfigureEndpointCommandTrb com(_input_context.GetPhysAddr(), _slot_id, false);
+    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
+    if (info.completion_code != TrbCompletionCode::kSuccess) {
+      printf("xhci: error: failed to configure stream endpoint (%s)\n", GetString(info.completion_code));
+      state = ReturnState::kErrUnknown;
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+  // no doorbell here. each stream is kicked when a TD is queued on it.
+  return state;
+}
+
+ReturnState DevXhci::Device::ResetEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
+  TransferRing *ring = _input_context.GetResettableRing(endpt_address, direction);
+  if (ring == nullptr) {
+    printf("xhci: error: the endpoint cannot be reset\n");
+    return ReturnState::kErrInvalid;
+  }
+  ring->BeginCancel();
+  // the TD in progress is reported by a Stopped event (4.6.9).
+  // Context State Error: the endpoint is halted or stopped already.
+  CommandRing::StopEndpointCommandTrb stop(_slot_id, _input_context.GetDci(endpt_address, direction));
+  CommandRing::CompletionInfo info = _hc->_command_ring.Issue(stop);
+  if (info.completion_code != TrbCompletionCode::kSuccess && info.completion_code != TrbCompletionCode::kContextStateError) {
+    printf("xhci: warning: failed to stop endpoint (%s)\n", GetString(info.completion_code));
+  }
+  phys_addr dequeue_ptr;
+  bool dcs;
+  ring->Cancel(dequeue_ptr, dcs);
+
+  // Reset Endpoint only takes a halted endpoint, and keeps the data toggle of the others (4.6.8).
+  // so the endpoint is dropped and added again instead.
+  pthread_mutex_lock(&_lock);
+  _input_context.SelectEndpointReset(endpt_address, direction, dequeue_ptr, dcs);
+  CommandRing::ConfigureEndpointCommandTrb com(_input_context.GetPhysAddr(), _slot_id, false);
+  info = _hc->_command_ring.Issue(com);
+  pthread_mutex_unlock(&_lock);
+  ring->EndCancel();
+  if (info.completion_code != TrbCompletionCode::kSuccess) {
+    printf("xhci: error: failed to reset endpoint (%s)\n", GetString(info.completion_code));
+    return ReturnState::kErrUnknown;
+  }
+  return ReturnState::kSuccess;
+}
+
+void DevXhci::Device::InitHub(int number_of_ports, int ttt, bool mtt) {
+  pthread_mutex_lock(&_lock);
+  assert(_children == nullptr);
+  _num_hub_ports = number_of_ports;
+  _multi_tt_hub = mtt && (GetPortSpeed() == UsbCtrl::PortSpeed::kHighSpeed);
+  _children = new Device *[number_of_ports + 1];
+  for (int i = 0; i <= number_of_ports; i++) {
+    _children[i] = nullptr;
+  }
+  _input_context.InitHub(number_of_ports, ttt, mtt);
   do {
     CommandRing::EvaluateContextCommandTrb com(_input_context.GetPhysAddr(), _slot_id);
-    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
+    CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
     assert(info.completion_code == TrbCompletionCode::kSuccess);
   } while(0);
+  pthread_mutex_unlock(&_lock);
+}
+
+void DevXhci::Device::GetTtForChild(int hub_port_id, int &tt_hub_slot_id, int &tt_port_number, bool &mtt) {
+  if (GetPortSpeed() == UsbCtrl::PortSpeed::kHighSpeed) {
+    // the TT of this hub. each port has its own TT if multiple TTs are enabled.
+    tt_hub_slot_id = _slot_id;
+    tt_port_number = hub_port_id;
+    mtt = _multi_tt_hub;
+  } else {
+    // a full-speed hub behind a high-speed hub shares the TT of its parent
+    tt_hub_slot_id = _tt_hub_slot_id;
+    tt_port_number = _tt_port_number;
+    mtt = _mtt;
+  }
+}
+
+DevXhci::TransferRing::TransferTrb **DevXhci::TransferRing::BuildBulkTd(UsbCtrl::IoVector *iov, int iovcnt, int &array_len) {
+  // split buffers at 64KB boundaries
+  int trb_num = 0;
+  size_t td_length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    phys_addr addr = iov[i].mem->GetPhysPtr() + iov[i].offset;
+    for (size_t offset = 0; offset < iov[i].length;) {
+      size_t len = kTrbBufferBoundary - ((addr + offset) % kTrbBufferBoundary);
+      if (len > iov[i].length - offset) {
+        len = iov[i].length - offset;
+      }
+      offset += len;
+      trb_num++;
+    }
+    td_length += iov[i].length;
+  }
+  if (trb_num == 0) {
+    // zero length packet
+    trb_num = 1;
+  }
+
+  TransferTrb **trb = new TransferTrb *[trb_num + 1];
+  // see 4.11.2.4 TD Size
+  int td_packet_count = (td_length + _max_packet_size - 1) / _max_packet_size;
+  size_t transferred = 0;
+  int index = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    phys_addr addr = iov[i].mem->GetPhysPtr() + iov[i].offset;
+    for (size_t offset = 0; offset < iov[i].length;) {
+      size_t len = kTrbBufferBoundary - ((addr + offset) % kTrbBufferBoundary);
+      if (len > iov[i].length - offset) {
+        len = iov[i].length - offset;
+      }
+      transferred += len;
+      int td_size = td_packet_count - transferred / _max_packet_size;
+      if (index == trb_num - 1) {
+        td_size = 0;
+      } else if (td_size > 31) {
+        td_size = 31;
+      }
+      trb[index] = new NormalTrb(addr + offset, len, td_size, true, false);
+      offset += len;
+      index++;
+    }
+  }
+  if (index == 0) {
+    trb[index] = new NormalTrb(0, 0, 0, true, false);
+    index++;
+  }
+  assert(index == trb_num);
+  trb[trb_num] = new EventDataTrb(true);
+  array_len = trb_num + 1;
+  return trb;
+}
+
+DevXhci::TransferRing::CompletionInfo DevXhci::TransferRing::IssueBulk(UsbCtrl::IoVector *iov, int iovcnt) {
+  int array_len;
+  TransferTrb **trb = BuildBulkTd(iov, iovcnt, array_len);
+  CompletionInfo info = Issue(trb, array_len);
+  ReleaseBulkTd(trb, array_len);
+  return info;
+}
+
+#ifndef NDEBUG
+void DevXhci::TrbRing::CheckGrowth(DevXhci *hc) {
+  // the ring is never handed over to the controller, and nothing is consumed
+  TrbRing ring;
+  ring._growable = true;
+  ring.Init(hc);
+  BlockingTrbHandler handler;
+  const int num = 2 * (kEntryNum - 1);
+  pthread_mutex_lock(&ring._lock);
+  for (int i = 0; i < num; i++) {
+    ring.AllocTrb(handler);
+    assert(ring.GetFreeNum() >= kGrowThreshold);
+  }
+  pthread_mutex_unlock(&ring._lock);
+  assert(ring._outstanding == num);
+  assert(ring.GetSegmentNum() > num / (kEntryNum - 1));
+  for (int i = 0; i < ring._num_segments; i++) {
+    delete ring._segments[i]->mem;
+    delete ring._segments[i];
+  }
+}
+#endif
+
+void DevXhci::TransferRing::SubmitBulk(UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) {
+  int array_len;
+  TransferTrb **trb = BuildBulkTd(iov, iovcnt, array_len);
+  Submit(trb, array_len, completion);
+  ReleaseBulkTd(trb, array_len);
+}
+
+void DevXhci::TransferRing::CompleteTransfer(phys_addr pointer, CompletionInfo &info) {
+  pthread_mutex_lock(&_lock);
+  if (info.completion_code == TrbCompletionCode::kRingUnderrun || info.completion_code == TrbCompletionCode::kRingOverrun) {
+    // isochronous endpoints only. no TRB is bound to the event.
+    HandleRingEmpty(info.completion_code);
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  bool stopped = IsStopCode(info.completion_code);
+  int index = GetIndexFromEntryAddr(pointer);
+  if (!IsOwnedByHardware(index)) {
+    // e.g. an isoch TD which reported Missed Service may also report its completion.
+    // a TD stopped by Stop Endpoint may have been cancelled already.
+    if (!stopped) {
+      printf("xhci: warning: completion of a released TRB (%s)\n", GetString(info.completion_code));
+    }
+    pthread_mutex_unlock(&_lock);
+    return;
+  }
+  // the endpoint has been restarted (by a doorbell) before its recovery finished.
+  // the failed TD precedes this one, so complete it first.
+  TrbHandler *halted_handler = ReleaseHaltedTd();
+  TrbHandler *handler = nullptr;
+  EndpointRecovery *recovery = nullptr;
+  if (CanHalt() && IsHaltingError(info.completion_code)) {
+    recovery = Halt(index, info);
+    if (recovery == nullptr) {
+      handler = ReleaseHaltedTd();
+    }
+  } else if (stopped) {
+    // the rest of the TD is never executed (4.6.9)
+    int td_end = GetTdEnd(index);
+    GetInfo(td_end) = info;
+    handler = ReleaseTrb(td_end);
+  } else {
+    GetInfo(index) = info;
+    handler = ReleaseTrb(index);
+  }
+  pthread_mutex_unlock(&_lock);
+  if (halted_handler != nullptr) {
+    halted_handler->CompleteUnlocked();
+  }
+  if (handler != nullptr) {
+    handler->CompleteUnlocked();
+  }
+  if (recovery != nullptr) {
+    recovery->Start();
+  }
 }
 
-bool DevXhci::EventRing::Handle(phys_addr &dequeue_ptr) {
-  int offset = dequeue_ptr - _mem->GetPhysPtr();
-  uint32_t *ptr = _mem->GetVirtPtr<uint32_t>();
-  assert(offset % sizeof(uint32_t) == 0);
-  ptr += offset / sizeof(uint32_t);
+DevXhci::EndpointRecovery *DevXhci::TransferRing::Halt(int index, CompletionInfo &info) {
+  // the controller stops at the failed TRB, and never processes the rest of the TD
+  int td_end = GetTdEnd(index);
+  for (int i = index;; i = GetNextIndex(i)) {
+    NoOpTrb trb;
+    trb.Set(GetTrbAddr(i), Trb::GetCycleBit(GetTrbAddr(i)));
+    if (i == td_end) {
+      break;
+    }
+  }
+  // the handler of the TD is called with the error, when the TD is released
+  GetInfo(td_end) = info;
+  _halted_td = td_end;
+  if (_cancelling || !_device->BeginRecovery()) {
+    // the endpoint is being reset, or the device is going away. the endpoint is left halted.
+    return nullptr;
+  }
+  _recovering = true;
+  return new EndpointRecovery(this, td_end);
+}
 
-  bool dequeu_ptr_incremented = false;
+void DevXhci::EndpointRecovery::Start() {
+  CommandRing::ResetEndpointCommandTrb com(_ring->_device->GetSlotId(), _ring->_dci);
+  _state = State::kResetEndpoint;
+  _ring->_device->GetHc()->_command_ring.Submit(com, *this);
+}
 
+void DevXhci::EndpointRecovery::Complete(CommandRing::CompletionInfo &info) {
+  switch(_state) {
+  case State::kResetEndpoint: {
+    if (info.completion_code != TrbCompletionCode::kSuccess) {
+      printf("xhci: warning: failed to reset endpoint (%s)\n", GetString(info.completion_code));
+    }
+    pthread_mutex_lock(&_ring->_lock);
+    if (_ring->_halted_td != _td_end) {
+      // the endpoint has been restarted, and the failed TD was completed
+      pthread_mutex_unlock(&_ring->_lock);
+      Finish();
+      return;
+    }
+    int next = _ring->GetNextIndex(_td_end);
+    CommandRing::SetTrDequeuePointerCommandTrb com(_ring->GetTrbPhysAddr(next), _ring->GetConsumerCycle(next), _ring->_device->GetSlotId(), _ring->_dci, _ring->_stream_id);
+    pthread_mutex_unlock(&_ring->_lock);
+    _state = State::kSetTrDequeuePointer;
+    _ring->_device->GetHc()->_command_ring.Submit(com, *this);
+    return;
+  }
+  case State::kSetTrDequeuePointer: {
+    // Context State Error: the endpoint has been restarted by a doorbell, and skips the No Op TRBs by itself
+    if (info.completion_code != TrbCompletionCode::kSuccess && info.completion_code != TrbCompletionCode::kContextStateError) {
+      printf("xhci: warning: failed to set TR dequeue pointer (%s)\n", GetString(info.completion_code));
+    }
+    Finish();
+    return;
+  }
+  }
+}
+
+void DevXhci::EndpointRecovery::Finish() {
+  pthread_mutex_lock(&_ring->_lock);
+  TrbHandler *handler = (_ring->_halted_td == _td_end) ? _ring->ReleaseHaltedTd() : nullptr;
+  bool cancelling = _ring->_cancelling;
+  _ring->_recovering = false;
+  _ring->NotifyChange();
+  pthread_mutex_unlock(&_ring->_lock);
+  if (handler != nullptr) {
+    handler->CompleteUnlocked();
+  }
+  if (!cancelling) {
+    // doorbells rung while the endpoint was halted were ignored
+    _ring->_device->RequestEndpointDoorbell(_ring->_dci, _ring->_stream_id);
+  }
+  _ring->_device->EndRecovery();
+  delete this;
+}
+
+void DevXhci::TransferRing::Cancel(phys_addr &dequeue_ptr, bool &dcs) {
   while(true) {
+    pthread_mutex_lock(&_lock);
+    TrbHandler *handler = nullptr;
+    int dequeue = GetDequeueIndex();
+    if (_halted_td >= 0) {
+      handler = ReleaseHaltedTd();
+    } else if (dequeue != GetEnqueueIndex()) {
+      int td_end = GetTdEnd(dequeue);
+      CompletionInfo &info = GetInfo(td_end);
+      info.transfer_length = 0;
+      info.completion_code = TrbCompletionCode::kStopped;
+      info.event_data = false;
+      info.endpoint_id = _dci;
+      info.slot_id = _device->GetSlotId();
+      handler = ReleaseTrb(td_end);
+    } else {
+      dequeue_ptr = GetTrbPhysAddr(dequeue);
+      dcs = GetConsumerCycle(dequeue);
+      pthread_mutex_unlock(&_lock);
+      return;
+    }
+    pthread_mutex_unlock(&_lock);
+    if (handler != nullptr) {
+      handler->CompleteUnlocked();
+    }
+  }
+}
+
+void DevXhci::TransferRing::AsyncTrbHandler::CompleteUnlocked() {
+  bool success = (_info.completion_code == TrbCompletionCode::kSuccess || _info.completion_code == TrbCompletionCode::kShortPacket);
+  // an error is reported by the failed TRB, not by the Event Data TRB
+  _completion->Complete(success, (success && _info.event_data) ? _info.transfer_length : 0);
+  delete this;
+}
+
+void DevXhci::IsochTransferRing::Start(UsbCtrl::PacketIdentification direction, int esit_payload, int max_burst, bool superspeed, SpscRingBuffer<IsochPacket> *buf) {
+  pthread_mutex_lock(&_lock);
+  _buf = buf;
+  _in = (direction == UsbCtrl::PacketIdentification::kIn);
+  _esit_payload = esit_payload;
+  _max_burst = max_burst;
+  _superspeed = superspeed;
+  _posted_head = 0;
+  _posted_num = 0;
+  _empty_status = IsochPacket::Status::kSuccess;
+
+  _stride = 1;
+  while(_stride < esit_payload) {
+    _stride *= 2;
+  }
+  assert(_stride <= static_cast<int>(kTrbBufferBoundary));
+  _mem = new Memory(_stride * (kTdNum + 1));
+  _offset = (_stride - _mem->GetPhysPtr() % _stride) % _stride;
+
+  for (int i = 0; i < kTdNum; i++) {
+    _handlers[i] = new IsochTrbHandler(this, i);
+    if (_in) {
+      Post(i, _esit_payload);
+    } else {
+      Deliver(i, 0, IsochPacket::Status::kSuccess);
+    }
+  }
+  pthread_mutex_unlock(&_lock);
+}
+
+void DevXhci::IsochTransferRing::Post(int index, int length) {
+  // see 4.11.2.3 Isoch TRB
+  int packets = (length + _max_packet_size - 1) / _max_packet_size;
+  if (packets == 0) {
+    // a zero length packet
+    packets = 1;
+  }
+  int tbc = 0;
+  int tlbpc = packets - 1;
+  if (_superspeed) {
+    tbc = (packets + _max_burst) / (_max_burst + 1) - 1;
+    int residue = packets % (_max_burst + 1);
+    tlbpc = (residue == 0) ? _max_burst : residue - 1;
+  }
+
+  // the controller may have passed the end of the schedule. start over from a frame ahead.
+  bool sia = true;
+  int frame_id = 0;
+  if (_posted_num == 0) {
+    sia = false;
+    frame_id = (_hc->GetFrameIndex() + _hc->GetIstFrames() + kScheduleMarginFrames) & IsochTrb::kFrameIdMask;
+  }
+
+  IsochTrb trb(GetBufferPhysAddr(index), length, 0, tbc, tlbpc, sia, frame_id, false, true);
+  TransferTrb *trbs[1] = { &trb };
+  _length[index] = length;
+  Enqueue(trbs, 1, *_handlers[index]);
+  assert(_posted_num < kTdNum);
+  _posted[(_posted_head + _posted_num) % kTdNum] = index;
+  _posted_num++;
+}
+
+void DevXhci::IsochTransferRing::Deliver(int index, int length, IsochPacket::Status status) {
+  if (_buf->Push(IsochPacket(this, index, GetBufferVirtAddr(index), length, _esit_payload, status))) {
+    return;
+  }
+  // the user is too slow. IN: drop the packet, OUT: keep the schedule with a zero length packet.
+  Post(index, _in ? _esit_payload : 0);
+  _device->RequestEndpointDoorbell(_dci);
+}
+
+void DevXhci::IsochTransferRing::Handle(int index, int trb_index) {
+  // the controller may skip TDs without reporting each of them (see 4.10.3.2)
+  assert(_posted_num > 0);
+  while(_posted[_posted_head] != index) {
+    int skipped = _posted[_posted_head];
+    _posted_head = (_posted_head + 1) % kTdNum;
+    _posted_num--;
+    assert(_posted_num > 0);
+    Deliver(skipped, 0, IsochPacket::Status::kMissedService);
+  }
+  _posted_head = (_posted_head + 1) % kTdNum;
+  _posted_num--;
+
+  CompletionInfo &info = GetInfo(trb_index);
+  IsochPacket::Status status;
+  int length = 0;
+  switch(info.completion_code) {
+  case TrbCompletionCode::kSuccess:
+  case TrbCompletionCode::kShortPacket:
+    status = IsochPacket::Status::kSuccess;
+    // TRB Transfer Length of the Transfer Event is the residual number of bytes
+    length = _length[index] - info.transfer_length;
+    break;
+  case TrbCompletionCode::kMissedServiceError:
+    status = IsochPacket::Status::kMissedService;
+    break;
+  default:
+    printf("xhci: warning: isoch transfer failed (%s)\n", GetString(info.completion_code));
+    status = IsochPacket::Status::kError;
+    break;
+  }
+  if (status == IsochPacket::Status::kSuccess) {
+    status = _empty_status;
+    _empty_status = IsochPacket::Status::kSuccess;
+  }
+  Deliver(index, _in ? length : 0, status);
+}
+
+void DevXhci::IsochTransferRing::ReturnIsochPacket(int index, int length) {
+  pthread_mutex_lock(&_lock);
+  Post(index, length);
+  pthread_mutex_unlock(&_lock);
+  _device->RequestEndpointDoorbell(_dci);
+}
+
+int DevXhci::EventRing::Handle(phys_addr &dequeue_ptr, int budget) {
+  int handled = 0;
+
+  while(true) {
+    uint32_t *ptr = GetDequeueAddr();
     EventTrb trb(ptr);
-    if (trb.GetCycleBit() != _consumer_cycle_bit) {
-      if (dequeu_ptr_incremented) {
-        dequeue_ptr = _mem->GetPhysPtr() + (ptr - _mem->GetVirtPtr<uint32_t>()) * sizeof(uint32_t);
+    if (trb.GetCycleBit() != _consumer_cycle_bit || handled == budget) {
+      if (handled > 0) {
+        dequeue_ptr = _mem[_dequeue_segment]->GetPhysPtr() + _dequeue_index * kEntrySize;
       }
-      return dequeu_ptr_incremented;
+      return handled;
     }
 
     switch(trb.GetType()) {
@@ -385,15 +1250,8 @@ bool DevXhci::EventRing::Handle(phys_addr &dequeue_ptr) {
       break;
     }
     case PortStatusChangeEventTrb::kValueTrbType: {
-      auto container = new ContainerForPortStatusChangeHandler;
-      container->that = _hc;
       PortStatusChangeEventTrb trb2(ptr);
-      trb2.SetContainer(*container);
-      pthread_t tid;
-      if (pthread_create(&tid, NULL, HandlePortStatusChange, container) != 0) {
-        perror("pthread_create:");
-        exit(1);
-      }
+      _hc->QueuePortStatusChange(trb2.GetPortId());
       break;
     }
     default: {
@@ -402,54 +1260,211 @@ bool DevXhci::EventRing::Handle(phys_addr &dequeue_ptr) {
     }
     }
 	
-    ptr += 4;
-    if (ptr - _mem->GetVirtPtr<uint32_t>() == kEntryNum * kEntrySize / sizeof(uint32_t)) {
-      ptr = _mem->GetVirtPtr<uint32_t>();
-      _consumer_cycle_bit = !_consumer_cycle_bit;
+    _dequeue_index++;
+    if (_dequeue_index == kEntryNum) {
+      _dequeue_index = 0;
+      _dequeue_segment++;
+      if (_dequeue_segment == _num_segments) {
+        _dequeue_segment = 0;
+        _consumer_cycle_bit = !_consumer_cycle_bit;
+      }
     }
-    dequeu_ptr_incremented = true;
+    handled++;
   }
 }
 
 void DevXhci::Interrupter::Init(volatile uint32_t *base_addr, EventRingSegmentTable *erst, EventRing *event_ring) {
   phys_addr erst_addr = erst->GetMemory().GetPhysPtr();
   _base_addr = base_addr;
+  _erst = erst;
   // default Interrupt Moderation Interval is 4000(1ms)
   // refer to Table 49: Interrupter Moderation Register (IMOD)
-  _base_addr[kRegOffsetImod]
-    = GenerateValue<ImodRegModerationInterval, uint32_t>(40000)
-    | GenerateValue<ImodRegModerationCounter, uint32_t>(0);
+  WriteModerationInterval();
   _base_addr[kRegOffsetErstsz]
     = GenerateValue<ErstszRegEventRingSegmentTableSize, uint32_t>(erst->GetSize());
-  _dequeue_ptr = event_ring->GetMemory().GetPhysPtr();
+  _dequeue_ptr = erst->GetFirstSegmentAddr();
   WriteDequeuePtr();
   _base_addr[kRegOffsetErstba + 0] = erst_addr & GenerateMask<ErstbaEventRingSegmentTableBaseAddress, uint32_t>();
   _base_addr[kRegOffsetErstba + 1] = erst_addr >> 32;
   _base_addr[kRegOffsetIman] |= kImanRegFlagEnable;
-  _erst = erst;
 }
 
-uint8_t DevXhci::GetSlotType(int root_port_id) {
-  volatile uint32_t *base = _excapreg_base_addr;
+void DevXhci::Interrupter::AdaptModeration() {
+  if (!_adaptive) {
+    return;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (_window_start.tv_sec == 0 && _window_start.tv_nsec == 0) {
+    _window_start = now;
+    _window_events = 0;
+    return;
+  }
+  int64_t elapsed_us = (now.tv_sec - _window_start.tv_sec) * 1000000 + (now.tv_nsec - _window_start.tv_nsec) / 1000;
+  if (elapsed_us < kModerationWindowUs) {
+    return;
+  }
+
+  uint64_t rate = _window_events * 1000000 / elapsed_us;
+  int min_interval = _min_moderation_interval;
+  int max_interval = _max_moderation_interval;
+  int interval;
+  if (rate <= kLowEventRate) {
+    // latency matters more than the interrupt overhead
+    interval = min_interval;
+  } else if (rate >= kHighEventRate) {
+    interval = max_interval;
+  } else {
+    interval = min_interval + (max_interval - min_interval) * (rate - kLowEventRate) / (kHighEventRate - kLowEventRate);
+  }
+  if (interval != _moderation_interval) {
+    pthread_mutex_lock(&_moderation_lock);
+    // the adaptive moderation may have been disabled since the check above
+    if (_adaptive) {
+      UpdateModerationInterval(interval);
+    }
+    pthread_mutex_unlock(&_moderation_lock);
+  }
+
+  _window_start = now;
+  _window_events = 0;
+}
+
+void DevXhci::ExtendedCapabilities::Init(volatile uint32_t *base) {
   while(true) {
-    uint8_t capid = MaskValue(*base, kExtCapRegLenCapabilityId, kExtCapRegOffsetCapabilityId);
+    uint8_t capid = MaskValue<ExtCapRegCapabilityId>(*base);
     switch(capid) {
+    case kExCapCodeUsbLegacySupport: {
+      TakeOwnership(base);
+      break;
+    }
     case kExCapCodeSupportedProtocol: {
-      int offset = MaskValue(base[2], kSupportedProtocolCap8LenCompatiblePortOffset, kSupportedProtocolCap8OffsetCompatiblePortOffset);
-      int count = MaskValue(base[2], kSupportedProtocolCap8LenCompatiblePortCount, kSupportedProtocolCap8OffsetCompatiblePortCount);
-      if (offset <= root_port_id && root_port_id < offset + count) {
-        return MaskValue(base[3], kSupportedProtocolCapCLenProtocolSlotType, kSupportedProtocolCapCOffsetProtocolSlotType);
+      ParseSupportedProtocol(base);
+      break;
+    }
+    default: {
+      if (capid >= kExCapCodeVendorDefinedMin) {
+        if (_num_vendor_caps == kMaxVendorCaps) {
+          printf("xhci: warning: too many vendor defined capabilities\n");
+          break;
+        }
+        _vendor_caps[_num_vendor_caps].id = capid;
+        _vendor_caps[_num_vendor_caps].base = base;
+        _num_vendor_caps++;
       }
       break;
     }
     }
-    int next_offset = MaskValue(*base, kExtCapRegLenNextPointer, kExtCapRegOffsetNextPointer);
+    int next_offset = MaskValue<ExtCapRegNextPointer>(*base);
     if (next_offset == 0) {
       break;
     }
     base += next_offset;
   }
-  assert(false);
+}
+
+void DevXhci::ExtendedCapabilities::ParseSupportedProtocol(volatile uint32_t *base) {
+  if (_num_protocols == kMaxProtocols) {
+    printf("xhci: warning: too many supported protocol capabilities\n");
+    return;
+  }
+  SupportedProtocol &protocol = _protocols[_num_protocols];
+  protocol.major_revision = MaskValue<SupportedProtocolCap0MajorRevision>(base[0]);
+  protocol.minor_revision = MaskValue<SupportedProtocolCap0MinorRevision>(base[0]);
+  protocol.port_offset = MaskValue<SupportedProtocolCap8CompatiblePortOffset>(base[2]);
+  protocol.port_count = MaskValue<SupportedProtocolCap8CompatiblePortCount>(base[2]);
+  protocol.slot_type = MaskValue<SupportedProtocolCapCProtocolSlotType>(base[3]);
+  protocol.num_speeds = MaskValue<SupportedProtocolCap8ProtocolSpeedIdCount>(base[2]);
+  for (int i = 0; i < protocol.num_speeds; i++) {
+    uint32_t psi = base[4 + i];
+    ProtocolSpeed &speed = protocol.speeds[i];
+    speed.value = MaskValue<ProtocolSpeedIdValue>(psi);
+    speed.bitrate = MaskValue<ProtocolSpeedIdMantissa>(psi);
+    for (int e = MaskValue<ProtocolSpeedIdExponent>(psi); e > 0; e--) {
+      speed.bitrate *= 1000;
+    }
+    speed.type = MaskValue<ProtocolSpeedIdType>(psi);
+    speed.full_duplex = IsFlagSet(psi, kProtocolSpeedIdFlagFullDuplex);
+  }
+  for (int i = 0; i < protocol.port_count; i++) {
+    int root_port_id = protocol.port_offset + i;
+    if (root_port_id < 1 || root_port_id > kMaxPorts) {
+      continue;
+    }
+    _port_protocol[root_port_id] = _num_protocols;
+  }
+  _num_protocols++;
+}
+
+// 4.22.1 Pre-OS to OS Handoff Synchronization
+void DevXhci::ExtendedCapabilities::TakeOwnership(volatile uint32_t *base) {
+  _legacy_support = true;
+  base[0] |= kUsbLegSupFlagOsOwned;
+  for (int i = 0; IsFlagSet(base[0], kUsbLegSupFlagBiosOwned); i++) {
+    if (i == kOwnershipTimeout) {
+      printf("xhci: warning: BIOS did not release the controller\n");
+      base[0] &= ~kUsbLegSupFlagBiosOwned;
+      break;
+    }
+    usleep(1000);
+  }
+  // disable SMIs (RW1C status bits are cleared at the same time)
+  base[1] &= ~kUsbLegCtlStsFlagsSmiEnableBits;
+  _os_owned = IsFlagSet(base[0], kUsbLegSupFlagOsOwned) && IsFlagClear(base[0], kUsbLegSupFlagBiosOwned);
+}
+
+UsbCtrl::PortSpeed DevXhci::ExtendedCapabilities::DecodePortSpeed(int root_port_id, int psiv) {
+  const SupportedProtocol *protocol = GetProtocol(root_port_id);
+  if (protocol == nullptr || protocol->num_speeds == 0) {
+    return GetDefaultPortSpeed(psiv);
+  }
+  for (int i = 0; i < protocol->num_speeds; i++) {
+    const ProtocolSpeed &speed = protocol->speeds[i];
+    if (speed.value != psiv) {
+      continue;
+    }
+    if (protocol->major_revision < 3) {
+      if (speed.bitrate <= 1500 * 1000) {
+        return UsbCtrl::PortSpeed::kLowSpeed;
+      } else if (speed.bitrate <= 12 * 1000 * 1000) {
+        return UsbCtrl::PortSpeed::kFullSpeed;
+      } else {
+        return UsbCtrl::PortSpeed::kHighSpeed;
+      }
+    } else {
+      if (speed.bitrate <= 5ULL * 1000 * 1000 * 1000) {
+        return UsbCtrl::PortSpeed::kSuperSpeed;
+      } else {
+        return UsbCtrl::PortSpeed::kSuperSpeedPlus;
+      }
+    }
+  }
+  // the PSI table has no entry for the value
+  return UsbCtrl::PortSpeed::kUnknown;
+}
+
+// Table 157: Default USB Speed ID Mapping
+UsbCtrl::PortSpeed DevXhci::ExtendedCapabilities::GetDefaultPortSpeed(int psiv) {
+  switch (psiv) {
+  case 1: {
+    return UsbCtrl::PortSpeed::kFullSpeed;
+  }
+  case 2: {
+    return UsbCtrl::PortSpeed::kLowSpeed;
+  }
+  case 3: {
+    return UsbCtrl::PortSpeed::kHighSpeed;
+  }
+  case 4: {
+    return UsbCtrl::PortSpeed::kSuperSpeed;
+  }
+  case 5: {
+    return UsbCtrl::PortSpeed::kSuperSpeedPlus;
+  }
+  default: {
+    return UsbCtrl::PortSpeed::kUnknown;
+  }
+  }
 }
 
 void DevXhci::SetupScratchPad() {
@@ -477,9 +1492,145 @@ void DevXhci::SetupScratchPad() {
   }
 }
 
-DevUsb *DevXhci::AttachDevice(Hub *hub, int hub_addr, int hub_port_id) {
-  HubPortDevice *device = new HubPortDevice(this, _device_list[hub_addr], hub, hub_port_id);
-  return device->Init();
+ReturnState DevXhci::AttachDevice(Hub *hub, int hub_addr, int hub_port_id) {
+  // ask the speed here (in the thread of the hub driver), since the enumeration thread must not block
+  Device *parent = _device_list[hub_addr];
+  HubPortDevice *device = new HubPortDevice(this, parent, hub, hub_port_id, hub->GetPortSpeed(hub_port_id));
+  parent->AttachChild(hub_port_id, device);
+  device->StartEnumeration(true);
+  return ReturnState::kSuccess;
+}
+
+void DevXhci::LockDefaultAddressOfRootPort(int root_port_id) {
+  pthread_mutex_lock(&_default_address_lock);
+  while(_default_address_busy[root_port_id]) {
+    pthread_cond_wait(&_default_address_cond, &_default_address_lock);
+  }
+  _default_address_busy[root_port_id] = true;
+  pthread_mutex_unlock(&_default_address_lock);
+}
+
+void DevXhci::UnlockDefaultAddressOfRootPort(int root_port_id) {
+  pthread_mutex_lock(&_default_address_lock);
+  assert(_default_address_busy[root_port_id]);
+  _default_address_busy[root_port_id] = false;
+  // the waiters of the other root ports share the condition
+  pthread_cond_broadcast(&_default_address_cond);
+  pthread_mutex_unlock(&_default_address_lock);
+}
+
+void DevXhci::DetachDevice(int hub_addr, int hub_port_id) {
+  assert(_device_list[hub_addr] != nullptr);
+  Device *device = _device_list[hub_addr]->DetachChild(hub_port_id);
+  if (device != nullptr) {
+    device->Release();
+    delete device;
+  }
+}
+
+void DevXhci::Device::DeviceContext::EndpointContext::InitIsoch(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::PacketIdentification direction, int max_packet_size, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) {
+  Init(device, addr, dci);
+  _isoch = true;
+
+  UsbCtrl::PortSpeed speed = _device->GetPortSpeed();
+  bool superspeed = (speed == UsbCtrl::PortSpeed::kSuperSpeed || speed == UsbCtrl::PortSpeed::kSuperSpeedPlus);
+  if (speed == UsbCtrl::PortSpeed::kHighSpeed) {
+    // additional transactions per microframe (see 6.2.3.4)
+    max_burst = (max_packet_size >> 11) & 0x3;
+    mult = 0;
+  }
+  max_packet_size &= 0x7FF;
+
+  // the interval is 2^(bInterval - 1) frames (full-speed) or microframes (others)
+  assert(interval >= 1 && interval <= 16);
+  int interval_ = (speed == UsbCtrl::PortSpeed::kFullSpeed) ? interval + 2 : interval - 1;
+  int esit_payload = max_packet_size * (max_burst + 1) * (mult + 1);
+
+  _addr[0] = GenerateValue<Mult, uint32_t>(mult)
+    | GenerateValue<MaxPrimaryStreams, uint32_t>(0)
+    | GenerateValue<Interval, uint32_t>(interval_)
+    | GenerateValue<MaxEsitPayloadHi, uint32_t>(esit_payload >> 16);
+  // Cerr should be 0 for isochronous endpoints
+  _addr[1] = GenerateValue<Cerr, uint32_t>(0)
+    | GenerateValue<EndpointType, uint32_t>((direction == UsbCtrl::PacketIdentification::kIn) ? 5 : 1)
+    | GenerateValue<MaxBurstSize, uint32_t>(max_burst)
+    | GenerateValue<MaxPacketSize, uint32_t>(max_packet_size);
+  _isoch_ring.Init(_device, _dci, max_packet_size);
+  phys_addr tr_ptr = _isoch_ring.GetMemory().GetPhysPtr();
+  _addr[2] = kFlagDequequeCycleState
+    | (tr_ptr & GenerateMask<TrDequeuePointer, uint32_t>());
+  _addr[3] = tr_ptr >> 32;
+  // a TD is posted per service interval
+  _addr[4] = GenerateValue<AverageTrbLength, uint32_t>(esit_payload & 0xFFFF)
+    | GenerateValue<MaxEsitPayloadLo, uint32_t>(esit_payload & 0xFFFF);
+  _addr[5] = 0;
+  _addr[6] = 0;
+  _addr[7] = 0;
+
+  _isoch_ring.Start(direction, esit_payload, max_burst, superspeed, buf);
+}
+
+void DevXhci::Device::DeviceContext::EndpointContext::InitStreams(Device *device, uint32_t *addr, int dci, UsbCtrl::PacketIdentification direction, int max_packet_size, int max_burst, int num_streams) {
+  Init(device, addr, dci);
+
+  // the array has 2^(MaxPStreams + 1) entries including the reserved stream 0
+  int max_pstreams = 1;
+  while((2 << max_pstreams) < num_streams + 1) {
+    max_pstreams++;
+  }
+  int array_size = kStreamContextSize * (2 << max_pstreams);
+  _stream_context_array = new Memory(array_size);
+  uint32_t *array = _stream_context_array->GetVirtPtr<uint32_t>();
+  // contexts beyond num_streams are left invalid (SCT = 0)
+  memset(array, 0, array_size);
+
+  _stream_rings = new TransferRing[num_streams + 1];
+  for (int i = 1; i <= num_streams; i++) {
+    _stream_rings[i].Init(_device, _dci, max_packet_size, i);
+    phys_addr tr_ptr = _stream_rings[i].GetMemory().GetPhysPtr();
+    uint32_t *context = array + (i * kStreamContextSize) / sizeof(uint32_t);
+    context[0] = kStreamContextFlagDequeueCycleState
+      | GenerateValue<StreamContextType, uint32_t>(kValueStreamContextTypePrimaryTransferRing)
+      | (tr_ptr & GenerateMask<TrDequeuePointer, uint32_t>());
+    context[1] = tr_ptr >> 32;
+  }
+  _num_streams = num_streams;
+
+  _addr[0] = GenerateValue<Mult, uint32_t>(0)
+    | GenerateValue<MaxPrimaryStreams, uint32_t>(max_pstreams)
+    | kFlagLinearStreamArray
+    | GenerateValue<Interval, uint32_t>(0);
+  _addr[1] = GenerateValue<Cerr, uint32_t>(3)
+    | GenerateValue<EndpointType, uint32_t>((direction == UsbCtrl::PacketIdentification::kIn) ? 6 : 2)
+    | GenerateValue<MaxBurstSize, uint32_t>(max_burst)
+    | GenerateValue<MaxPacketSize, uint32_t>(max_packet_size);
+  // TR Dequeue Pointer points to the Primary Stream Context Array, and DCS should be 0
+  phys_addr array_ptr = _stream_context_array->GetPhysPtr();
+  _addr[2] = array_ptr & GenerateMask<TrDequeuePointer, uint32_t>();
+  _addr[3] = array_ptr >> 32;
+  _addr[4] = 0;
+  _addr[5] = 0;
+  _addr[6] = 0;
+  _addr[7] = 0;
+}
+
+void DevXhci::Device::DeviceContext::EndpointContext::CompleteStreamTransfer(phys_addr pointer, TransferRing::CompletionInfo &info) {
+  if (info.event_data) {
+    int stream_id = TransferRing::GetStreamIdFromEventData(pointer);
+    if (stream_id >= 1 && stream_id <= _num_streams) {
+      _stream_rings[stream_id].CompleteTransfer(TransferRing::GetTrbAddrFromEventData(pointer), info);
+      return;
+    }
+  } else {
+    // reported by a failed TRB, which carries no stream ID
+    for (int i = 1; i <= _num_streams; i++) {
+      if (_stream_rings[i].Contains(pointer)) {
+        _stream_rings[i].CompleteTransfer(pointer, info);
+        return;
+      }
+    }
+  }
+  printf("xhci: warning: completion of an unknown stream (%s)\n", GetString(info.completion_code));
 }
 
 void DevXhci::Device::DeviceContext::OutEndpointContext::Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size) {
@@ -517,7 +1668,7 @@ void DevXhci::Device::DeviceContext::OutEndpointContext::Init(Device *device, ui
     | GenerateValue<EndpointType, uint32_t>(ep_type)
     | GenerateValue<MaxBurstSize, uint32_t>(0)
     | GenerateValue<MaxPacketSize, uint32_t>(max_packet_size);
-  _ring.Init(_device, _dci);
+  _ring.Init(_device, _dci, max_packet_size);
   phys_addr tr_ptr = _ring.GetMemory().GetPhysPtr();
   _addr[2] = kFlagDequequeCycleState
     | (tr_ptr & GenerateMask<TrDequeuePointer, uint32_t>());
@@ -528,9 +1679,8 @@ void DevXhci::Device::DeviceContext::OutEndpointContext::Init(Device *device, ui
   _addr[7] = 0;
 }
 
-void DevXhci::Device::DeviceContext::InEndpointContext::Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size, RingBuffer<uint8_t *> *buf) {
+void DevXhci::Device::DeviceContext::InEndpointContext::Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size, SpscRingBuffer<uint8_t *> *buf, SpscRingBuffer<InTransferLease> *lease_buf) {
   EndpointContext::Init(device, addr, dci);
-  _buf = buf;
 
   int ep_type;
   switch(type) {
@@ -565,7 +1715,7 @@ void DevXhci::Device::DeviceContext::InEndpointContext::Init(Device *device, uin
     | GenerateValue<EndpointType, uint32_t>(ep_type)
     | GenerateValue<MaxBurstSize, uint32_t>(0)
     | GenerateValue<MaxPacketSize, uint32_t>(max_packet_size);
-  _ring.Init(_device, _dci);
+  _ring.Init(_device, _dci, max_packet_size);
   phys_addr tr_ptr = _ring.GetMemory().GetPhysPtr();
   _addr[2] = kFlagDequequeCycleState
     | (tr_ptr & GenerateMask<TrDequeuePointer, uint32_t>());
@@ -575,8 +1725,9 @@ void DevXhci::Device::DeviceContext::InEndpointContext::Init(Device *device, uin
   _addr[6] = 0;
   _addr[7] = 0;
 
-  if (type != UsbCtrl::TransferType::kControl) {
-    _ring.Fill(&_device->GetHc()->_mp, max_packet_size, buf);
+  // without buffers, the ring is driven by BulkTransfer()
+  if (type != UsbCtrl::TransferType::kControl && (buf != nullptr || lease_buf != nullptr)) {
+    _ring.Fill(buf, lease_buf);
   }
 }
 
@@ -616,12 +1767,15 @@ int DevXhci::Device::InputDeviceContext::Init(Device *device) {
   }
   }
 
-  _dev_context._in_endpoint_context[0].Init(_device, addr + (2 * _device->_hc->_context_size) / sizeof(uint32_t), 1, 0, UsbCtrl::TransferType::kControl, _ed0_max_packet_size, nullptr);
+  _dev_context._in_endpoint_context[0].Init(_device, addr + (2 * _device->_hc->_context_size) / sizeof(uint32_t), 1, 0, UsbCtrl::TransferType::kControl, _ed0_max_packet_size, nullptr, nullptr);
 
   return 0;
 }
 
 void DevXhci::BufferingNormalTrbHandler::Handle() {
-  _ring->Handle(_index);
+  _ring->Handle(_index, handle_index);
 }
 
+void DevXhci::IsochTrbHandler::Handle() {
+  _ring->Handle(_index, handle_index);
+}
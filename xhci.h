@@ -11,38 +11,169 @@
 #include <string.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <time.h>
+#include <sched.h>
+#include <atomic>
 #include "hub.h"
 
 class DevXhci : public DevUsbController {
 public:
+  enum class PollMode {
+    kInterrupt,  // wait for the uio interrupt before handling events
+    kPolling,    // spin on the event ring without waiting for interrupts
+    kHybrid,     // poll while events keep arriving, fall back to interrupts when idle
+  };
+  // statistics of an interrupter
+  struct InterrupterStats {
+    uint64_t interrupts;
+    uint64_t events;
+    // current moderation interval (in 250ns)
+    int moderation_interval;
+    // effective coalescing (events per interrupt)
+    double GetEventsPerInterrupt() {
+      return (interrupts == 0) ? 0 : static_cast<double>(events) / interrupts;
+    }
+  };
   void Init();
-  void Run() {
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, AttachAll, this) != 0) {
-      perror("pthread_create:");
-      exit(1);
+  void Run();
+  virtual void BeginSubmissionBatch() override {
+    _submission_batch_depth++;
+  }
+  virtual void EndSubmissionBatch() override {
+    assert(_submission_batch_depth > 0);
+    _submission_batch_depth--;
+    if (_submission_batch_depth == 0) {
+      FlushDoorbells();
     }
-    while(true) {
-      _pci.WaitInterrupt();
-      pthread_mutex_lock(&_mp);
-      _interrupter.Handle();
-      pthread_mutex_unlock(&_mp);
+  }
+  // idle_budget_us: (kHybrid only) how long to keep polling without any event
+  void SetPollMode(PollMode mode, int idle_budget_us = kDefaultPollIdleBudgetUs) {
+    _poll_mode = mode;
+    _poll_idle_budget_us = idle_budget_us;
+  }
+  // fixed interrupt moderation interval (in 250ns) of all interrupters. disables the adaptive moderation.
+  // can be called at runtime.
+  void SetModerationInterval(int interval) {
+    assert(interval >= 0 && interval <= kMaxModerationInterval);
+    for (int i = 0; i < kMaxInterrupters; i++) {
+      _interrupter[i].SetAdaptiveModeration(false);
+      _interrupter[i].SetModerationInterval(interval);
+    }
+  }
+  // the moderation interval follows the event rate of each interrupter.
+  // min_interval is used while events are sparse (e.g. HID), max_interval while events are dense (e.g. bulk streaming).
+  // can be called at runtime.
+  void SetAdaptiveModeration(int min_interval = kDefaultMinModerationInterval, int max_interval = kDefaultMaxModerationInterval) {
+    assert(0 <= min_interval && min_interval <= max_interval && max_interval <= kMaxModerationInterval);
+    for (int i = 0; i < kMaxInterrupters; i++) {
+      _interrupter[i].SetModerationRange(min_interval, max_interval);
+      _interrupter[i].SetAdaptiveModeration(true);
     }
   }
-  virtual bool SendControlTransfer(UsbCtrl::DeviceRequest &request, Memory &mem, size_t data_size, int device_addr) override {
+  void GetInterrupterStats(int index, InterrupterStats &stats) {
+    assert(index >= 0 && index < _num_interrupters);
+    _interrupter[index].GetStats(stats);
+  }
+  // max number of events handled in a pass.
+  // ERDP is written after each pass, and the handler thread yields between passes.
+  void SetEventBudget(int budget) {
+    assert(budget > 0);
+    _event_budget = budget;
+  }
+  static const int kMaxInterrupters = 8;
+  // must be called before Init().
+  // each interrupter owns an event ring and a handler thread.
+  // the actual number is limited by the controller (HCSPARAMS1 MaxIntrs).
+  void SetInterrupterNum(int num) {
+    assert(num >= 1 && num <= kMaxInterrupters);
+    _num_interrupters = num;
+  }
+  // pin the handler thread of the interrupter to the core (-1: not pinned)
+  void SetInterrupterAffinity(int index, int core) {
+    assert(index >= 0 && index < kMaxInterrupters);
+    _interrupter_core[index] = core;
+  }
+  // steer completions of the endpoint to the interrupter.
+  // TRBs which are already posted still report to the previous interrupter.
+  void SteerEndpoint(int device_addr, uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int interrupter) {
+    assert(_device_list[device_addr] != nullptr);
+    assert(interrupter >= 0 && interrupter < _num_interrupters);
+    _device_list[device_addr]->SteerEndpoint(endpt_address, direction, interrupter);
+  }
+  virtual bool SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size, int device_addr) override {
     assert(_device_list[device_addr] != nullptr);
-    return _device_list[device_addr]->SendControlTransfer(request, mem, data_size);
+    return _device_list[device_addr]->SendControlTransfer(request, buf, data_size);
   }
-  virtual void InitHub(int number_of_ports, int ttt, int device_addr) override {
+  virtual void InitHub(int number_of_ports, int ttt, bool mtt, int device_addr) override {
     assert(_device_list[device_addr] != nullptr);
-    return _device_list[device_addr]->InitHub(number_of_ports, ttt);
+    return _device_list[device_addr]->InitHub(number_of_ports, ttt, mtt);
   }
-  virtual DevUsb *AttachDevice(Hub *hub, int hub_addr, int hub_port_id) override;
-  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, RingBuffer<uint8_t *> *buf) override {
+  virtual int GetHubDepth(int device_addr) override {
     assert(_device_list[device_addr] != nullptr);
-    return _device_list[device_addr]->SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, buf);
+    return _device_list[device_addr]->GetHubDepth();
+  }
+  virtual ReturnState AttachDevice(Hub *hub, int hub_addr, int hub_port_id) override;
+  virtual void DetachDevice(int hub_addr, int hub_port_id) override;
+  virtual void LockDefaultAddress(int hub_addr) override {
+    assert(_device_list[hub_addr] != nullptr);
+    LockDefaultAddressOfRootPort(_device_list[hub_addr]->GetRootPortId());
+  }
+  virtual void UnlockDefaultAddress(int hub_addr) override {
+    assert(_device_list[hub_addr] != nullptr);
+    UnlockDefaultAddressOfRootPort(_device_list[hub_addr]->GetRootPortId());
+  }
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<uint8_t *> *buf) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, buf, nullptr);
+  }
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<InTransferLease> *lease_buf) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, nullptr, lease_buf);
+  }
+  virtual ReturnState SetupEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, nullptr, nullptr);
+  }
+  virtual ReturnState SetupIsochEndpoint(uint8_t endpt_address, int device_addr, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->SetupIsochEndpoint(endpt_address, interval, direction, max_packetsize, max_burst, mult, buf);
+  }
+  virtual ReturnState SetupStreamEndpoint(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int &num_streams) override {
+    assert(_device_list[device_addr] != nullptr);
+    // stream 0 is reserved
+    if (num_streams > _max_psa_size - 1) {
+      num_streams = _max_psa_size - 1;
+    }
+    if (num_streams <= 0) {
+      return ReturnState::kErrNoHwResource;
+    }
+    return _device_list[device_addr]->SetupStreamEndpoint(endpt_address, direction, max_packetsize, max_burst, num_streams);
+  }
+  virtual ReturnState BulkTransfer(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->BulkTransfer(endpt_address, direction, stream_id, iov, iovcnt, transferred);
+  }
+  virtual ReturnState SubmitBulkTransfer(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->SubmitBulkTransfer(endpt_address, direction, stream_id, iov, iovcnt, completion);
+  }
+  virtual ReturnState ResetEndpoint(uint8_t endpt_address, int device_addr, UsbCtrl::PacketIdentification direction) override {
+    assert(_device_list[device_addr] != nullptr);
+    return _device_list[device_addr]->ResetEndpoint(endpt_address, direction);
   }
 private:
+  static const int kDefaultPollIdleBudgetUs = 100;
+  // the polling thread checks IMAN of the sleeping interrupters once in this many spins
+  static const int kWakeupCheckSpins = 256;
+  static const int kDefaultEventBudget = 64;
+  // Table 49: Interrupter Moderation Register (IMOD). in 250ns.
+  static const int kMaxModerationInterval = 0xFFFF;
+  // 1ms
+  static const int kDefaultModerationInterval = 4000;
+  // 125us, 2ms
+  static const int kDefaultMinModerationInterval = 500;
+  static const int kDefaultMaxModerationInterval = 8000;
+
   static const int kCapRegOffsetCapLength = 0x00;
   static const int kCapRegOffsetHciVersion = 0x02;
   
@@ -60,19 +191,35 @@ private:
   static const int kOpRegOffsetConfig = 0x38 / sizeof(uint32_t);
   static const int kOpRegOffsetPortsc = 0x400 / sizeof(uint32_t);
 
+  static const int kRunRegOffsetMfindex = 0x00 / sizeof(uint32_t);
   static const int kRunRegIntRegSet = 0x20 / sizeof(uint32_t);
+  static const int kRunRegIntRegSetSize = 0x20 / sizeof(uint32_t);
 
   // Table 23: Host Controller Structural Parameters 1 (HCSPARAMS1)
   struct CapReg32HcsParams1MaxSlots {
     static const int kOffset = 0;
     static const int kLen = 8;
   };
+  struct CapReg32HcsParams1MaxIntrs {
+    static const int kOffset = 8;
+    static const int kLen = 18 - 8 + 1;
+  };
   struct CapReg32HcsParams1MaxPorts {
     static const int kOffset = 24;
     static const int kLen = 8;
   };
 
   // Table 24: Host Controller Structural Parameters 2 (HCSPARAMS2)
+  struct CapReg32HcsParams2Ist {
+    static const int kOffset = 0;
+    static const int kLen = 4;
+  };
+  // bit 3 of IST: the rest of IST is in frames (otherwise in microframes)
+  static const uint32_t kCapReg32HcsParams2IstFlagFrames = 1 << 3;
+  struct CapReg32HcsParams2ErstMax {
+    static const int kOffset = 4;
+    static const int kLen = 4;
+  };
   struct CapReg32HcsParams2MaxScratchpadHi {
     static const int kOffset = 21;
     static const int kLen = 5;
@@ -85,6 +232,10 @@ private:
   // Table 26: Host Controller Capability 1 Parameters (HCCPARAMS1)
   static const uint32_t kCapReg32HccParams1FlagContextSize = 1 << 2;
   static const uint32_t kCapReg32HccParams1FlagPortPowerControl = 1 << 3;
+  struct CapReg32HccParams1MaxPsaSize {
+    static const int kOffset = 12;
+    static const int kLen = 4;
+  };
   struct CapReg32HccParams1Xecp {
     static const int kOffset = 16;
     static const int kLen = 16;
@@ -151,24 +302,82 @@ private:
     static const int kLen = 16;
   };
 
+  // Table 47: Microframe Index Register (MFINDEX)
+  struct RunRegMfindexMicroframeIndex {
+    static const int kOffset = 0;
+    static const int kLen = 14;
+  };
+
   // Table 145: Format of xHCI Extended Capability Pointer Register
-  static const int kExtCapRegOffsetCapabilityId = 0;
-  static const int kExtCapRegLenCapabilityId = 0b11111111;
-  static const int kExtCapRegOffsetNextPointer = 8;
-  static const int kExtCapRegLenNextPointer = 8;
+  struct ExtCapRegCapabilityId {
+    static const int kOffset = 0;
+    static const int kLen = 8;
+  };
+  struct ExtCapRegNextPointer {
+    static const int kOffset = 8;
+    static const int kLen = 8;
+  };
 
   // Table 146: xHCI Extended Capability Codes
+  static const uint8_t kExCapCodeUsbLegacySupport = 1;
   static const uint8_t kExCapCodeSupportedProtocol = 2;
+  static const uint8_t kExCapCodeVendorDefinedMin = 192;
+
+  // Table 147: HC Extended Capability Registers (USBLEGSUP)
+  static const uint32_t kUsbLegSupFlagBiosOwned = 1 << 16;
+  static const uint32_t kUsbLegSupFlagOsOwned = 1 << 24;
+
+  // Table 148: USB Legacy Support Control/Status (USBLEGCTLSTS)
+  static const uint32_t kUsbLegCtlStsFlagsSmiEnableBits = (1 << 0) | (1 << 4) | (1 << 13) | (1 << 14) | (1 << 15);
+
+  // Table 150: xHCI Supported Protocol Capability Field Definitions
+  struct SupportedProtocolCap0MinorRevision {
+    static const int kOffset = 16;
+    static const int kLen = 8;
+  };
+  struct SupportedProtocolCap0MajorRevision {
+    static const int kOffset = 24;
+    static const int kLen = 8;
+  };
 
   // Table 152: xHCI Supported Protocol Capability Field Definitions
-  static const int kSupportedProtocolCap8OffsetCompatiblePortOffset = 0;
-  static const int kSupportedProtocolCap8LenCompatiblePortOffset = 8;
-  static const int kSupportedProtocolCap8OffsetCompatiblePortCount = 8;
-  static const int kSupportedProtocolCap8LenCompatiblePortCount = 8;
+  struct SupportedProtocolCap8CompatiblePortOffset {
+    static const int kOffset = 0;
+    static const int kLen = 8;
+  };
+  struct SupportedProtocolCap8CompatiblePortCount {
+    static const int kOffset = 8;
+    static const int kLen = 8;
+  };
+  struct SupportedProtocolCap8ProtocolSpeedIdCount {
+    static const int kOffset = 28;
+    static const int kLen = 4;
+  };
 
   // Table 153: xHCI Supported Protocol Capability Field Definitions
-  static const int kSupportedProtocolCapCOffsetProtocolSlotType = 0;
-  static const int kSupportedProtocolCapCLenProtocolSlotType = 4;
+  struct SupportedProtocolCapCProtocolSlotType {
+    static const int kOffset = 0;
+    static const int kLen = 5;
+  };
+
+  // Table 154: Protocol Speed ID (PSI) Dword Fields
+  struct ProtocolSpeedIdValue {
+    static const int kOffset = 0;
+    static const int kLen = 4;
+  };
+  struct ProtocolSpeedIdExponent {
+    static const int kOffset = 4;
+    static const int kLen = 2;
+  };
+  struct ProtocolSpeedIdType {
+    static const int kOffset = 6;
+    static const int kLen = 2;
+  };
+  static const uint32_t kProtocolSpeedIdFlagFullDuplex = 1 << 8;
+  struct ProtocolSpeedIdMantissa {
+    static const int kOffset = 16;
+    static const int kLen = 16;
+  };
 
   volatile uint8_t *_capreg_base_addr;
   volatile uint32_t *_capreg_base_addr32;
@@ -187,6 +396,8 @@ private:
           kOut = false,
           kIn = true,
         };
+      virtual ~Trb() {
+      }
       virtual void Set(uint32_t *addr, bool cycle_flag) = 0;
       static bool GetCycleBit(uint32_t *addr) {
         return ((addr[3] & kFlagCycleBit) != 0);
@@ -224,25 +435,39 @@ private:
     int index;
     int handle_index;
     bool cycle_flag;
+    virtual ~TrbHandler() {
+    }
+    // called with the lock of the ring held. should not block.
     virtual void Handle() = 0;
+    // return value: CompleteUnlocked() should be called after the lock of the ring is released.
+    // (checked with the lock held, so a handler on the stack of the waiter is still alive)
+    virtual bool HasUnlockedCompletion() {
+      return false;
+    }
+    virtual void CompleteUnlocked() {
+    }
   };
 
   class BlockingTrbHandler : public TrbHandler {
   public:
-    BlockingTrbHandler() {
+    BlockingTrbHandler() : _done(false) {
       pthread_cond_init(&_cond, NULL);
     }
     virtual void Handle() override {
+      _done = true;
       pthread_cond_broadcast(&_cond);
     }
     void Wait(pthread_mutex_t *mutex) {
-      pthread_cond_wait(&_cond, mutex);
+      while(!_done) {
+        pthread_cond_wait(&_cond, mutex);
+      }
     }
     ~BlockingTrbHandler() {
       pthread_cond_destroy(&_cond);
     }
   private:
     pthread_cond_t _cond;
+    bool _done;
   };
 
   class InTransferRing;
@@ -259,60 +484,95 @@ private:
     int _index;
   };
   
-  class DummyTrbHandler : public TrbHandler {
+  class IsochTransferRing;
+  class IsochTrbHandler : public TrbHandler {
   public:
-    DummyTrbHandler(BlockingTrbHandler *bhandler) : _bhandler(bhandler) {
-    }
-    virtual void Handle() override {
-      _bhandler->Handle();
+    IsochTrbHandler(IsochTransferRing *ring, int index) : _ring(ring), _index(index) {
     }
+    virtual void Handle() override;
   private:
-    BlockingTrbHandler *_bhandler;
+    IsochTransferRing *_ring;
+    const int _index;
   };
-    
+
+  // a ring consists of one or more segments chained by Link TRBs.
+  // the last entry of each segment is a Link TRB which points to the next segment.
+  // a transfer ring grows by inserting new segments when it runs out of free TRBs.
   class TrbRing : public TrbRingBase {
   public:
-    void Init(DevXhci *hc) {
+    void Init(DevXhci *hc, int num_segments = 1) {
+      assert(0 < num_segments && num_segments <= kMaxSegments);
       InitSub(hc);
-      _mem = new Memory(kEntrySize * kEntryNum);
-      _ring_address = _mem->GetVirtPtr<uint32_t>();
+      _num_segments = 0;
+      _enqueue_segment = 0;
       _enqueue_index = 0;
+      _dequeue_segment = 0;
+      _dequeue_index = 0;
+      _outstanding = 0;
       _cycle_flag = true;
+      pthread_mutex_init(&_lock, NULL);
       pthread_cond_init(&_cond, NULL);
-      for (int i = 0; i < sizeof(_context) / sizeof(_context[0]); i++) {
-        _context[i].status = ContextStatus::kOwnedBySoftware;
-      }
 
-      memset(_ring_address, 0, kEntrySize * kEntryNum);
-      
-      // set link TRB
-      LinkTrb trb(_mem->GetPhysPtr());
-      trb.Set(_ring_address + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t)), true);
+      for (int i = 0; i < num_segments; i++) {
+        AllocSegment();
+      }
+      for (int i = 0; i < num_segments; i++) {
+        // toggle the cycle bit at the end of the last segment
+        SetLink(i, (i + 1) % num_segments, i == num_segments - 1);
+      }
     }
+    // the first segment. the controller starts processing from here.
     Memory &GetMemory() {
-      return *_mem;
+      return *_segments[0]->mem;
     }
     int GetIndexFromEntryAddr(phys_addr addr) {
-      assert(_mem->GetPhysPtr() <= addr);
-      int index = (addr - _mem->GetPhysPtr()) / kEntrySize;
-      assert(index < kEntryNum);
-      return index;
+      for (int i = 0; i < _num_segments; i++) {
+        phys_addr segment_addr = _segments[i]->mem->GetPhysPtr();
+        if (segment_addr <= addr && addr < segment_addr + kEntrySize * kEntryNum) {
+          return i * kEntryNum + (addr - segment_addr) / kEntrySize;
+        }
+      }
+      assert(false);
+    }
+    // takes _lock, since the ring may grow.
+    bool Contains(phys_addr addr) {
+      bool found = false;
+      pthread_mutex_lock(&_lock);
+      for (int i = 0; i < _num_segments; i++) {
+        phys_addr segment_addr = _segments[i]->mem->GetPhysPtr();
+        if (segment_addr <= addr && addr < segment_addr + kEntrySize * kEntryNum) {
+          found = true;
+          break;
+        }
+      }
+      pthread_mutex_unlock(&_lock);
+      return found;
+    }
+    int GetSegmentNum() {
+      return _num_segments;
     }
     static const int kEntrySize = 16;
+    // number of entries in a segment (including the Link TRB)
     static const int kEntryNum = 256;
+    static const int kMaxSegments = 16;
+#ifndef NDEBUG
+    // fills a growable ring with single TRB allocations, and checks that it grows instead of blocking
+    static void CheckGrowth(DevXhci *hc);
+#endif
   protected:
     class LinkTrb : public Trb {
     public:
-      LinkTrb(phys_addr ring_address) : _ring_address(ring_address) {
+      LinkTrb(phys_addr ring_address, bool toggle_cycle) : _ring_address(ring_address), _toggle_cycle(toggle_cycle) {
       }
       virtual void Set(uint32_t *addr, bool cycle_flag) override {
         addr[0] = _ring_address;
         addr[1] = _ring_address >> 32;
         addr[2] = 0;
-        addr[3] = kLinkTrbFlagToggleCycle;
+        addr[3] = _toggle_cycle ? kLinkTrbFlagToggleCycle : 0;
         SetSub(addr, kValueTrbType, cycle_flag);
       }
-      static void ToggleCycle(uint32_t *addr) {
+      static bool IsToggleCycle(uint32_t *addr) {
+        return (addr[3] & kLinkTrbFlagToggleCycle) != 0;
       }
     private:
       // Table 134: Offset 0Ch – Link TRB Field Definitions
@@ -322,45 +582,149 @@ private:
       static const uint32_t kValueTrbType = 6;
 
       const phys_addr _ring_address;
+      const bool _toggle_cycle;
     };
-    
-    void AllocTrb(TrbHandler &handler, pthread_mutex_t *mutex) {
-      while(_context[_enqueue_index].status == ContextStatus::kOwnedByHardware) {
-        if (pthread_cond_wait(&_cond, mutex) < 0) {
+
+    // called when a new segment is allocated. index of TRBs in the segment start from segment * kEntryNum.
+    virtual void InitSegment(int segment) {
+    }
+
+    uint32_t *GetTrbAddr(int index) {
+      return _segments[index / kEntryNum]->addr + (index % kEntryNum) * (kEntrySize / sizeof(uint32_t));
+    }
+    phys_addr GetTrbPhysAddr(int index) {
+      return _segments[index / kEntryNum]->mem->GetPhysPtr() + (index % kEntryNum) * kEntrySize;
+    }
+    // should be called with _lock held.
+    bool IsOwnedByHardware(int index) {
+      return _segments[index / kEntryNum]->context[index % kEntryNum].status == ContextStatus::kOwnedByHardware;
+    }
+
+    // functions below should be called with _lock held.
+
+    // wait until num TRBs can be allocated without blocking.
+    // a growable ring inserts new segments instead of waiting if possible.
+    void Reserve(int num) {
+      assert(num <= kMaxSegments * (kEntryNum - 1));
+      while(GetFreeNum() < num) {
+        if (_growable && Grow(num - GetFreeNum())) {
+          continue;
+        }
+        if (pthread_cond_wait(&_cond, &_lock) < 0) {
           perror("pthread_cond_wait:");
         }
       }
-      handler.index = _enqueue_index;
+      // a full ring cannot grow (see Grow()), so grow while a few free TRBs are left.
+      // retried on each reservation until the dequeue pointer leaves the way.
+      if (_growable && GetFreeNum() - num < kGrowThreshold) {
+        Grow(kEntryNum - 1);
+      }
+    }
+    
+    void AllocTrb(TrbHandler &handler) {
+      Reserve(1);
+      Segment *segment = _segments[_enqueue_segment];
+      assert(segment->context[_enqueue_index].status == ContextStatus::kOwnedBySoftware);
+      handler.index = _enqueue_segment * kEntryNum + _enqueue_index;
       handler.cycle_flag = _cycle_flag;
-      _context[_enqueue_index].handler = &handler;
-      _context[_enqueue_index].status = ContextStatus::kOwnedByHardware;
+      segment->context[_enqueue_index].handler = &handler;
+      segment->context[_enqueue_index].status = ContextStatus::kOwnedByHardware;
+      _outstanding++;
       _enqueue_index++;
       if (_enqueue_index == kEntryNum - 1) {
+        // hand the Link TRB over to the controller
+        uint32_t *link = segment->addr + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t));
+        assert(_cycle_flag != LinkTrb::GetCycleBit(link));
+        LinkTrb::ToggleCycleBit(link);
+        if (LinkTrb::IsToggleCycle(link)) {
+          _cycle_flag = !_cycle_flag;
+        }
+        _enqueue_segment = segment->next;
         _enqueue_index = 0;
-        _cycle_flag = !_cycle_flag;
-        LinkTrb trb(0); // dummy
-        assert(_cycle_flag != trb.GetCycleBit(_ring_address + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t))));
-        trb.ToggleCycleBit(_ring_address + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t)));
-	uint32_t *tmp = _ring_address + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t));
       }
       return;
     }
     
-    // release trb from consumer
+    // release trb from consumer.
+    // TRBs between the dequeue pointer and the completed TRB (e.g. TRBs of the same TD without IOC)
+    // have also been consumed by the controller.
+    // return value: the handler if its CompleteUnlocked() should be called after releasing _lock
     TrbHandler *ReleaseTrb(int index) {
-      assert(index < kEntryNum);
-      TrbContext *context = &_context[index];
+      assert(index / kEntryNum < _num_segments && index % kEntryNum < kEntryNum - 1);
+      TrbContext *context = &_segments[index / kEntryNum]->context[index % kEntryNum];
       assert(context->status == ContextStatus::kOwnedByHardware);
-      if (pthread_cond_signal(&_cond) < 0) {
-        perror("pthread_cond_signal:");
+      while(true) {
+        Segment *segment = _segments[_dequeue_segment];
+        bool last = (_dequeue_segment * kEntryNum + _dequeue_index == index);
+        segment->context[_dequeue_index].status = ContextStatus::kOwnedBySoftware;
+        _outstanding--;
+        _dequeue_index++;
+        if (_dequeue_index == kEntryNum - 1) {
+          _dequeue_segment = segment->next;
+          _dequeue_index = 0;
+        }
+        if (last) {
+          break;
+        }
+      }
+      if (pthread_cond_broadcast(&_cond) < 0) {
+        perror("pthread_cond_broadcast:");
       }
       context->handler->handle_index = index;
-      context->status = ContextStatus::kOwnedBySoftware;
       context->handler->Handle();
-      return context->handler;
+      return context->handler->HasUnlockedCompletion() ? context->handler : nullptr;
+    }
+
+    // the TRB which the controller consumes next. equals to GetEnqueueIndex() if no TRB is outstanding.
+    int GetDequeueIndex() {
+      return _dequeue_segment * kEntryNum + _dequeue_index;
+    }
+    // the TRB which is written next
+    int GetEnqueueIndex() {
+      return _enqueue_segment * kEntryNum + _enqueue_index;
+    }
+    // waits for a change of the ring, which is notified by ReleaseTrb() or NotifyChange()
+    void WaitChange() {
+      if (pthread_cond_wait(&_cond, &_lock) < 0) {
+        perror("pthread_cond_wait:");
+      }
+    }
+    void NotifyChange() {
+      if (pthread_cond_broadcast(&_cond) < 0) {
+        perror("pthread_cond_broadcast:");
+      }
+    }
+    // index of the TRB which follows the TRB (skipping the Link TRB)
+    int GetNextIndex(int index) {
+      index++;
+      if (index % kEntryNum == kEntryNum - 1) {
+        return _segments[index / kEntryNum]->next * kEntryNum;
+      }
+      return index;
+    }
+    // the last TRB of the TD which the TRB belongs to. TRBs of a TD share the handler.
+    int GetTdEnd(int index) {
+      TrbHandler *handler = _segments[index / kEntryNum]->context[index % kEntryNum].handler;
+      while(true) {
+        int next = GetNextIndex(index);
+        if (next == GetEnqueueIndex() || !IsOwnedByHardware(next) || _segments[next / kEntryNum]->context[next % kEntryNum].handler != handler) {
+          return index;
+        }
+        index = next;
+      }
+    }
+    // the cycle state which the controller should have when it dequeues the TRB
+    bool GetConsumerCycle(int index) {
+      if (index == GetEnqueueIndex()) {
+        // not written yet
+        return _cycle_flag;
+      }
+      return Trb::GetCycleBit(GetTrbAddr(index));
     }
 
-    uint32_t *_ring_address;
+    bool _growable = false;
+    // protects the ring. the event handler also takes it to complete TRBs.
+    pthread_mutex_t _lock;
   private:
     enum class ContextStatus : bool
       {
@@ -371,23 +735,106 @@ private:
       ContextStatus status;
       TrbHandler *handler;
     };
+    struct Segment {
+      Memory *mem;
+      uint32_t *addr;
+      int next;  // id of the next segment in the ring
+      TrbContext context[kEntryNum];
+    };
 
-    Memory *_mem;
+    // free TRBs below which a growable ring grows in advance
+    static const int kGrowThreshold = (kEntryNum - 1) / 4;
+
+    int GetFreeNum() {
+      return _num_segments * (kEntryNum - 1) - _outstanding;
+    }
+    int AllocSegment() {
+      assert(_num_segments < kMaxSegments);
+      int id = _num_segments;
+      Segment *segment = new Segment;
+      segment->mem = new Memory(kEntrySize * kEntryNum);
+      segment->addr = segment->mem->GetVirtPtr<uint32_t>();
+      segment->next = id;
+      memset(segment->addr, 0, kEntrySize * kEntryNum);
+      for (int i = 0; i < kEntryNum; i++) {
+        segment->context[i].status = ContextStatus::kOwnedBySoftware;
+        // entries of the new segment should not be valid for the current producer cycle
+        if (_cycle_flag == false) {
+          Trb::ToggleCycleBit(segment->addr + i * (kEntrySize / sizeof(uint32_t)));
+        }
+      }
+      _segments[id] = segment;
+      _num_segments++;
+      InitSegment(id);
+      return id;
+    }
+    // the Link TRB becomes valid when the producer passes it.
+    void SetLink(int from, int to, bool toggle_cycle) {
+      LinkTrb trb(_segments[to]->mem->GetPhysPtr(), toggle_cycle);
+      trb.Set(_segments[from]->addr + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t)), !_cycle_flag);
+      _segments[from]->next = to;
+    }
+    // insert segments just after the enqueue segment.
+    // the controller never reaches the Link TRB of the enqueue segment before the producer passes it,
+    // so it is safe to rewrite it unless the dequeue pointer is in the rest of the enqueue segment.
+    // if the ring is full, the dequeue pointer is at the enqueue pointer, and the TRBs in the rest of
+    // the segment (and its Link TRB) are still to be processed, so no segment can be inserted.
+    bool Grow(int num) {
+      if (_outstanding != 0 && _dequeue_segment == _enqueue_segment && _dequeue_index >= _enqueue_index) {
+        return false;
+      }
+      int num_segments = (num + kEntryNum - 2) / (kEntryNum - 1);
+      if (_num_segments + num_segments > kMaxSegments) {
+        return false;
+      }
+      int prev = _enqueue_segment;
+      for (int i = 0; i < num_segments; i++) {
+        uint32_t *link = _segments[prev]->addr + (kEntryNum - 1) * (kEntrySize / sizeof(uint32_t));
+        bool toggle_cycle = LinkTrb::IsToggleCycle(link);
+        int id = AllocSegment();
+        // the new segment takes over the Toggle Cycle flag
+        SetLink(id, _segments[prev]->next, toggle_cycle);
+        SetLink(prev, id, false);
+        prev = id;
+      }
+      return true;
+    }
+
+    Segment *_segments[kMaxSegments];
+    int _num_segments;
+    int _enqueue_segment;
     int _enqueue_index;
+    int _dequeue_segment;
+    int _dequeue_index;
+    // number of TRBs owned by the controller
+    int _outstanding;
     bool _cycle_flag;
-    TrbContext _context[kEntryNum];
     pthread_cond_t _cond;
   };
 
   enum class TrbCompletionCode : uint8_t
     {
       kSuccess = 1,
+      kBabbleDetectedError = 3,
+      kUsbTransactionError = 4,
+      kTrbError = 5,
+      kStallError = 6,
+      kShortPacket = 13,
+      kRingUnderrun = 14,
+      kRingOverrun = 15,
+      kContextStateError = 19,
+      kMissedServiceError = 23,
+      kStopped = 26,
+      kStoppedLengthInvalid = 27,
+      kStoppedShortPacket = 28,
+      kSplitTransactionError = 36,
     };
   static const char* const _completion_code_table[];
   static const char * const GetString(TrbCompletionCode code) {
     return _completion_code_table[static_cast<uint8_t>(code)];
   }
 
+  class EndpointRecovery;
   class TransferRing : public TrbRing {
   public:
     struct CompletionInfo {
@@ -404,6 +851,16 @@ private:
       bool GetIoc() {
         return _ioc;
       }
+      void SetInterrupterTarget(int interrupter_target) {
+        _interrupter_target = interrupter_target;
+      }
+      // physical address of the entry which the TRB is written to
+      void SetTrbAddr(phys_addr trb_addr) {
+        _trb_addr = trb_addr;
+      }
+      void SetStreamId(int stream_id) {
+        _stream_id = stream_id;
+      }
       void SetSub(uint32_t *addr, uint32_t type, bool cycle_flag) {
         addr[3]
           |= (_chain ? kFlagChainBit : 0)
@@ -420,20 +877,26 @@ private:
       const bool _chain;
       const bool _ioc;
       const bool _idt;
+      int _interrupter_target = 0;
+      phys_addr _trb_addr = 0;
+      int _stream_id = 0;
     };
 
     class NormalTrb : public TransferTrb {
     public:
       NormalTrb() = delete;
-      NormalTrb(phys_addr addr, int transfer_len, bool ioc, bool idt) : TransferTrb(false, ioc, idt), _addr(addr), _transfer_len(transfer_len) {
+      NormalTrb(phys_addr addr, int transfer_len, bool ioc, bool idt) : TransferTrb(false, ioc, idt), _addr(addr), _transfer_len(transfer_len), _td_size(0) {
+      }
+      // a TRB of a multi-TRB TD. td_size: number of packets remaining after this TRB (see 4.11.2.4)
+      NormalTrb(phys_addr addr, int transfer_len, int td_size, bool chain, bool ioc) : TransferTrb(chain, ioc, false), _addr(addr), _transfer_len(transfer_len), _td_size(td_size) {
       }
       virtual void Set(uint32_t *addr, bool cycle_flag) override {
         addr[0] = _addr;
         addr[1] = _addr >> 32;
         addr[2]
           = GenerateValue<TransferLength, uint32_t>(_transfer_len)
-          | GenerateValue<TdSize, uint32_t>(0)
-          | GenerateValue<InterruptTarget, uint32_t>(0);
+          | GenerateValue<TdSize, uint32_t>(_td_size)
+          | GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
         addr[3] = 0;
         SetSub(addr, kValueTrbType, cycle_flag);
       }
@@ -444,7 +907,7 @@ private:
       // Table 74: Offset 08h – Normal TRB Field Definitions Bits
       struct TransferLength {
         static const int kOffset = 0;
-        static const int kLen = 16;
+        static const int kLen = 17;
       };
       struct TdSize {
         static const int kOffset = 17;
@@ -457,6 +920,99 @@ private:
 
       const phys_addr _addr;
       const int _transfer_len;
+      const int _td_size;
+    };
+
+    // the Transfer Event of an Event Data TRB reports the number of bytes transferred by the TD (EDTLA)
+    class EventDataTrb : public TransferTrb {
+    public:
+      EventDataTrb(bool ioc) : TransferTrb(false, ioc, false) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        // the Event Data is reported in the TRB Pointer field of the Transfer Event.
+        // use the address of this TRB, so that the event is bound to the ring entry.
+        // the stream ID is tagged above the address, since Transfer Events do not report it.
+        phys_addr event_data = _trb_addr | (static_cast<phys_addr>(_stream_id) << kEventDataStreamIdShift);
+        addr[0] = event_data;
+        addr[1] = event_data >> 32;
+        addr[2]
+          = GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
+        addr[3] = 0;
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+    private:
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 7;
+
+      // Table 87: Offset 08h – Event Data TRB Field Definitions
+      struct InterruptTarget {
+        static const int kOffset = 22;
+        static const int kLen = 31 - 22 + 1;
+      };
+    };
+
+    // the first TRB of an isochronous TD
+    class IsochTrb : public TransferTrb {
+    public:
+      IsochTrb() = delete;
+      // tbc, tlbpc: Transfer Burst Count and Transfer Last Burst Packet Count (see 4.11.2.3)
+      // sia: Start Isoch ASAP. frame_id is ignored if set.
+      IsochTrb(phys_addr addr, int transfer_len, int td_size, int tbc, int tlbpc, bool sia, int frame_id, bool chain, bool ioc) : TransferTrb(chain, ioc, false), _addr(addr), _transfer_len(transfer_len), _td_size(td_size), _tbc(tbc), _tlbpc(tlbpc), _sia(sia), _frame_id(frame_id) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        addr[0] = _addr;
+        addr[1] = _addr >> 32;
+        addr[2]
+          = GenerateValue<TransferLength, uint32_t>(_transfer_len)
+          | GenerateValue<TdSize, uint32_t>(_td_size)
+          | GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
+        addr[3]
+          = GenerateValue<TransferBurstCount, uint32_t>(_tbc)
+          | GenerateValue<TransferLastBurstPacketCount, uint32_t>(_tlbpc)
+          | (_sia ? kFlagStartIsochAsap : GenerateValue<FrameId, uint32_t>(_frame_id));
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+      static const int kFrameIdMask = (1 << 11) - 1;
+    private:
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 5;
+
+      // Table 85: Offset 08h – Isoch TRB Field Definitions
+      struct TransferLength {
+        static const int kOffset = 0;
+        static const int kLen = 17;
+      };
+      struct TdSize {
+        static const int kOffset = 17;
+        static const int kLen = 21 - 17 + 1;
+      };
+      struct InterruptTarget {
+        static const int kOffset = 22;
+        static const int kLen = 31 - 22 + 1;
+      };
+
+      // Table 86: Offset 0Ch – Isoch TRB Field Definitions
+      struct TransferBurstCount {
+        static const int kOffset = 7;
+        static const int kLen = 8 - 7 + 1;
+      };
+      struct TransferLastBurstPacketCount {
+        static const int kOffset = 16;
+        static const int kLen = 19 - 16 + 1;
+      };
+      struct FrameId {
+        static const int kOffset = 20;
+        static const int kLen = 30 - 20 + 1;
+      };
+      static const uint32_t kFlagStartIsochAsap = 1u << 31;
+
+      const phys_addr _addr;
+      const int _transfer_len;
+      const int _td_size;
+      const int _tbc;
+      const int _tlbpc;
+      const bool _sia;
+      const int _frame_id;
     };
 
     class SetupStageTrb : public TransferTrb {
@@ -474,7 +1030,7 @@ private:
         memcpy(addr, &_request, sizeof(UsbCtrl::DeviceRequest));
         addr[2]
           = GenerateValue<TrbTransferLength, uint32_t>(8)
-          | GenerateValue<InterruptTarget, uint32_t>(0);
+          | GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
         addr[3]
           = GenerateValue<TransferType, uint32_t>(static_cast<uint8_t>(_type));
         SetSub(addr, kValueTrbType, cycle_flag);
@@ -514,7 +1070,7 @@ private:
         addr[2]
           = GenerateValue<TransferLength, uint32_t>(_transfer_len)
           | GenerateValue<TdSize, uint32_t>(0)
-          | GenerateValue<InterruptTarget, uint32_t>(0);
+          | GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
         addr[3]
           = (static_cast<bool>(_dir) ? kFlagDirection : 0);
         SetSub(addr, kValueTrbType, cycle_flag);
@@ -556,7 +1112,7 @@ private:
         addr[0] = 0;
         addr[1] = 0;
         addr[2]
-          = GenerateValue<InterruptTarget, uint32_t>(0);
+          = GenerateValue<InterruptTarget, uint32_t>(_interrupter_target);
         addr[3]
           = (static_cast<bool>(_dir) ? kFlagDirection : 0);
         SetSub(addr, kValueTrbType, cycle_flag);
@@ -577,84 +1133,344 @@ private:
       const Direction _dir;
     };
     void Init(DevXhci *hc) = delete;
-    void Init(Device *device, int dci) {
+    // stream_id: the ring serves the stream of the endpoint (0: the endpoint has no streams)
+    void Init(Device *device, int dci, int max_packet_size, int stream_id = 0) {
       _device = device;
       _dci = dci;
+      _stream_id = stream_id;
+      _max_packet_size = max_packet_size;
+      _interrupter_target = device->GetInterrupterTarget();
+      _growable = true;
       TrbRing::Init(device->GetHc());
     }
-    void CompleteTransfer(int index, CompletionInfo &info) {
-      _info[index] = info;
-      ReleaseTrb(index);
+    void SetInterrupterTarget(int interrupter_target) {
+      pthread_mutex_lock(&_lock);
+      _interrupter_target = interrupter_target;
+      pthread_mutex_unlock(&_lock);
+    }
+    // called from the event handler.
+    // an error which halts the endpoint (4.10.2) starts its recovery (4.8.3), and the failed TD
+    // is completed once the endpoint is ready to execute the next TD.
+    void CompleteTransfer(phys_addr pointer, CompletionInfo &info);
+    // insert TRBs of a TD to the ring without ringing the doorbell. _lock should be held.
+    // all TRBs of the TD share the handler. it is called once, when the TD completes
+    // or when a TRB of the TD reports an error.
+    void Enqueue(TransferTrb *trb[], const int array_len, TrbHandler &handler) {
+      // TRBs of a TD should not be separated by waiting for free TRBs
+      Reserve(array_len);
+      for(int i = 0; i < array_len; i++) {
+        assert(trb[i]->GetIoc() == (i == array_len - 1));
+        AllocTrb(handler);
+        trb[i]->SetInterrupterTarget(_interrupter_target);
+        trb[i]->SetTrbAddr(GetTrbPhysAddr(handler.index));
+        trb[i]->SetStreamId(_stream_id);
+        trb[i]->Set(GetTrbAddr(handler.index), handler.cycle_flag);
+      }
     }
     // insert TRBs to the ring. get state from completion event.
-    CompletionInfo Issue(TransferTrb *trb[], const int array_len, pthread_mutex_t *mutex) {
+    CompletionInfo Issue(TransferTrb *trb[], const int array_len) {
       BlockingTrbHandler bhandler;
+      pthread_mutex_lock(&_lock);
+      Enqueue(trb, array_len, bhandler);
+      _device->RingEndpointDoorbell(_dci, _stream_id);
+      bhandler.Wait(&_lock);
+      CompletionInfo info = GetInfo(bhandler.handle_index);
+      pthread_mutex_unlock(&_lock);
+      return info;
+    }
+    // same as Issue(), but returns without waiting.
+    // completion->Complete() is called from the event handler (without the lock of the ring) when the TD completes.
+    void Submit(TransferTrb *trb[], const int array_len, TransferCompletion *completion) {
+      pthread_mutex_lock(&_lock);
+      Enqueue(trb, array_len, *new AsyncTrbHandler(this, completion));
+      pthread_mutex_unlock(&_lock);
+      _device->RequestEndpointDoorbell(_dci, _stream_id);
+    }
+    // transfer the scatter list as a single TD of chained Normal TRBs terminated by an Event Data TRB.
+    // transfer_length of the return value is the number of transferred bytes.
+    CompletionInfo IssueBulk(UsbCtrl::IoVector *iov, int iovcnt);
+    // same as IssueBulk(), but returns without waiting.
+    // completion->Complete() is called from the event handler (without the lock of the ring) when the TD completes.
+    void SubmitBulk(UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion);
+    // cancellation of all TDs on the ring (see Device::ResetEndpoint()).
+    // waits for the recovery of the endpoint (if any), and holds off new ones until EndCancel().
+    void BeginCancel() {
+      pthread_mutex_lock(&_lock);
+      _cancelling = true;
+      while(_recovering) {
+        WaitChange();
+      }
+      pthread_mutex_unlock(&_lock);
+    }
+    // the endpoint should be stopped (or halted). the handlers of the TDs are called with kStopped.
+    // dequeue_ptr, dcs: where the endpoint should restart from
+    void Cancel(phys_addr &dequeue_ptr, bool &dcs);
+    void EndCancel() {
+      pthread_mutex_lock(&_lock);
+      _cancelling = false;
+      pthread_mutex_unlock(&_lock);
+    }
+    // an Event Data TRB counts transferred bytes in 24 bits (EDTLA)
+    static const size_t kMaxBulkTransferLength = (1 << 24) - 1;
+    // physical addresses of TRBs fit in 48 bits
+    static const int kEventDataStreamIdShift = 48;
+    static int GetStreamIdFromEventData(phys_addr event_data) {
+      return event_data >> kEventDataStreamIdShift;
+    }
+    static phys_addr GetTrbAddrFromEventData(phys_addr event_data) {
+      return event_data & ((static_cast<phys_addr>(1) << kEventDataStreamIdShift) - 1);
+    }
+  protected:
+    // a data buffer of a TRB must not span a 64KB boundary (see 6.1)
+    static const phys_addr kTrbBufferBoundary = 64 * 1024;
+
+    // the controller has no TD to execute on an isochronous endpoint. called with _lock held.
+    virtual void HandleRingEmpty(TrbCompletionCode code) {
+      printf("xhci: warning: unexpected event (%s)\n", GetString(code));
+    }
+    // errors of isochronous transfers do not halt the endpoint (4.10.2)
+    virtual bool CanHalt() {
+      return true;
+    }
+    // 4.6.9: reported by the TD which Stop Endpoint interrupted
+    static bool IsStopCode(TrbCompletionCode code) {
+      return code == TrbCompletionCode::kStopped || code == TrbCompletionCode::kStoppedLengthInvalid || code == TrbCompletionCode::kStoppedShortPacket;
+    }
+    static bool IsHaltingError(TrbCompletionCode code) {
+      switch(code) {
+      case TrbCompletionCode::kBabbleDetectedError:
+      case TrbCompletionCode::kUsbTransactionError:
+      case TrbCompletionCode::kTrbError:
+      case TrbCompletionCode::kStallError:
+      case TrbCompletionCode::kSplitTransactionError:
+        return true;
+      default:
+        return false;
+      }
+    }
 
-      for(int i = 0; i < array_len - 1; i++) {
-        assert(!trb[i]->GetIoc());
-        DummyTrbHandler handler(&bhandler);
-        AllocTrb(handler, mutex);
+    // the rest of a failed TD is turned into No Op TRBs, so that the controller skips it
+    // even if the endpoint is restarted by a doorbell before its dequeue pointer is moved.
+    class NoOpTrb : public TransferTrb {
+    public:
+      NoOpTrb() : TransferTrb(false, false, false) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        addr[0] = 0;
+        addr[1] = 0;
+        addr[2] = 0;
+        addr[3] = 0;
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+    private:
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 8;
+    };
 
-        trb[i]->Set(_ring_address + handler.index * (kEntrySize / sizeof(uint32_t)), handler.cycle_flag);
+    friend class EndpointRecovery;
+    // called with _lock held. return: the recovery to be started after releasing _lock (nullptr if none)
+    EndpointRecovery *Halt(int index, CompletionInfo &info);
+    // the failed TD whose endpoint is being recovered
+    // return: the handler if its CompleteUnlocked() should be called after releasing _lock
+    TrbHandler *ReleaseHaltedTd() {
+      if (_halted_td < 0) {
+        return nullptr;
       }
-      
-      assert(trb[array_len - 1]->GetIoc());
-      
-      AllocTrb(bhandler, mutex);
+      TrbHandler *handler = ReleaseTrb(_halted_td);
+      _halted_td = -1;
+      return handler;
+    }
+    // the last TRB of the failed TD (-1 if none)
+    int _halted_td = -1;
+    // an EndpointRecovery of the ring is in progress
+    bool _recovering = false;
+    // see BeginCancel()
+    bool _cancelling = false;
+
+    // allocated per submission. deletes itself after notifying the completion.
+    class AsyncTrbHandler : public TrbHandler {
+    public:
+      AsyncTrbHandler(TransferRing *ring, TransferCompletion *completion) : _ring(ring), _completion(completion) {
+      }
+      virtual void Handle() override {
+        _info = _ring->GetInfo(handle_index);
+      }
+      virtual bool HasUnlockedCompletion() override {
+        return true;
+      }
+      virtual void CompleteUnlocked() override;
+    private:
+      TransferRing *_ring;
+      TransferCompletion *_completion;
+      CompletionInfo _info;
+    };
 
-      trb[array_len - 1]->Set(_ring_address + bhandler.index * (kEntrySize / sizeof(uint32_t)), bhandler.cycle_flag);
-      _device->RingEndpointDoorbell(_dci);
-      bhandler.Wait(mutex);
-      return _info[bhandler.handle_index];
+    // return value: array of TRBs of the TD. should be freed by ReleaseBulkTd().
+    TransferTrb **BuildBulkTd(UsbCtrl::IoVector *iov, int iovcnt, int &array_len);
+    void ReleaseBulkTd(TransferTrb **trb, int array_len) {
+      for (int i = 0; i < array_len; i++) {
+        delete trb[i];
+      }
+      delete[] trb;
     }
-  protected:
-    CompletionInfo _info[kEntryNum];
+
+    virtual void InitSegment(int segment) override {
+      _info[segment] = new CompletionInfo[kEntryNum];
+    }
+    CompletionInfo &GetInfo(int index) {
+      return _info[index / kEntryNum][index % kEntryNum];
+    }
+    CompletionInfo *_info[kMaxSegments];
     Device *_device;
     int _dci;
+    int _stream_id;
+    int _interrupter_target;
+    int _max_packet_size;
   };
   
   class OutTransferRing : public TransferRing {
   public:
   };
 
-  class InTransferRing : public TransferRing {
+  class InTransferRing : public TransferRing, public InTransferLease::Owner {
   public:
     ~InTransferRing() {
       delete _mem;
     }
-    void Fill(pthread_mutex_t *mutex, int max_packet_size, RingBuffer<uint8_t *> *buf) {
-      _mutex = mutex;
-      _max_packet_size = max_packet_size;
+    // either buf or lease_buf should be specified.
+    // buf: each packet is copied to a new buffer.
+    // lease_buf: each packet is lent to the consumer without copying. the TRB is re-posted when the lease is returned.
+    void Fill(SpscRingBuffer<uint8_t *> *buf, SpscRingBuffer<InTransferLease> *lease_buf) {
+      assert((buf == nullptr) != (lease_buf == nullptr));
+      pthread_mutex_lock(&_lock);
       _buf = buf;
-      _mem = new Memory(max_packet_size * (kEntryNum - 1));
+      _lease_buf = lease_buf;
+      _mem = new Memory(_max_packet_size * (kEntryNum - 1));
       for (int i = 0; i < kEntryNum - 1; i++) {
-        TransferRing::NormalTrb trb(_mem->GetPhysPtr() + i * max_packet_size, max_packet_size, true, false);
+        TransferRing::NormalTrb trb(_mem->GetPhysPtr() + i * _max_packet_size, _max_packet_size, true, false);
+        trb.SetInterrupterTarget(_interrupter_target);
         _handlers[i] = new BufferingNormalTrbHandler(this);
         _handlers[i]->SetIndexOfRing(i);
         
-        AllocTrb(*_handlers[i], mutex);
+        AllocTrb(*_handlers[i]);
 	assert(i == _handlers[i]->index);
 
-        trb.Set(_ring_address + _handlers[i]->index * (kEntrySize / sizeof(uint32_t)), _handlers[i]->cycle_flag);
+        trb.Set(GetTrbAddr(_handlers[i]->index), _handlers[i]->cycle_flag);
       }
+      pthread_mutex_unlock(&_lock);
     }
-    void Handle(int index) {
-      uint8_t *data = new uint8_t[_max_packet_size];
-      memcpy(data, _mem->GetVirtPtr<uint8_t>() + index * _max_packet_size, _max_packet_size);
-      _buf->Push(data);
+    // index: index of the buffer, trb_index: index of the completed TRB
+    // called with _lock held.
+    void Handle(int index, int trb_index) {
+      uint8_t *packet = _mem->GetVirtPtr<uint8_t>() + index * _max_packet_size;
+      // TRB Transfer Length of the Transfer Event is the residual number of bytes
+      CompletionInfo &info = GetInfo(trb_index);
+      int length = _max_packet_size - info.transfer_length;
+      if (info.completion_code != TrbCompletionCode::kSuccess && info.completion_code != TrbCompletionCode::kShortPacket) {
+        length = 0;
+      }
 
+      if (_lease_buf != nullptr) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t timestamp = static_cast<uint64_t>(now.tv_sec) * 1000 * 1000 * 1000 + now.tv_nsec;
+        if (_lease_buf->Push(InTransferLease(this, index, packet, length, timestamp))) {
+          return;
+        }
+        // the consumer is too slow. drop the packet.
+      } else {
+        uint8_t *data = new uint8_t[_max_packet_size];
+        memcpy(data, packet, _max_packet_size);
+        if (!_buf->Push(data)) {
+          delete[] data;
+        }
+      }
+
+      Repost(index);
+      _device->RequestEndpointDoorbell(_dci);
+    }
+    virtual void ReturnLease(int index) override {
+      pthread_mutex_lock(&_lock);
+      Repost(index);
+      pthread_mutex_unlock(&_lock);
+      _device->RequestEndpointDoorbell(_dci);
+    }
+  private:
+    Memory *_mem = nullptr;
+    BufferingNormalTrbHandler *_handlers[kEntryNum - 1];
+    SpscRingBuffer<uint8_t *> *_buf;
+    SpscRingBuffer<InTransferLease> *_lease_buf;
+
+    void Repost(int index) {
       TransferRing::NormalTrb trb(_mem->GetPhysPtr() + index * _max_packet_size, _max_packet_size, true, false);
+      trb.SetInterrupterTarget(_interrupter_target);
+
+      AllocTrb(*_handlers[index]);
 
-      AllocTrb(*_handlers[index], _mutex);
+      trb.Set(GetTrbAddr(_handlers[index]->index), _handlers[index]->cycle_flag);
+    }
+  };
 
-      trb.Set(_ring_address + _handlers[index]->index * (kEntrySize / sizeof(uint32_t)), _handlers[index]->cycle_flag);
+  // isochronous streaming. a TD transfers the payload of a service interval (ESIT) from/to a buffer,
+  // and kTdNum buffers circulate between the ring and the user.
+  // when the ring has run dry, the next TD is scheduled to a frame a little ahead of MFINDEX,
+  // and following TDs are scheduled back to back (Start Isoch ASAP).
+  class IsochTransferRing : public TransferRing, public IsochPacket::Owner {
+  public:
+    virtual bool CanHalt() override {
+      return false;
+    }
+    ~IsochTransferRing() {
+      delete _mem;
+      for (int i = 0; i < kTdNum; i++) {
+        delete _handlers[i];
+      }
+    }
+    // IN: all buffers are posted to the ring.
+    // OUT: all buffers are handed to the user as empty packets.
+    void Start(UsbCtrl::PacketIdentification direction, int esit_payload, int max_burst, bool superspeed, SpscRingBuffer<IsochPacket> *buf);
+    // index: index of the buffer, trb_index: index of the completed TRB
+    // called with _lock held.
+    void Handle(int index, int trb_index);
+    virtual void ReturnIsochPacket(int index, int length) override;
+    static const int kTdNum = 64;
+  protected:
+    virtual void HandleRingEmpty(TrbCompletionCode code) override {
+      // reported with the next packet
+      _empty_status = (code == TrbCompletionCode::kRingUnderrun) ? IsochPacket::Status::kRingUnderrun : IsochPacket::Status::kRingOverrun;
     }
   private:
+    // the first TD after the ring has run dry starts this number of frames beyond IST (4.14.2.1.4),
+    // which covers the rest of the current frame and gives the user time to queue following TDs.
+    static const int kScheduleMarginFrames = 2;
+
+    // functions below should be called with _lock held.
+    void Post(int index, int length);
+    void Deliver(int index, int length, IsochPacket::Status status);
+    phys_addr GetBufferPhysAddr(int index) {
+      return _mem->GetPhysPtr() + _offset + index * _stride;
+    }
+    uint8_t *GetBufferVirtAddr(int index) {
+      return _mem->GetVirtPtr<uint8_t>() + _offset + index * _stride;
+    }
+
     Memory *_mem = nullptr;
-    BufferingNormalTrbHandler *_handlers[kEntryNum - 1];
-    RingBuffer<uint8_t *> *_buf;
-    int _max_packet_size;
-    pthread_mutex_t *_mutex;
+    // buffers are aligned to the stride (a power of two), so that none of them spans a 64KB boundary
+    int _offset;
+    int _stride;
+    IsochTrbHandler *_handlers[kTdNum] = {};
+    // requested length of the TD of each buffer
+    int _length[kTdNum];
+    // indices of buffers posted to the ring, in the order of TDs
+    int _posted[kTdNum];
+    int _posted_head;
+    int _posted_num;
+    SpscRingBuffer<IsochPacket> *_buf;
+    bool _in;
+    int _esit_payload;
+    int _max_burst;
+    bool _superspeed;
+    IsochPacket::Status _empty_status;
   };
 
   class CommandRing : public TrbRing {
@@ -796,76 +1612,271 @@ private:
       };
 
       // Table 139: TRB Type Definitions
-      static const uint32_t kValueTrbType = 13;
+      static const uint32_t kValueTrbType = 13;
+
+      const phys_addr _input_context;
+      const uint8_t _slot_id;
+    };
+    class ResetDeviceCommandTrb : public Trb {
+    public:
+      ResetDeviceCommandTrb() = delete;
+      ResetDeviceCommandTrb(uint8_t slot_id) : _slot_id(slot_id) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        addr[0] = 0;
+        addr[1] = 0;
+        addr[2] = 0;
+        addr[3]
+          = GenerateValue<SlotId, uint32_t>(_slot_id);
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+    private:
+      
+      // Table 123: Offset 0Ch – Address Device Command TRB Field Definitions
+      struct SlotId {
+        static const int kOffset = 24;
+        static const int kLen = 8;
+      };
+
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 17;
+
+      const uint8_t _slot_id;
+    };
+    // 6.4.3.7 Reset Endpoint Command TRB
+    class ResetEndpointCommandTrb : public Trb {
+    public:
+      ResetEndpointCommandTrb() = delete;
+      ResetEndpointCommandTrb(uint8_t slot_id, int dci) : _slot_id(slot_id), _dci(dci) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        addr[0] = 0;
+        addr[1] = 0;
+        addr[2] = 0;
+        addr[3]
+          = GenerateValue<EndpointId, uint32_t>(_dci)
+          | GenerateValue<SlotId, uint32_t>(_slot_id);
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+    private:
+      struct EndpointId {
+        static const int kOffset = 16;
+        static const int kLen = 20 - 16 + 1;
+      };
+      struct SlotId {
+        static const int kOffset = 24;
+        static const int kLen = 8;
+      };
+
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 14;
+
+      const uint8_t _slot_id;
+      const int _dci;
+    };
+    // 6.4.3.8 Stop Endpoint Command TRB
+    class StopEndpointCommandTrb : public Trb {
+    public:
+      StopEndpointCommandTrb() = delete;
+      StopEndpointCommandTrb(uint8_t slot_id, int dci) : _slot_id(slot_id), _dci(dci) {
+      }
+      virtual void Set(uint32_t *addr, bool cycle_flag) override {
+        addr[0] = 0;
+        addr[1] = 0;
+        addr[2] = 0;
+        addr[3]
+          = GenerateValue<EndpointId, uint32_t>(_dci)
+          | GenerateValue<SlotId, uint32_t>(_slot_id);
+        SetSub(addr, kValueTrbType, cycle_flag);
+      }
+    private:
+      struct EndpointId {
+        static const int kOffset = 16;
+        static const int kLen = 20 - 16 + 1;
+      };
+      struct SlotId {
+        static const int kOffset = 24;
+        static const int kLen = 8;
+      };
+
+      // Table 139: TRB Type Definitions
+      static const uint32_t kValueTrbType = 15;
 
-      const phys_addr _input_context;
       const uint8_t _slot_id;
+      const int _dci;
     };
-    class ResetDeviceCommandTrb : public Trb {
+    // 6.4.3.9 Set TR Dequeue Pointer Command TRB
+    class SetTrDequeuePointerCommandTrb : public Trb {
     public:
-      ResetDeviceCommandTrb() = delete;
-      ResetDeviceCommandTrb(uint8_t slot_id) : _slot_id(slot_id) {
+      SetTrDequeuePointerCommandTrb() = delete;
+      // stream_id: 0 unless the endpoint has streams
+      SetTrDequeuePointerCommandTrb(phys_addr dequeue_ptr, bool dcs, uint8_t slot_id, int dci, int stream_id) : _dequeue_ptr(dequeue_ptr), _dcs(dcs), _slot_id(slot_id), _dci(dci), _stream_id(stream_id) {
       }
       virtual void Set(uint32_t *addr, bool cycle_flag) override {
-        addr[0] = 0;
-        addr[1] = 0;
-        addr[2] = 0;
+        assert((_dequeue_ptr & 0xF) == 0);
+        addr[0]
+          = (_dequeue_ptr & 0xFFFFFFFF)
+          | (_dcs ? kFlagDequeueCycleState : 0)
+          | GenerateValue<StreamContextType, uint32_t>(_stream_id != 0 ? kValueStreamContextTypePrimaryTransferRing : 0);
+        addr[1] = _dequeue_ptr >> 32;
+        addr[2] = GenerateValue<StreamId, uint32_t>(_stream_id);
         addr[3]
-          = GenerateValue<SlotId, uint32_t>(_slot_id);
+          = GenerateValue<EndpointId, uint32_t>(_dci)
+          | GenerateValue<SlotId, uint32_t>(_slot_id);
         SetSub(addr, kValueTrbType, cycle_flag);
       }
     private:
-      
-      // Table 123: Offset 0Ch – Address Device Command TRB Field Definitions
+      static const uint32_t kFlagDequeueCycleState = 1 << 0;
+      struct StreamContextType {
+        static const int kOffset = 1;
+        static const int kLen = 3 - 1 + 1;
+      };
+      // Table 66: Stream Context Type (SCT) Field Values
+      static const int kValueStreamContextTypePrimaryTransferRing = 1;
+      struct StreamId {
+        static const int kOffset = 16;
+        static const int kLen = 31 - 16 + 1;
+      };
+      struct EndpointId {
+        static const int kOffset = 16;
+        static const int kLen = 20 - 16 + 1;
+      };
       struct SlotId {
         static const int kOffset = 24;
         static const int kLen = 8;
       };
 
       // Table 139: TRB Type Definitions
-      static const uint32_t kValueTrbType = 17;
+      static const uint32_t kValueTrbType = 16;
 
+      const phys_addr _dequeue_ptr;
+      const bool _dcs;
       const uint8_t _slot_id;
+      const int _dci;
+      const int _stream_id;
     };
-    CompletionInfo Issue(Trb &trb, pthread_mutex_t *mutex) {
+    CompletionInfo Issue(Trb &trb) {
       BlockingTrbHandler handler;
-      AllocTrb(handler, mutex);
+      pthread_mutex_lock(&_lock);
+      AllocTrb(handler);
 
-      memset(_ring_address + handler.index * (kEntrySize / sizeof(uint32_t)), 0, kEntrySize);
-      trb.Set(_ring_address + handler.index * (kEntrySize / sizeof(uint32_t)), handler.cycle_flag);
+      memset(GetTrbAddr(handler.index), 0, kEntrySize);
+      trb.Set(GetTrbAddr(handler.index), handler.cycle_flag);
       _hc->RingCommandDoorbell();
-      handler.Wait(mutex);
-      return _completion_info[handler.handle_index];
+      handler.Wait(&_lock);
+      CompletionInfo info = _completion_info[handler.handle_index];
+      pthread_mutex_unlock(&_lock);
+      return info;
+    }
+    // notified when an asynchronous command completes.
+    // Complete() is called from the event handler (without the lock of the ring), so it should not block.
+    class AsyncCommandHandler : public TrbHandler {
+    public:
+      virtual void Handle() override {
+        _info = _ring->_completion_info[handle_index];
+      }
+      virtual bool HasUnlockedCompletion() override {
+        return true;
+      }
+      virtual void CompleteUnlocked() override {
+        Complete(_info);
+      }
+      virtual void Complete(CompletionInfo &info) = 0;
+    private:
+      friend class CommandRing;
+      CommandRing *_ring;
+      CompletionInfo _info;
+    };
+    // same as Issue(), but returns without waiting.
+    // the handler should be kept until completion, and can be reused for the next command.
+    void Submit(Trb &trb, AsyncCommandHandler &handler) {
+      pthread_mutex_lock(&_lock);
+      handler._ring = this;
+      AllocTrb(handler);
+
+      memset(GetTrbAddr(handler.index), 0, kEntrySize);
+      trb.Set(GetTrbAddr(handler.index), handler.cycle_flag);
+      pthread_mutex_unlock(&_lock);
+      _hc->RequestDoorbell(0, 0);
     }
-    void CompleteCommand(int index, CompletionInfo &completion_info) {
+    // called from the event handler
+    void CompleteCommand(phys_addr pointer, CompletionInfo &completion_info) {
+      pthread_mutex_lock(&_lock);
+      int index = GetIndexFromEntryAddr(pointer);
       _completion_info[index] = completion_info;
-      ReleaseTrb(index);
+      TrbHandler *handler = ReleaseTrb(index);
+      pthread_mutex_unlock(&_lock);
+      if (handler != nullptr) {
+        handler->CompleteUnlocked();
+      }
     }
   private:    
     CompletionInfo _completion_info[kEntryNum];
   };
 
-  struct ContainerForPortStatusChangeHandler {
-    DevXhci *that;
-    int root_port_id;
+  // recovers a transfer ring whose endpoint is halted (4.8.3).
+  // Reset Endpoint moves the endpoint to the Stopped state, and Set TR Dequeue Pointer moves it to the next TD.
+  // the commands are issued asynchronously, since the event handler waits for nothing.
+  // allocated per halt, and deletes itself when the recovery finishes.
+  class EndpointRecovery : public CommandRing::AsyncCommandHandler {
+  public:
+    EndpointRecovery(TransferRing *ring, int td_end) : _ring(ring), _td_end(td_end) {
+    }
+    void Start();
+    virtual void Complete(CommandRing::CompletionInfo &info) override;
+  private:
+    enum class State {
+      kResetEndpoint,
+      kSetTrDequeuePointer,
+    };
+    void Finish();
+    TransferRing *_ring;
+    // the last TRB of the failed TD
+    const int _td_end;
+    State _state = State::kResetEndpoint;
   };
 
   class EventRing : public TrbRingBase {
   public:
-    void Init(DevXhci *hc) {
+    // the controller moves to the next segment in the order of the ERST,
+    // and toggles its cycle state at the end of the last segment.
+    void Init(DevXhci *hc, int num_segments = kDefaultSegmentNum) {
+      assert(0 < num_segments && num_segments <= kMaxSegments);
       InitSub(hc);
-      _mem = new Memory(kEntrySize * kEntryNum);
-      memset(_mem->GetVirtPtr<uint8_t>(), 0, kEntrySize * kEntryNum);
+      for (int i = 0; i < num_segments; i++) {
+        _mem[i] = new Memory(kEntrySize * kEntryNum);
+        memset(_mem[i]->GetVirtPtr<uint8_t>(), 0, kEntrySize * kEntryNum);
+      }
+      _num_segments = num_segments;
+      _dequeue_segment = 0;
+      _dequeue_index = 0;
       _consumer_cycle_bit = true;
     }
-    Memory &GetMemory() {
-      return *_mem;
+    Memory &GetMemory(int segment) {
+      assert(segment < _num_segments);
+      return *_mem[segment];
     }
+    int GetSegmentNum() {
+      return _num_segments;
+    }
+    // number of entries in a segment
     int GetEntryNum() {
       return kEntryNum;
     }
-    // return value: dequeue_ptr is incremented or not
-    bool Handle(phys_addr &dequeue_ptr);
+    int GetDequeueSegment() {
+      return _dequeue_segment;
+    }
+    // handle at most budget events.
+    // return value: number of handled events (dequeue_ptr is updated if not 0)
+    int Handle(phys_addr &dequeue_ptr, int budget);
+    bool HasPendingEvent() {
+      EventTrb trb(GetDequeueAddr());
+      return trb.GetCycleBit() == _consumer_cycle_bit;
+    }
+    // the controller may support less (HCSPARAMS2 ERST Max)
+    static const int kDefaultSegmentNum = 4;
+    // ERDP tells the segment of the dequeue pointer in 3 bits (DESI, Table 52)
+    static const int kMaxSegments = 8;
   private:
     class EventTrb : public Trb {
     public:
@@ -976,8 +1987,8 @@ private:
       PortStatusChangeEventTrb() = delete;
       PortStatusChangeEventTrb(uint32_t *addr) : EventTrb(addr) {
       }
-      void SetContainer(ContainerForPortStatusChangeHandler &container) {
-        container.root_port_id = MaskValue<PortId>(_addr[0]);
+      int GetPortId() {
+        return MaskValue<PortId>(_addr[0]);
       }
       
       // Table 139: TRB Type Definitions
@@ -990,7 +2001,14 @@ private:
       };
     };
     
-    Memory *_mem;
+    uint32_t *GetDequeueAddr() {
+      return _mem[_dequeue_segment]->GetVirtPtr<uint32_t>() + _dequeue_index * (kEntrySize / sizeof(uint32_t));
+    }
+
+    Memory *_mem[kMaxSegments];
+    int _num_segments;
+    int _dequeue_segment;
+    int _dequeue_index;
     static const int kEntrySize = 16;
     static const int kEntryNum = 256;
     bool _consumer_cycle_bit;
@@ -999,46 +2017,135 @@ private:
   class EventRingSegmentTable {
   public:
     void Init(EventRing *event_ring) {
-      _mem = new Memory(16); // only 1 entry
+      _size = event_ring->GetSegmentNum();
+      _mem = new Memory(kEntrySize * _size);
       uint32_t *ptr = _mem->GetVirtPtr<uint32_t>();
-      phys_addr event_ring_addr = event_ring->GetMemory().GetPhysPtr();
-      ptr[0] = event_ring_addr;
-      ptr[1] = event_ring_addr >> 32;
-      ptr[2] = event_ring->GetEntryNum();
+      memset(ptr, 0, kEntrySize * _size);
+      for (int i = 0; i < _size; i++) {
+        // Table 54: Event Ring Segment Table Entry
+        phys_addr event_ring_addr = event_ring->GetMemory(i).GetPhysPtr();
+        ptr[i * 4 + 0] = event_ring_addr;
+        ptr[i * 4 + 1] = event_ring_addr >> 32;
+        ptr[i * 4 + 2] = event_ring->GetEntryNum();
+      }
       _event_ring = event_ring;
     }
     int GetSize() {
-      return 1;
+      return _size;
+    }
+    phys_addr GetFirstSegmentAddr() {
+      return _event_ring->GetMemory(0).GetPhysPtr();
+    }
+    int GetDequeueSegment() {
+      return _event_ring->GetDequeueSegment();
     }
     Memory &GetMemory() {
       return *_mem;
     }
     // return value: dequeue_ptr is incremented or not
-    bool Handle(phys_addr &dequeue_ptr) {
-      return _event_ring->Handle(dequeue_ptr);
+    int Handle(phys_addr &dequeue_ptr, int budget) {
+      return _event_ring->Handle(dequeue_ptr, budget);
+    }
+    bool HasPendingEvent() {
+      return _event_ring->HasPendingEvent();
     }
   private:
+    static const int kEntrySize = 16;
     Memory *_mem;
+    int _size;
     EventRing *_event_ring = nullptr;
   };
 
   class Interrupter {
   public:
+    Interrupter() {
+      pthread_mutex_init(&_moderation_lock, NULL);
+    }
     void Init(volatile uint32_t *base_addr, EventRingSegmentTable *erst, EventRing *event_ring);
-    void Handle() {
+    // handle at most budget events.
+    // return value: events remain in the ring. Continue() should be called for them (after yielding).
+    bool Handle(int budget) {
       if (IsFlagClear(_base_addr[kRegOffsetIman], kImanRegFlagPending)) {
-        return;
+        return false;
       }
 
       _base_addr[0] |= kImanRegFlagPending;
+      _interrupts.fetch_add(1, std::memory_order_relaxed);
 
-      if (_erst->Handle(_dequeue_ptr)) {
-        WriteDequeuePtr();
+      return Continue(budget);
+    }
+    bool Continue(int budget) {
+      int handled = _erst->Handle(_dequeue_ptr, budget);
+      _events.fetch_add(handled, std::memory_order_relaxed);
+      _window_events += handled;
+      if (handled == budget && HasPendingEvent()) {
+        // let the controller reuse the handled entries,
+        // but leave EHB set, since the handler is still busy (see 4.17.2)
+        WriteDequeuePtr(false);
+        _draining = true;
+        return true;
+      }
+      if (handled > 0 || _draining) {
+        WriteDequeuePtr(true);
+        _draining = false;
       } else {
         assert(IsFlagClear(_base_addr[kRegOffsetErdp], kErdpRegFlagEventHandlerBusy));
       }
+      return false;
+    }
+    // handle at most budget events without checking the interrupt pending flag.
+    // return value: number of handled events
+    int Poll(int budget) {
+      int handled = _erst->Handle(_dequeue_ptr, budget);
+      _events.fetch_add(handled, std::memory_order_relaxed);
+      _window_events += handled;
+      if (handled > 0) {
+        WriteDequeuePtr(true);
+      }
+      return handled;
+    }
+    // check the cycle bit of the event ring. no MMIO access.
+    bool HasPendingEvent() {
+      return _erst->HasPendingEvent();
+    }
+    void ClearPending() {
+      if (IsFlagSet(_base_addr[kRegOffsetIman], kImanRegFlagPending)) {
+        _base_addr[kRegOffsetIman] |= kImanRegFlagPending;
+      }
+    }
+    bool IsPending() {
+      return IsFlagSet(_base_addr[kRegOffsetIman], kImanRegFlagPending);
+    }
+    // in 250ns. written to IMOD when the interrupter is initialized.
+    void SetModerationInterval(int interval) {
+      pthread_mutex_lock(&_moderation_lock);
+      UpdateModerationInterval(interval);
+      pthread_mutex_unlock(&_moderation_lock);
+    }
+    void SetAdaptiveModeration(bool adaptive) {
+      pthread_mutex_lock(&_moderation_lock);
+      _adaptive = adaptive;
+      pthread_mutex_unlock(&_moderation_lock);
+    }
+    void SetModerationRange(int min_interval, int max_interval) {
+      _min_moderation_interval = min_interval;
+      _max_moderation_interval = max_interval;
+    }
+    // called from the handler thread after handling an interrupt, and from the polling loop.
+    // adjusts the moderation interval once per window according to the event rate.
+    void AdaptModeration();
+    void GetStats(InterrupterStats &stats) {
+      stats.interrupts = _interrupts.load(std::memory_order_relaxed);
+      stats.events = _events.load(std::memory_order_relaxed);
+      stats.moderation_interval = _moderation_interval;
     }
   private:
+    // the event rate (events per second) is measured in windows of kModerationWindowUs
+    static const int kModerationWindowUs = 100 * 1000;
+    // below kLowEventRate, the min interval is used. above kHighEventRate, the max one is used.
+    static const int kLowEventRate = 2000;
+    static const int kHighEventRate = 20000;
+
     static const int kRegOffsetIman = 0x0 / sizeof(uint32_t);
     static const int kRegOffsetImod = 0x4 / sizeof(uint32_t);
     static const int kRegOffsetErstsz = 0x8 / sizeof(uint32_t);
@@ -1072,31 +2179,78 @@ private:
     };
 
     // Table 52: Event Ring Dequeue Pointer Register Bit Definitions (ERDP)
+    struct ErdpRegDequeueErstSegmentIndex {
+      static const int kOffset = 0;
+      static const int kLen = 3;
+    };
     static const uint32_t kErdpRegFlagEventHandlerBusy = 1 << 3;
     struct ErdpRegEventRingDequeuePointer {
       static const int kOffset = 4;
       static const int kLen = 31 - 4 + 1;
     };
     
-    void WriteDequeuePtr() {
+    // clear_busy: clear EHB (RW1C) as well
+    void WriteDequeuePtr(bool clear_busy = true) {
       _base_addr[kRegOffsetErdp + 0]
         = (_dequeue_ptr & GenerateMask<ErdpRegEventRingDequeuePointer, uint32_t>())
-        | kErdpRegFlagEventHandlerBusy;
+        | GenerateValue<ErdpRegDequeueErstSegmentIndex, uint32_t>(_erst->GetDequeueSegment() & 0b111)
+        | (clear_busy ? kErdpRegFlagEventHandlerBusy : 0);
       _base_addr[kRegOffsetErdp + 1] = _dequeue_ptr >> 32;
     }
+    // called with _moderation_lock held
+    void UpdateModerationInterval(int interval) {
+      _moderation_interval = interval;
+      if (_base_addr != nullptr) {
+        WriteModerationInterval();
+      }
+    }
+    void WriteModerationInterval() {
+      _base_addr[kRegOffsetImod]
+        = GenerateValue<ImodRegModerationInterval, uint32_t>(_moderation_interval)
+        | GenerateValue<ImodRegModerationCounter, uint32_t>(0);
+    }
     EventRingSegmentTable *_erst;
+    // ERDP was written without clearing EHB
+    bool _draining = false;
     phys_addr _dequeue_ptr;
-    volatile uint32_t *_base_addr;
+    volatile uint32_t *_base_addr = nullptr;
+
+    // serializes the adaptive updates against SetModerationInterval() and SetAdaptiveModeration(),
+    // so an interval chosen by AdaptModeration() never overwrites a fixed one
+    pthread_mutex_t _moderation_lock;
+    std::atomic<int> _moderation_interval{kDefaultModerationInterval};
+    std::atomic<bool> _adaptive{false};
+    std::atomic<int> _min_moderation_interval{kDefaultMinModerationInterval};
+    std::atomic<int> _max_moderation_interval{kDefaultMaxModerationInterval};
+    std::atomic<uint64_t> _interrupts{0};
+    std::atomic<uint64_t> _events{0};
+    // touched only by the handler thread
+    uint64_t _window_events = 0;
+    struct timespec _window_start = {0, 0};
   };
 
   class Device {
   public:
     Device() = delete;
-    Device(DevXhci *hc, const int root_port_id) : _hc(hc), _root_port_id(root_port_id) {
+    Device(DevXhci *hc, const int root_port_id) : _hc(hc), _root_port_id(root_port_id), _command_handler(this), _transfer_completion(this) {
+      pthread_mutex_init(&_lock, NULL);
+      pthread_cond_init(&_enumeration_cond, NULL);
+      pthread_cond_init(&_recovery_cond, NULL);
     }
-    
-    DevUsb *Init();
+    virtual ~Device() {
+      delete[] _children;
+      delete _usb_device;
+    }
+
+    // enumeration (4.3) proceeds asynchronously. each step issues a command or a control transfer,
+    // and its completion hands the device to the enumeration thread, which issues the next step.
+    // so the steps of many devices are interleaved. class drivers are probed in their own threads.
+    // default_address_locked: the default address is held for the device until Address Device (BSR=0) completes
+    void StartEnumeration(bool default_address_locked = false);
+    // called from the enumeration thread when the pending step completes
+    void AdvanceEnumeration();
 
+    // waits for the enumeration (including probing) to finish
     void Release();
 
     DevXhci *GetHc() {
@@ -1107,30 +2261,60 @@ private:
       _input_context.CompleteTransfer(pointer, completion_info);
     }
    
-    bool SendControlTransfer(UsbCtrl::DeviceRequest &request, Memory &mem, size_t data_size);
-    ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, RingBuffer<uint8_t *> *buf) {
-      RETURN_IF_ERR(_input_context.SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, buf));
-      do {
+    bool SendControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size);
+    ReturnState BulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, size_t &transferred);
+    ReturnState SubmitBulkTransfer(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion);
+    ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<uint8_t *> *buf, SpscRingBuffer<InTransferLease> *lease_buf) {
+      // the input context is shared by all commands of the slot
+      pthread_mutex_lock(&_lock);
+      ReturnState state = _input_context.SetupEndpoint(endpt_address, interval, type, direction, max_packetsize, buf, lease_buf);
+      if (state == ReturnState::kSuccess) {
         CommandRing::ConfigureEndpointCommandTrb com(_input_context.GetPhysAddr(), _slot_id, false);
-        CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com, &_hc->_mp);
+        CommandRing::CompletionInfo info = _hc->_command_ring.Issue(com);
         if (info.completion_code != TrbCompletionCode::kSuccess) {
-          return ReturnState::kErrUnknown;
+          state = ReturnState::kErrUnknown;
         }
-      } while(0);
+      }
+      pthread_mutex_unlock(&_lock);
+      RETURN_IF_ERR(state);
       _input_context.RingEndpointDoorbell(endpt_address, direction);
       return ReturnState::kSuccess;
     }
-    void InitHub(int number_of_ports, int ttt);
-    void RegisterDevUsb(DevUsb *device) {
-      _dev_usb = device;
+    ReturnState SetupIsochEndpoint(uint8_t endpt_address, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf);
+    ReturnState SetupStreamEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int num_streams);
+    ReturnState ResetEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction);
+    void InitHub(int number_of_ports, int ttt, bool mtt);
+    // the TT which schedules a low-/full-speed device attached to the port of this hub
+    void GetTtForChild(int hub_port_id, int &tt_hub_slot_id, int &tt_port_number, bool &mtt);
+    // devices attached to the downstream ports of the hub
+    void AttachChild(int hub_port_id, Device *child) {
+      pthread_mutex_lock(&_lock);
+      assert(hub_port_id >= 1 && hub_port_id <= _num_hub_ports);
+      assert(_children[hub_port_id] == nullptr);
+      _children[hub_port_id] = child;
+      pthread_mutex_unlock(&_lock);
+    }
+    // return: the detached device (nullptr if none is attached)
+    Device *DetachChild(int hub_port_id) {
+      pthread_mutex_lock(&_lock);
+      assert(hub_port_id >= 1 && hub_port_id <= _num_hub_ports);
+      Device *child = _children[hub_port_id];
+      _children[hub_port_id] = nullptr;
+      pthread_mutex_unlock(&_lock);
+      return child;
     }
     void UnRegisterDevUsb() {
-      if (_dev_usb != nullptr) {
-        _dev_usb->Release();
+      for (int i = 0; i < _num_dev_usb; i++) {
+        _dev_usb[i]->Release();
       }
+      _num_dev_usb = 0;
+    }
+    int GetDevUsbNum() {
+      return _num_dev_usb;
     }
-    DevUsb *GetPointerOfDevUsb() {
-      return _dev_usb;
+    DevUsb *GetPointerOfDevUsb(int index) {
+      assert(index >= 0 && index < _num_dev_usb);
+      return _dev_usb[index];
     }
     int GetRootPortId() {
       return _root_port_id;
@@ -1138,13 +2322,103 @@ private:
     uint32_t GetRouteString() {
       return _route_string;
     }
+    // each tier of the route string is 4 bits wide (8.9 of USB 3.2 spec)
+    int GetHubDepth() {
+      int depth = 0;
+      while(depth < kRouteStringTiers && ((_route_string >> (depth * 4)) & 0xF) != 0) {
+        depth++;
+      }
+      return depth;
+    }
+    // 0 unless the device is a low-/full-speed device behind a high-speed hub
+    int GetTtHubSlotId() {
+      return _tt_hub_slot_id;
+    }
+    int GetTtPortNumber() {
+      return _tt_port_number;
+    }
+    bool IsMultiTt() {
+      return _mtt;
+    }
     int GetSlotId() {
       return _slot_id;
     }
-    void RingEndpointDoorbell(uint8_t target) {
-      _hc->RingEndpointDoorbell(_slot_id, target);
+    // a halted endpoint is being recovered (see EndpointRecovery). Release() waits for them.
+    // return: false if the device is being released
+    bool BeginRecovery() {
+      pthread_mutex_lock(&_lock);
+      bool releasing = _releasing;
+      if (!releasing) {
+        _recoveries++;
+      }
+      pthread_mutex_unlock(&_lock);
+      return !releasing;
+    }
+    void EndRecovery() {
+      pthread_mutex_lock(&_lock);
+      _recoveries--;
+      pthread_cond_broadcast(&_recovery_cond);
+      pthread_mutex_unlock(&_lock);
+    }
+    int GetInterrupterTarget() {
+      return _interrupter_target;
+    }
+    void SteerEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int interrupter) {
+      _input_context.SteerEndpoint(endpt_address, direction, interrupter);
+    }
+    void RingEndpointDoorbell(uint8_t target, int stream_id = 0) {
+      _hc->RingEndpointDoorbell(_slot_id, target, stream_id);
+    }
+    // deferred until the end of the submission batch (if any)
+    void RequestEndpointDoorbell(uint8_t target, int stream_id = 0) {
+      _hc->RequestDoorbell(_slot_id, target, stream_id);
     }
   protected:
+    // the step whose completion the device is waiting for
+    enum class EnumerationState {
+      kEnableSlot,
+      kAddressDeviceBsr,
+      kAddressDevice,
+      kGetMaxPacketSize,
+      kEvaluateContext,
+      kProbe,
+      kDone,
+      kFailed,
+    };
+    class EnumerationCommandHandler : public CommandRing::AsyncCommandHandler {
+    public:
+      EnumerationCommandHandler(Device *device) : _device(device) {
+      }
+      virtual void Complete(CommandRing::CompletionInfo &info) override {
+        _device->_command_info = info;
+        _device->_hc->QueueEnumeration(_device);
+      }
+    private:
+      Device *_device;
+    };
+    class EnumerationTransferCompletion : public TransferCompletion {
+    public:
+      EnumerationTransferCompletion(Device *device) : _device(device) {
+      }
+      virtual void Complete(bool success, size_t transferred) override {
+        _device->_transfer_success = success;
+        _device->_hc->QueueEnumeration(_device);
+      }
+    private:
+      Device *_device;
+    };
+    // returns without waiting. _transfer_completion is notified.
+    void SubmitControlTransfer(UsbCtrl::DeviceRequest &request, DmaBuffer &buf, size_t data_size);
+    // code: completion code of the failed command
+    void FailEnumeration(const char *step, TrbCompletionCode code);
+    // for steps other than commands
+    void FailEnumeration(const char *step);
+    // undoes RegisterDevice() and Enable Slot, so the slot is not leaked
+    void DisableSlot();
+    void FinishEnumeration(EnumerationState state);
+    void UnlockDefaultAddress();
+    static void *Probe(void *arg);
+
 
     class DeviceContext {
     public:
@@ -1152,31 +2426,15 @@ private:
       public:
         void InitInput(Device *device, uint32_t *addr) {
           _addr = addr;
-          int speed_value = 0;
-          // Table 157: Default USB Speed ID Mapping
-          switch(device->GetPortSpeed()) {
-          case UsbCtrl::PortSpeed::kFullSpeed:
-            speed_value = 1;
-            break;
-          case UsbCtrl::PortSpeed::kLowSpeed:
-            speed_value = 2;
-            break;
-          case UsbCtrl::PortSpeed::kHighSpeed:
-            speed_value = 3;
-            break;
-          case UsbCtrl::PortSpeed::kSuperSpeed:
-            speed_value = 4;
-            break;
-          case UsbCtrl::PortSpeed::kSuperSpeedPlus:
-            speed_value = 5;
-            break;
-          }
           _addr[0] = GenerateValue<RouteString, uint32_t>(device->GetRouteString())
-            | GenerateValue<Speed, uint32_t>(speed_value)
+            | GenerateValue<Speed, uint32_t>(device->GetSpeedId())
+            | (device->IsMultiTt() ? kFlagMtt : 0)
             | GenerateValue<ContextEntries, uint32_t>(1);
           _addr[1] = GenerateValue<MaxExitLatency, uint32_t>(0)
             | GenerateValue<RootHubPortNumber, uint32_t>(device->GetRootPortId());
-          _addr[2] = GenerateValue<InterrupterTarget, uint32_t>(0);
+          _addr[2] = GenerateValue<TtHubSlotId, uint32_t>(device->GetTtHubSlotId())
+            | GenerateValue<TtPortNumber, uint32_t>(device->GetTtPortNumber())
+            | GenerateValue<InterrupterTarget, uint32_t>(device->GetInterrupterTarget());
           _addr[3] = GenerateValue<DeviceAddress, uint32_t>(0);
           _addr[4] = 0;
           _addr[5] = 0;
@@ -1186,11 +2444,14 @@ private:
         void InitOutput(uint32_t *addr) {
           _addr = addr;
         }
-        void InitHub(int number_of_ports, int ttt, UsbCtrl::PortSpeed speed) {
+        void InitHub(int number_of_ports, int ttt, bool mtt, UsbCtrl::PortSpeed speed) {
           _addr[0] |= kFlagHub;
           _addr[1] |= GenerateValue<NumberOfPorts, uint32_t>(number_of_ports);
           if (speed == UsbCtrl::PortSpeed::kHighSpeed) {
             _addr[2] |= GenerateValue<TtThinkTime, uint32_t>(ttt);
+            if (mtt) {
+              _addr[0] |= kFlagMtt;
+            }
           }
         }
         void SetupEndpoint(int dci) {
@@ -1210,6 +2471,7 @@ private:
           static const int kOffset = 20;
           static const int kLen = 23 - 20 + 1;
         };
+        static const uint32_t kFlagMtt = 1 << 25;
         static const uint32_t kFlagHub = 1 << 26;
         struct ContextEntries {
           static const int kOffset = 27;
@@ -1262,8 +2524,34 @@ private:
         void UpdateMaxPacketSize(uint8_t max_packet_size) {
           _addr[1] = (_addr[1] & ~GenerateMask<MaxPacketSize, uint32_t>()) | GenerateValue<MaxPacketSize, uint32_t>(max_packet_size);
         }
+        // interval: bInterval of the endpoint descriptor
+        void InitIsoch(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::PacketIdentification direction, int max_packet_size, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf);
+        // bulk endpoint with streams 1..num_streams. each stream has its own transfer ring.
+        void InitStreams(Device *device, uint32_t *addr, int dci, UsbCtrl::PacketIdentification direction, int max_packet_size, int max_burst, int num_streams);
+        bool HasStreams() {
+          return _num_streams != 0;
+        }
+        TransferRing &GetStreamRing(int stream_id) {
+          assert(stream_id >= 1 && stream_id <= _num_streams);
+          return _stream_rings[stream_id];
+        }
+        bool IsIsoch() {
+          return _isoch;
+        }
+        // Table 63: the ring is read from here when the endpoint is (re)added by Configure Endpoint
+        void SetDequeuePointer(phys_addr tr_ptr, bool dcs) {
+          _addr[2] = (dcs ? kFlagDequequeCycleState : 0)
+            | (tr_ptr & GenerateMask<TrDequeuePointer, uint32_t>());
+          _addr[3] = tr_ptr >> 32;
+        }
+        // called from the event handler
+        void CompleteStreamTransfer(phys_addr pointer, TransferRing::CompletionInfo &info);
       protected:
         // Table 61: Offset 00h – Endpoint Context Field Definitions
+        struct MaxEsitPayloadHi {
+          static const int kOffset = 24;
+          static const int kLen = 31 - 24 + 1;
+        };
         struct Mult {
           static const int kOffset = 8;
           static const int kLen = 9 - 8 + 1;
@@ -1272,6 +2560,7 @@ private:
           static const int kOffset = 10;
           static const int kLen = 14 - 10 + 1;
         };
+        static const uint32_t kFlagLinearStreamArray = 1 << 15;
         struct Interval {
           static const int kOffset = 16;
           static const int kLen = 23 - 16 + 1;
@@ -1302,14 +2591,43 @@ private:
           static const int kLen = 31 - 4 + 1;
         };
 
+        // Table 64: Offset 10h – Endpoint Context Field Definitions
+        struct AverageTrbLength {
+          static const int kOffset = 0;
+          static const int kLen = 16;
+        };
+        struct MaxEsitPayloadLo {
+          static const int kOffset = 16;
+          static const int kLen = 31 - 16 + 1;
+        };
+
+        // Table 65: Stream Context Field Definitions
+        static const int kStreamContextSize = 16;
+        static const uint32_t kStreamContextFlagDequeueCycleState = 1 << 0;
+        struct StreamContextType {
+          static const int kOffset = 1;
+          static const int kLen = 3 - 1 + 1;
+        };
+        // Table 66: Stream Context Type (SCT) Field Values
+        static const int kValueStreamContextTypePrimaryTransferRing = 1;
+
         Device *_device;
         uint32_t *_addr;
         int _dci;
+        // the endpoint is driven by _isoch_ring instead of the ring of the subclass
+        bool _isoch = false;
+        IsochTransferRing _isoch_ring;
+        // Primary Stream Context Array and rings of streams (indexed by stream ID. 0 is reserved)
+        Memory *_stream_context_array = nullptr;
+        TransferRing *_stream_rings = nullptr;
+        int _num_streams = 0;
 
         void Init(Device *device, uint32_t *addr, int dci) {
           _device = device;
           _addr = addr;
           _dci = dci;
+          _isoch = false;
+          _num_streams = 0;
         }
       };
 
@@ -1317,7 +2635,10 @@ private:
       public:
         // return value: error or not
         void Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size);
-        OutTransferRing &GetRing() {
+        TransferRing &GetRing() {
+          if (_isoch) {
+            return _isoch_ring;
+          }
           return _ring;
         }
       private:
@@ -1326,12 +2647,14 @@ private:
       class InEndpointContext : public EndpointContext {
       public:
         // return value: error or not
-        void Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size, RingBuffer<uint8_t *> *buf);
-        InTransferRing &GetRing() {
+        void Init(Device *device, uint32_t *addr, int dci, int interval, UsbCtrl::TransferType type, int max_packet_size, SpscRingBuffer<uint8_t *> *buf, SpscRingBuffer<InTransferLease> *lease_buf);
+        TransferRing &GetRing() {
+          if (_isoch) {
+            return _isoch_ring;
+          }
           return _ring;
         }
       private:
-        RingBuffer<uint8_t *> *_buf;
         InTransferRing _ring;
       } _in_endpoint_context[16];
     };
@@ -1360,8 +2683,8 @@ private:
     public:
       // return value: error or not
       int Init(Device *device);
-      void InitHub(int number_of_ports, int ttt) {
-        _dev_context._slot_context.InitHub(number_of_ports, ttt, _device->GetPortSpeed());
+      void InitHub(int number_of_ports, int ttt, bool mtt) {
+        _dev_context._slot_context.InitHub(number_of_ports, ttt, mtt, _device->GetPortSpeed());
       }
       void UpdateMaxPacketSizeOfEndpoint0(uint8_t max_packet_size) {
         _ed0_max_packet_size = max_packet_size; 
@@ -1370,34 +2693,70 @@ private:
       phys_addr GetPhysAddr() {
         return _mem->GetPhysPtr();
       }
-      TransferRing::CompletionInfo Issue(int dci, TransferRing::TransferTrb *trb[], const int array_len, pthread_mutex_t *mutex) {
+      TransferRing::CompletionInfo Issue(int dci, TransferRing::TransferTrb *trb[], const int array_len) {
+        assert(dci >= 1 && dci <= 31);
+        if ((dci % 2) == 1) {
+          // IN
+          return _dev_context._in_endpoint_context[dci / 2].GetRing().Issue(trb, array_len);
+        } else {
+          // OUT
+          return _dev_context._out_endpoint_context[dci / 2].GetRing().Issue(trb, array_len);
+        }
+      }
+      void Submit(int dci, TransferRing::TransferTrb *trb[], const int array_len, TransferCompletion *completion) {
         assert(dci >= 1 && dci <= 31);
         if ((dci % 2) == 1) {
           // IN
-          return _dev_context._in_endpoint_context[dci / 2].GetRing().Issue(trb, array_len, mutex);
+          _dev_context._in_endpoint_context[dci / 2].GetRing().Submit(trb, array_len, completion);
         } else {
           // OUT
-          return _dev_context._out_endpoint_context[dci / 2].GetRing().Issue(trb, array_len, mutex);
+          _dev_context._out_endpoint_context[dci / 2].GetRing().Submit(trb, array_len, completion);
         }
       }
+      TransferRing::CompletionInfo IssueBulk(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt) {
+        return GetRing(endpt_address, direction, stream_id).IssueBulk(iov, iovcnt);
+      }
+      void SubmitBulk(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id, UsbCtrl::IoVector *iov, int iovcnt, TransferCompletion *completion) {
+        GetRing(endpt_address, direction, stream_id).SubmitBulk(iov, iovcnt, completion);
+      }
       void CompleteTransfer(phys_addr pointer, TransferRing::CompletionInfo &completion_info) {
         int dci = completion_info.endpoint_id;
         assert(dci >= 1 && dci <= 31);
         if ((dci % 2) == 1) {
           // IN
-          int index = _dev_context._in_endpoint_context[dci / 2].GetRing().GetIndexFromEntryAddr(pointer);
-          _dev_context._in_endpoint_context[dci / 2].GetRing().CompleteTransfer(index, completion_info);
+          DeviceContext::InEndpointContext &context = _dev_context._in_endpoint_context[dci / 2];
+          if (context.HasStreams()) {
+            context.CompleteStreamTransfer(pointer, completion_info);
+          } else {
+            context.GetRing().CompleteTransfer(pointer, completion_info);
+          }
         } else {
           // OUT
-          int index = _dev_context._out_endpoint_context[dci / 2].GetRing().GetIndexFromEntryAddr(pointer);
-          _dev_context._out_endpoint_context[dci / 2].GetRing().CompleteTransfer(index, completion_info);
+          DeviceContext::OutEndpointContext &context = _dev_context._out_endpoint_context[dci / 2];
+          if (context.HasStreams()) {
+            context.CompleteStreamTransfer(pointer, completion_info);
+          } else {
+            context.GetRing().CompleteTransfer(pointer, completion_info);
+          }
         }
       }
       void RingEndpointDoorbell(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
         int dci = GetDciFromEndptAddress(endpt_address, direction);
         _device->RingEndpointDoorbell(dci);
       }
-      ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, RingBuffer<uint8_t *> *buf) {
+      void SteerEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int interrupter) {
+        switch(direction) {
+        case UsbCtrl::PacketIdentification::kOut:
+          _dev_context._out_endpoint_context[endpt_address].GetRing().SetInterrupterTarget(interrupter);
+          break;
+        case UsbCtrl::PacketIdentification::kIn:
+          _dev_context._in_endpoint_context[endpt_address].GetRing().SetInterrupterTarget(interrupter);
+          break;
+        default:
+          break;
+        }
+      }
+      ReturnState SetupEndpoint(uint8_t endpt_address, int interval, UsbCtrl::TransferType type, UsbCtrl::PacketIdentification direction, int max_packetsize, SpscRingBuffer<uint8_t *> *buf, SpscRingBuffer<InTransferLease> *lease_buf) {
         int dci = GetDciFromEndptAddress(endpt_address, direction);
         uint32_t *addr = _mem->GetVirtPtr<uint32_t>();
         switch(direction) {
@@ -1407,15 +2766,79 @@ private:
           break;
         case UsbCtrl::PacketIdentification::kIn:
           _dev_context._slot_context.SetupEndpoint(dci);
-          _dev_context._in_endpoint_context[endpt_address].Init(_device, addr + ((dci + 1) * _device->_hc->_context_size) / sizeof(uint32_t), dci, interval, type, max_packetsize, buf);
+          _dev_context._in_endpoint_context[endpt_address].Init(_device, addr + ((dci + 1) * _device->_hc->_context_size) / sizeof(uint32_t), dci, interval, type, max_packetsize, buf, lease_buf);
+          break;
+        default:
+          break;
+        }
+        _control_context.SelectEndpoint(dci);
+        return ReturnState::kSuccess;
+      }
+      ReturnState SetupIsochEndpoint(uint8_t endpt_address, int interval, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int mult, SpscRingBuffer<IsochPacket> *buf) {
+        int dci = GetDciFromEndptAddress(endpt_address, direction);
+        uint32_t *addr = _mem->GetVirtPtr<uint32_t>() + ((dci + 1) * _device->_hc->_context_size) / sizeof(uint32_t);
+        switch(direction) {
+        case UsbCtrl::PacketIdentification::kOut:
+          _dev_context._out_endpoint_context[endpt_address].InitIsoch(_device, addr, dci, interval, direction, max_packetsize, max_burst, mult, buf);
+          break;
+        case UsbCtrl::PacketIdentification::kIn:
+          _dev_context._in_endpoint_context[endpt_address].InitIsoch(_device, addr, dci, interval, direction, max_packetsize, max_burst, mult, buf);
           break;
         default:
+          return ReturnState::kErrUnknown;
+        }
+        _dev_context._slot_context.SetupEndpoint(dci);
+        _control_context.SelectEndpoint(dci);
+        return ReturnState::kSuccess;
+      }
+      ReturnState SetupStreamEndpoint(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int max_packetsize, int max_burst, int num_streams) {
+        int dci = GetDciFromEndptAddress(endpt_address, direction);
+        uint32_t *addr = _mem->GetVirtPtr<uint32_t>() + ((dci + 1) * _device->_hc->_context_size) / sizeof(uint32_t);
+        switch(direction) {
+        case UsbCtrl::PacketIdentification::kOut:
+          _dev_context._out_endpoint_context[endpt_address].InitStreams(_device, addr, dci, direction, max_packetsize, max_burst, num_streams);
+          break;
+        case UsbCtrl::PacketIdentification::kIn:
+          _dev_context._in_endpoint_context[endpt_address].InitStreams(_device, addr, dci, direction, max_packetsize, max_burst, num_streams);
           break;
+        default:
+          return ReturnState::kErrUnknown;
         }
-        _control_context.ClearAddContextFlag(1);
-        _control_context.SetAddContextFlag(dci);
+        _dev_context._slot_context.SetupEndpoint(dci);
+        _control_context.SelectEndpoint(dci);
         return ReturnState::kSuccess;
       }
+      // a bulk or interrupt endpoint without streams. return: nullptr if the endpoint is not such one.
+      TransferRing *GetResettableRing(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
+        if (endpt_address < 1 || endpt_address >= 16) {
+          return nullptr;
+        }
+        DeviceContext::EndpointContext *context;
+        TransferRing *ring;
+        if (direction == UsbCtrl::PacketIdentification::kIn) {
+          context = &_dev_context._in_endpoint_context[endpt_address];
+          ring = &_dev_context._in_endpoint_context[endpt_address].GetRing();
+        } else {
+          context = &_dev_context._out_endpoint_context[endpt_address];
+          ring = &_dev_context._out_endpoint_context[endpt_address].GetRing();
+        }
+        return (context->IsIsoch() || context->HasStreams()) ? nullptr : ring;
+      }
+      // the endpoint is dropped and added back by the next Configure Endpoint, which resets its state
+      // (including the data toggle or the sequence number) and restarts it from tr_ptr (4.6.6)
+      int SelectEndpointReset(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, phys_addr tr_ptr, bool dcs) {
+        int dci = GetDciFromEndptAddress(endpt_address, direction);
+        if (direction == UsbCtrl::PacketIdentification::kIn) {
+          _dev_context._in_endpoint_context[endpt_address].SetDequeuePointer(tr_ptr, dcs);
+        } else {
+          _dev_context._out_endpoint_context[endpt_address].SetDequeuePointer(tr_ptr, dcs);
+        }
+        _control_context.ResetEndpoint(dci);
+        return dci;
+      }
+      int GetDci(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
+        return GetDciFromEndptAddress(endpt_address, direction);
+      }
     private:
       class ControlContext {
       public:
@@ -1424,11 +2847,16 @@ private:
           // set A0 and A1
           _addr[1] = (1 << 0) | (1 << 1);
         }
-        void ClearAddContextFlag(int dci) {
-          _addr[1] &= ~(1 << dci);
+        // Configure Endpoint adds only the endpoint (and the slot context, whose Context Entries may grow).
+        // endpoints added before are running, and their contexts here hold the stale TR Dequeue Pointer.
+        void SelectEndpoint(int dci) {
+          _addr[0] = 0;
+          _addr[1] = (1 << 0) | (1 << dci);
         }
-        void SetAddContextFlag(int dci) {
-          _addr[1] |= (1 << dci);
+        // 6.2.5.1: the endpoint is dropped and added by the same command
+        void ResetEndpoint(int dci) {
+          _addr[0] = 1 << dci;
+          _addr[1] = (1 << 0) | (1 << dci);
         }
       private:
         uint32_t *_addr;
@@ -1439,6 +2867,19 @@ private:
       Memory *_mem;
       int _ed0_max_packet_size;
 
+      // stream_id should be 0 unless the endpoint has streams
+      TransferRing &GetRing(uint8_t endpt_address, UsbCtrl::PacketIdentification direction, int stream_id) {
+        assert(endpt_address >= 1 && endpt_address < 16);
+        if (direction == UsbCtrl::PacketIdentification::kIn) {
+          DeviceContext::InEndpointContext &context = _dev_context._in_endpoint_context[endpt_address];
+          assert(context.HasStreams() == (stream_id != 0));
+          return (stream_id == 0) ? context.GetRing() : context.GetStreamRing(stream_id);
+        } else {
+          DeviceContext::OutEndpointContext &context = _dev_context._out_endpoint_context[endpt_address];
+          assert(context.HasStreams() == (stream_id != 0));
+          return (stream_id == 0) ? context.GetRing() : context.GetStreamRing(stream_id);
+        }
+      }
       int GetDciFromEndptAddress(uint8_t endpt_address, UsbCtrl::PacketIdentification direction) {
         assert(endpt_address >= 1);
         int dci = (endpt_address - 1) * 2 + 2;
@@ -1450,12 +2891,67 @@ private:
     } _input_context;
 
     DevXhci * const _hc;
-    int _slot_id;
+    // serializes operations on the slot (input context and commands for the slot)
+    pthread_mutex_t _lock;
+    // 0 until Enable Slot Command completes
+    int _slot_id = 0;
+    int _interrupter_target = 0;
     const int _root_port_id;
-    DevUsb *_dev_usb;
+    // descriptors are fetched once by the probe thread, and shared by the drivers bound to the interfaces
+    UsbDevice *_usb_device = nullptr;
+    static const int kMaxDevUsb = 16;
+    DevUsb *_dev_usb[kMaxDevUsb];
+    int _num_dev_usb = 0;
     uint32_t _route_string;
 
+    // state of the enumeration. only the enumeration thread (or the probe thread) touches it until it finishes.
+    EnumerationState _enumeration_state = EnumerationState::kEnableSlot;
+    EnumerationCommandHandler _command_handler;
+    EnumerationTransferCompletion _transfer_completion;
+    CommandRing::CompletionInfo _command_info;
+    bool _transfer_success;
+    // taken from DmaBufferPool while a control transfer of the enumeration is in flight
+    DmaBuffer *_enumeration_buf = nullptr;
+    // downstream devices if the device is a hub. indexed by port id (1 origin).
+    Device **_children = nullptr;
+    int _num_hub_ports = 0;
+    // the device is a high-speed hub whose multiple TT interface is selected
+    bool _multi_tt_hub = false;
+    // TT information of the slot context (Table 57, 59)
+    int _tt_hub_slot_id = 0;
+    int _tt_port_number = 0;
+    bool _mtt = false;
+    static const int kRouteStringTiers = 5;
+
+    // the device holds the default address of the bus
+    bool _default_address_locked = false;
+    // set (with _lock) when the enumeration finishes
+    bool _enumerated = false;
+    pthread_cond_t _enumeration_cond;
+    // see BeginRecovery()
+    bool _releasing = false;
+    int _recoveries = 0;
+    pthread_cond_t _recovery_cond;
+
     virtual UsbCtrl::PortSpeed GetPortSpeed() = 0;
+    // the value of the Speed field of the Slot Context
+    virtual int GetSpeedId() {
+      // Table 157: Default USB Speed ID Mapping
+      switch(GetPortSpeed()) {
+      case UsbCtrl::PortSpeed::kFullSpeed:
+        return 1;
+      case UsbCtrl::PortSpeed::kLowSpeed:
+        return 2;
+      case UsbCtrl::PortSpeed::kHighSpeed:
+        return 3;
+      case UsbCtrl::PortSpeed::kSuperSpeed:
+        return 4;
+      case UsbCtrl::PortSpeed::kSuperSpeedPlus:
+        return 5;
+      default:
+        return 0;
+      }
+    }
     virtual ReturnState SetRouteString() = 0;
     virtual void Reset() = 0;
   };
@@ -1469,6 +2965,11 @@ private:
       return _hc->GetPortSpeed(_root_port_id);
     }
   private:
+    // the PSIV of the root port is passed as is, since the PSI table may define it
+    // differently from Table 157 (see 7.2.2.1.1)
+    virtual int GetSpeedId() override {
+      return _hc->GetPortSpeedId(_root_port_id);
+    }
     virtual ReturnState SetRouteString() override {
       _route_string = 0;
       return ReturnState::kSuccess;
@@ -1481,28 +2982,29 @@ private:
   class HubPortDevice : public Device {
   public:
     HubPortDevice() = delete;
-    HubPortDevice(DevXhci *hc, Device *parent, Hub *hub, int hub_port_id) : Device(hc, parent->GetRootPortId()), _parent(parent), _hub(hub), _hub_port_id(hub_port_id) {
+    // speed: speed of the port. cached, since asking the hub blocks the enumeration thread.
+    HubPortDevice(DevXhci *hc, Device *parent, Hub *hub, int hub_port_id, UsbCtrl::PortSpeed speed) : Device(hc, parent->GetRootPortId()), _parent(parent), _hub(hub), _hub_port_id(hub_port_id), _speed(speed) {
+      if (speed == UsbCtrl::PortSpeed::kLowSpeed || speed == UsbCtrl::PortSpeed::kFullSpeed) {
+        parent->GetTtForChild(hub_port_id, _tt_hub_slot_id, _tt_port_number, _mtt);
+      }
     }
     virtual UsbCtrl::PortSpeed GetPortSpeed() override {
-      return _hub->GetPortSpeed(_hub_port_id);
+      return _speed;
     }
   private:
     Device *_parent;
     Hub *_hub;
     int _hub_port_id;
+    const UsbCtrl::PortSpeed _speed;
     virtual ReturnState SetRouteString() override {
       uint32_t parent_string = _parent->GetRouteString();
-      int offset = 0;
-      while(offset < 32) {
-        if (((parent_string >> 4) & 0xF) == 0) {
-          break;
-        }
-        offset += 4;
-      }
-      if (offset == 32) {
+      int depth = _parent->GetHubDepth();
+      if (depth == kRouteStringTiers) {
+        // too many tiers
         return ReturnState::kErrNoHwResource;
       }
-      _route_string = parent_string | (((_hub_port_id > 0xF) ? 0xF : _hub_port_id) << offset);
+      // ports above 15 are represented as 15
+      _route_string = parent_string | (((_hub_port_id > 0xF) ? 0xF : _hub_port_id) << (depth * 4));
       return ReturnState::kSuccess;
     }
     virtual void Reset() override {
@@ -1510,8 +3012,29 @@ private:
     }
   };
 
-  uint8_t GetSlotType(int root_port_id);
+  uint8_t GetSlotType(int root_port_id) {
+    return _ext_caps.GetSlotType(root_port_id);
+  }
   void SetupScratchPad();
+  void RunInterrupter(int index);
+  void WaitInterrupt(int index);
+  void WakeupInterrupters();
+  void PollEvents(int index);
+
+  struct ContainerForInterrupterThread {
+    DevXhci *that;
+    int index;
+  };
+  static void *HandleInterrupter(void *arg) {
+    ContainerForInterrupterThread *container = reinterpret_cast<ContainerForInterrupterThread *>(arg);
+    container->that->RunInterrupter(container->index);
+    return nullptr;
+  }
+  // completions of the slot are delivered to this interrupter by default.
+  // commands and port status changes always go to the primary interrupter.
+  int GetDefaultInterrupterTarget(int slot_id) {
+    return slot_id % _num_interrupters;
+  }
 
   void HandlePortStatusChange(int root_port_id) {
     int max_ports = MaskValue<CapReg32HcsParams1MaxPorts>(_capreg_base_addr32[kCapReg32OffsetHcsParams1]);
@@ -1531,62 +3054,102 @@ private:
   static void *AttachAll(void *arg) {
     DevXhci *that = reinterpret_cast<DevXhci *>(arg);
     
-    pthread_mutex_lock(&that->_mp);
-
     that->AttachAllSub();
 
-    pthread_mutex_unlock(&that->_mp);
-
     return nullptr;
   }
   void AttachAllSub();
   void Attach(int root_port_id);
   void Reset(int root_port_id);
+  // Reset() consists of the following steps, so that ports can be reset in parallel
+  void StartReset(int root_port_id);
+  bool IsResetCompleted(int root_port_id);
+  void FinishReset(int root_port_id);
 
-  UsbCtrl::PortSpeed GetPortSpeed(int root_port_id) {
-    volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
-    // Table 157: Default USB Speed ID Mapping
-    switch (MaskValue<OpRegPortscPortSpeed>(*portsc)) {
-    case 1: {
-      return UsbCtrl::PortSpeed::kFullSpeed;
-    }
-    case 2: {
-      return UsbCtrl::PortSpeed::kLowSpeed;
-    }
-    case 3: {
-      return UsbCtrl::PortSpeed::kHighSpeed;
-    }
-    case 4: {
-      return UsbCtrl::PortSpeed::kSuperSpeed;
-    }
-    case 5: {
-      return UsbCtrl::PortSpeed::kSuperSpeedPlus;
-    }
-    default: {
-      return UsbCtrl::PortSpeed::kUnknown;
+  static void *HandleEnumeration(void *arg) {
+    DevXhci *that = reinterpret_cast<DevXhci *>(arg);
+    while(true) {
+      that->_enumeration_queue.Pop()->AdvanceEnumeration();
     }
+    return nullptr;
+  }
+  // called from the event handler when a step of the enumeration completes
+  void QueueEnumeration(Device *device) {
+    if (!_enumeration_queue.Push(device)) {
+      printf("xhci: error: enumeration queue overflow\n");
+      assert(false);
     }
   }
 
+  UsbCtrl::PortSpeed GetPortSpeed(int root_port_id) {
+    return _ext_caps.DecodePortSpeed(root_port_id, GetPortSpeedId(root_port_id));
+  }
+
+  // Port Speed field of PORTSC (PSIV)
+  int GetPortSpeedId(int root_port_id) {
+    volatile uint32_t *portsc = &_opreg_base_addr[kOpRegOffsetPortsc + (root_port_id - 1) * 4];
+    return MaskValue<OpRegPortscPortSpeed>(*portsc);
+  }
+
   void Detach(int root_port_id);
 
   void RingCommandDoorbell() {
     _doorbell_array_base_addr[0] = 0;
   }
 
-  void RingEndpointDoorbell(int slot_id, uint8_t target) {
+  void RingEndpointDoorbell(int slot_id, uint8_t target, int stream_id = 0) {
     _doorbell_array_base_addr[slot_id]
       = GenerateValue<DoorbellRegDbTarget, uint32_t>(target)
-      | GenerateValue<DoorbellRegDbStreamId, uint32_t>(0);
+      | GenerateValue<DoorbellRegDbStreamId, uint32_t>(stream_id);
+  }
+
+  // ring the doorbell now, or mark it pending while a submission batch is open on this thread.
+  // slot_id 0 is the command ring (target should be 0).
+  // the pending bitmap has no room for stream IDs, so a doorbell of a stream is rung immediately.
+  void RequestDoorbell(int slot_id, uint8_t target, int stream_id = 0) {
+    if (stream_id != 0) {
+      RingEndpointDoorbell(slot_id, target, stream_id);
+      return;
+    }
+    if (_submission_batch_depth == 0) {
+      if (slot_id == 0) {
+        RingCommandDoorbell();
+      } else {
+        RingEndpointDoorbell(slot_id, target);
+      }
+      return;
+    }
+    // the slot bit is set after the target bit, so that a flush which sees the slot bit also sees the target bit
+    _pending_doorbell[slot_id].fetch_or(1U << target, std::memory_order_release);
+    _pending_doorbell_slots[slot_id / 64].fetch_or(1ULL << (slot_id % 64), std::memory_order_release);
+  }
+  // ring all pending doorbells. each doorbell is written once, however many TRBs were queued.
+  void FlushDoorbells();
+
+  // Isochronous Scheduling Threshold in frames (rounded up).
+  // the controller may have fetched isoch TDs up to this far ahead of the current frame.
+  int GetIstFrames() {
+    return _ist_frames;
+  }
+  // current 1ms frame, which wraps around in the same range as Frame ID of Isoch TRBs
+  int GetFrameIndex() {
+    return MaskValue<RunRegMfindexMicroframeIndex, uint32_t>(_runtime_base_addr[kRunRegOffsetMfindex]) >> 3;
   }
 
   void CompleteCommand(phys_addr pointer, CommandRing::CompletionInfo &info) {
-    _command_ring.CompleteCommand(_command_ring.GetIndexFromEntryAddr(pointer), info);
+    _command_ring.CompleteCommand(pointer, info);
   }
 
   void CompleteTransfer(phys_addr pointer, TransferRing::CompletionInfo &info) {
-    assert(_device_list[info.slot_id] != nullptr);
-    _device_list[info.slot_id]->CompleteTransfer(pointer, info);
+    pthread_rwlock_rdlock(&_device_list_lock);
+    Device *device = _device_list[info.slot_id];
+    if (device != nullptr) {
+      device->CompleteTransfer(pointer, info);
+    } else {
+      // the slot was disabled after the transfer was issued
+      printf("xhci: warning: transfer event for a removed slot (%d)\n", info.slot_id);
+    }
+    pthread_rwlock_unlock(&_device_list_lock);
   }
 
   void SetDcbaap(phys_addr pointer, uint8_t slot_id) {
@@ -1595,23 +3158,44 @@ private:
   }
 
   void RegisterDevice(Device *device) {
+    pthread_rwlock_wrlock(&_device_list_lock);
     _device_list[device->GetSlotId()] = device;
+    pthread_rwlock_unlock(&_device_list_lock);
   }
   
+  // no event handler touches the device after return
   void UnRegisterDevice(Device *device) {
+    pthread_rwlock_wrlock(&_device_list_lock);
     _device_list[device->GetSlotId()] = nullptr;
+    pthread_rwlock_unlock(&_device_list_lock);
   }
 
+  // called from the event handler.
+  // a port is queued at most once until the worker picks it up, since PORTSC is read when handled.
+  void QueuePortStatusChange(int root_port_id) {
+    assert(root_port_id >= 1 && root_port_id <= kMaxPorts);
+    if (_port_status_change_pending[root_port_id].exchange(true)) {
+      // coalesced
+      return;
+    }
+    if (!_port_status_change_queue.Push(root_port_id)) {
+      // never happens, since each port is queued at most once
+      printf("xhci: error: port status change queue overflow\n");
+      assert(false);
+    }
+  }
   static void *HandlePortStatusChange(void *arg) {
-    ContainerForPortStatusChangeHandler *container = reinterpret_cast<ContainerForPortStatusChangeHandler *>(arg);
-    
-    pthread_mutex_lock(&container->that->_mp);
-
-    container->that->HandlePortStatusChange(container->root_port_id);
-
-    pthread_mutex_unlock(&container->that->_mp);
+    DevXhci *that = reinterpret_cast<DevXhci *>(arg);
+    while(true) {
+      int root_port_id = that->_port_status_change_queue.Pop();
+      // events after this point are queued again
+      that->_port_status_change_pending[root_port_id] = false;
 
-    delete container;
+      pthread_mutex_lock(&that->_root_port_lock[root_port_id]);
+      that->HandlePortStatusChange(root_port_id);
+      pthread_mutex_unlock(&that->_root_port_lock[root_port_id]);
+    }
+    return nullptr;
   }
 
   DevPci _pci;
@@ -1620,12 +3204,126 @@ private:
   Memory *_scratchpad_array_mem;
   Memory *_scratchpad_mem;
   CommandRing _command_ring;
-  EventRing _event_ring;
-  EventRingSegmentTable _event_ring_segment_table;
-  Interrupter _interrupter;
+  EventRing _event_ring[kMaxInterrupters];
+  EventRingSegmentTable _event_ring_segment_table[kMaxInterrupters];
+  Interrupter _interrupter[kMaxInterrupters];
+  int _num_interrupters = 1;
+  int _interrupter_core[kMaxInterrupters] = {-1, -1, -1, -1, -1, -1, -1, -1};
+  // wakeup of the secondary interrupters (INTx is shared, so the primary one dispatches)
+  sem_t _interrupter_wakeup[kMaxInterrupters];
+  std::atomic<bool> _interrupter_sleeping[kMaxInterrupters];
+  // doorbells deferred by submission batches.
+  // _pending_doorbell: bitmap of targets per slot, _pending_doorbell_slots: bitmap of slots which have pending targets
+  static const int kDoorbellNum = 256;
+  std::atomic<uint32_t> _pending_doorbell[kDoorbellNum];
+  std::atomic<uint64_t> _pending_doorbell_slots[kDoorbellNum / 64];
+  static thread_local int _submission_batch_depth;
+  // MaxPorts is 8 bits wide
+  static const int kMaxPorts = 255;
+
+  // extended capabilities, parsed once at Init (see 7)
+  class ExtendedCapabilities {
+  public:
+    // Protocol Speed ID (7.2.1)
+    struct ProtocolSpeed {
+      uint8_t value;
+      // bit/s
+      uint64_t bitrate;
+      // 0: symmetric, 2: asymmetric Rx, 3: asymmetric Tx
+      uint8_t type;
+      bool full_duplex;
+    };
+    struct SupportedProtocol {
+      uint8_t major_revision;
+      uint8_t minor_revision;
+      uint8_t slot_type;
+      int port_offset;
+      int port_count;
+      int num_speeds;
+      ProtocolSpeed speeds[15];
+    };
+    ExtendedCapabilities() {
+      for (int i = 0; i <= kMaxPorts; i++) {
+        _port_protocol[i] = -1;
+      }
+    }
+    // should be called before the controller is reset, so that the BIOS releases the controller first
+    void Init(volatile uint32_t *base);
+    // return: nullptr if no Supported Protocol capability covers the port
+    const SupportedProtocol *GetProtocol(int root_port_id) {
+      assert(root_port_id >= 1 && root_port_id <= kMaxPorts);
+      int index = _port_protocol[root_port_id];
+      return (index < 0) ? nullptr : &_protocols[index];
+    }
+    uint8_t GetSlotType(int root_port_id) {
+      const SupportedProtocol *protocol = GetProtocol(root_port_id);
+      assert(protocol != nullptr);
+      return protocol->slot_type;
+    }
+    // psiv: Port Speed field of PORTSC
+    UsbCtrl::PortSpeed DecodePortSpeed(int root_port_id, int psiv);
+    bool HasLegacySupport() {
+      return _legacy_support;
+    }
+    bool IsOsOwned() {
+      return _os_owned;
+    }
+    // return: nullptr if the controller does not have the vendor defined capability
+    volatile uint32_t *GetVendorCapability(uint8_t id) {
+      for (int i = 0; i < _num_vendor_caps; i++) {
+        if (_vendor_caps[i].id == id) {
+          return _vendor_caps[i].base;
+        }
+      }
+      return nullptr;
+    }
+  private:
+    static const int kMaxProtocols = 16;
+    static const int kMaxVendorCaps = 16;
+    // 4.22.1: the BIOS should release the ownership within 1 second
+    static const int kOwnershipTimeout = 1000;
+    void ParseSupportedProtocol(volatile uint32_t *base);
+    void TakeOwnership(volatile uint32_t *base);
+    static UsbCtrl::PortSpeed GetDefaultPortSpeed(int psiv);
+    SupportedProtocol _protocols[kMaxProtocols];
+    int _num_protocols = 0;
+    // index of _protocols for each root port (-1: none)
+    int8_t _port_protocol[kMaxPorts + 1];
+    bool _legacy_support = false;
+    bool _os_owned = false;
+    struct VendorCapability {
+      uint8_t id;
+      volatile uint32_t *base;
+    };
+    VendorCapability _vendor_caps[kMaxVendorCaps];
+    int _num_vendor_caps = 0;
+  } _ext_caps;
+  // root ports whose status changed. served by a single worker thread in the order of events.
+  MpscRingBuffer<int> _port_status_change_queue{kMaxPorts + 1, RingBufferWaitStrategy::kBlocking};
+  std::atomic<bool> _port_status_change_pending[kMaxPorts + 1];
   Device **_device_list;
   RootPortDevice **_root_hub_device_list;
   int _max_slots;
-
-  pthread_mutex_t _mp;
+  // max number of entries of a Primary Stream Context Array (0: streams are not supported)
+  int _max_psa_size;
+  int _ist_frames;
+  PollMode _poll_mode = PollMode::kInterrupt;
+  int _poll_idle_budget_us = kDefaultPollIdleBudgetUs;
+  int _event_budget = kDefaultEventBudget;
+
+  // _device_list is read by the event handlers, and written on attach/detach
+  pthread_rwlock_t _device_list_lock;
+  // serializes attach/detach of each root port
+  pthread_mutex_t *_root_port_lock;
+  // see LockDefaultAddress(). each root port is a bus with its own default address.
+  // the ownership moves from the hub driver to the enumeration thread,
+  // so the locks are flags (indexed by root port) guarded by the mutex.
+  pthread_mutex_t _default_address_lock;
+  pthread_cond_t _default_address_cond;
+  bool *_default_address_busy;
+  void LockDefaultAddressOfRootPort(int root_port_id);
+  void UnlockDefaultAddressOfRootPort(int root_port_id);
+  // devices whose pending enumeration step has completed. consumed by the enumeration thread.
+  // a device has at most one pending step, so the queue never holds more than the number of slots.
+  MpscRingBuffer<Device *> _enumeration_queue{kDoorbellNum, RingBufferWaitStrategy::kBlocking};
 };